@@ -0,0 +1,510 @@
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include "action.h"
+#include "hsb_error.h"
+#include "hsb_config.h"
+#include "thread_utils.h"
+#include "obj_pool.h"
+#include "debug.h"
+
+/*
+ * Device actions run on one lane per driver, so a slow radio only delays
+ * its own devices. Within a lane every device has its own queue and at
+ * most one running action, which keeps per-device order while the lane
+ * workers serve different devices in parallel.
+ *
+ * A set-status queued behind another one of the same device and status
+ * ids only overwrites the values of the queued one and rides along in its
+ * merged list, so the driver sends the latest value once and every
+ * request still gets the result.
+ *
+ * Ready devices wait in one list per priority class of their next
+ * action. Workers take the highest class first, unless a lower class has
+ * waited past HSB_ACT_AGING_USEC. Alarm actions skip the device queue
+ * and the aging rule, they only wait for an action already running.
+ */
+
+typedef struct {
+	uint32_t		devid;
+	GQueue			actq;	/* HSB_ACT_T linked through act->node */
+	bool			busy;	/* a worker runs one of its actions */
+	int			prio;	/* readyq it sits in */
+	GList			node;	/* link in lane->readyq[prio] */
+} HSB_ACT_DEV_T;
+
+typedef struct {
+	uint32_t		drvid;
+	int			workers;
+
+	GMutex			mutex;
+	GCond			cond;
+	GQueue			readyq[HSB_ACT_PRIO_NUM];	/* devices with work and no worker */
+	guint			ready;
+	GHashTable		*dev_table;	/* devid -> HSB_ACT_DEV_T */
+
+	/* statistics */
+	guint			depth;
+	guint			max_depth;
+	guint64			done;
+	guint64			merged;		/* transactions saved */
+	gint64			wait_total;	/* usec */
+	gint64			wait_max;
+} HSB_ACT_LANE_T;
+
+static HSB_ACT_LANE_T gl_lanes[HSB_DRV_ID_LAST];
+static obj_pool *gl_act_pool = NULL;
+
+/* enqueue to completion latency per class */
+static gint gl_latency_hist[HSB_ACT_PRIO_NUM][HSB_ACT_HIST_NUM];
+
+static const char *gl_prio_name[HSB_ACT_PRIO_NUM] = {
+	"alarm",
+	"interactive",
+	"automation",
+	"maintenance",
+};
+
+static int gl_lane_workers[HSB_DRV_ID_LAST] = {
+	[0] = HSB_ACT_WORKERS_DEFAULT,
+	[HSB_DRV_ID_CJ_WIFI] = HSB_ACT_WORKERS_CJ_WIFI,
+	[HSB_DRV_ID_CJ_ZIGBEE] = HSB_ACT_WORKERS_CJ_ZIGBEE,
+	[HSB_DRV_ID_IR] = HSB_ACT_WORKERS_IR,
+};
+
+static uint32_t _act_devid(const HSB_ACT_T *act)
+{
+	switch (act->type) {
+		case HSB_ACT_TYPE_SET_STATUS:
+		case HSB_ACT_TYPE_GET_STATUS:
+			return act->u.status.devid;
+		case HSB_ACT_TYPE_DO_ACTION:
+			return act->u.action.devid;
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+static int _act_prio(const HSB_ACT_T *act)
+{
+	if (HSB_ACT_TYPE_PROBE == act->type)
+		return HSB_ACT_PRIO_MAINTENANCE;
+
+	if (act->reply)
+		return HSB_ACT_PRIO_INTERACTIVE;
+
+	return HSB_ACT_PRIO_AUTOMATION;
+}
+
+static void _record_latency(int prio, gint64 usec)
+{
+	int bucket = 0;
+	gint64 limit = 1000;
+
+	while (bucket < HSB_ACT_HIST_NUM - 1 && usec >= limit) {
+		bucket++;
+		limit <<= 1;
+	}
+
+	g_atomic_int_inc(&gl_latency_hist[prio][bucket]);
+}
+
+/* the ready list helpers below must be called with lane->mutex held */
+static void _ready_dev(HSB_ACT_LANE_T *lane, HSB_ACT_DEV_T *adev)
+{
+	HSB_ACT_T *head = (HSB_ACT_T *)adev->actq.head->data;
+
+	adev->prio = head->prio;
+	g_queue_push_tail_link(&lane->readyq[adev->prio], &adev->node);
+	lane->ready++;
+}
+
+static HSB_ACT_DEV_T *_pick_ready_dev(HSB_ACT_LANE_T *lane)
+{
+	gint64 now = g_get_monotonic_time();
+	HSB_ACT_DEV_T *adev;
+	GList *node;
+	int prio;
+
+	node = lane->readyq[HSB_ACT_PRIO_ALARM].head;
+	if (node) {
+		prio = HSB_ACT_PRIO_ALARM;
+		adev = (HSB_ACT_DEV_T *)node->data;
+		goto _out;
+	}
+
+	/* starvation guard, lowest class first */
+	for (prio = HSB_ACT_PRIO_NUM - 1; prio > HSB_ACT_PRIO_INTERACTIVE; prio--) {
+		node = lane->readyq[prio].head;
+		if (!node)
+			continue;
+
+		adev = (HSB_ACT_DEV_T *)node->data;
+		if (now - ((HSB_ACT_T *)adev->actq.head->data)->enq_time > HSB_ACT_AGING_USEC)
+			goto _out;
+	}
+
+	for (prio = 0; prio < HSB_ACT_PRIO_NUM; prio++) {
+		node = lane->readyq[prio].head;
+		if (node)
+			break;
+	}
+
+	adev = (HSB_ACT_DEV_T *)node->data;
+
+_out:
+	g_queue_unlink(&lane->readyq[prio], node);
+	lane->ready--;
+
+	return adev;
+}
+
+static HSB_ACT_LANE_T *_select_lane(const HSB_ACT_T *act, uint32_t devid)
+{
+	uint32_t drvid = 0;
+	HSB_DEV_T *pdev;
+
+	if (HSB_ACT_TYPE_PROBE == act->type) {
+		drvid = act->u.probe.drvid;
+	} else if (devid) {
+		pdev = get_dev(devid);
+		if (pdev) {
+			drvid = pdev->drvid;
+			put_dev(pdev);
+		}
+	}
+
+	if (drvid >= HSB_DRV_ID_LAST)
+		drvid = 0;
+
+	return &gl_lanes[drvid];
+}
+
+/* fold @act into the queued @tail when it sets the same status ids */
+static bool _merge_status(HSB_ACT_LANE_T *lane, HSB_ACT_DEV_T *adev,
+			HSB_ACT_T *tail, HSB_ACT_T *act)
+{
+	HSB_STATUS_T *dst = &tail->u.status;
+	HSB_STATUS_T *src = &act->u.status;
+	int cnt, id;
+
+	if (HSB_ACT_TYPE_SET_STATUS != tail->type ||
+	    HSB_ACT_TYPE_SET_STATUS != act->type)
+		return false;
+
+	/* batch items report into their own slot */
+	if (tail->batch || act->batch)
+		return false;
+
+	/* the box work mode handler only looks at the first entry */
+	if (0 == src->devid || src->num > 8)
+		return false;
+
+	for (cnt = 0; cnt < src->num; cnt++) {
+		for (id = 0; id < dst->num; id++) {
+			if (dst->id[id] == src->id[cnt])
+				break;
+		}
+
+		if (id == dst->num)
+			return false;
+	}
+
+	for (cnt = 0; cnt < src->num; cnt++) {
+		for (id = 0; id < dst->num; id++) {
+			if (dst->id[id] == src->id[cnt])
+				dst->val[id] = src->val[cnt];
+		}
+	}
+
+	g_queue_push_tail_link(&tail->merged, &act->node);
+
+	/* a merged client request lifts the queued one to its class */
+	if (act->prio < tail->prio) {
+		tail->prio = act->prio;
+
+		if (!adev->busy && adev->actq.head == &tail->node) {
+			g_queue_unlink(&lane->readyq[adev->prio], &adev->node);
+			lane->ready--;
+			_ready_dev(lane, adev);
+		}
+	}
+
+	return true;
+}
+
+static void _free_act(HSB_ACT_T *act)
+{
+	GList *node;
+
+	while ((node = g_queue_pop_head_link(&act->merged)))
+		obj_pool_free(gl_act_pool, node->data);
+
+	obj_pool_free(gl_act_pool, act);
+}
+
+static void *_lane_thread(HSB_ACT_LANE_T *lane)
+{
+	HSB_ACT_DEV_T *adev;
+	HSB_ACT_T *act;
+	gint64 wait;
+
+	g_mutex_lock(&lane->mutex);
+
+	while (1) {
+		while (0 == lane->ready)
+			g_cond_wait(&lane->cond, &lane->mutex);
+
+		adev = _pick_ready_dev(lane);
+		act = (HSB_ACT_T *)g_queue_pop_head_link(&adev->actq)->data;
+		adev->busy = true;
+
+		wait = g_get_monotonic_time() - act->enq_time;
+
+		lane->depth--;
+		lane->done++;
+		lane->wait_total += wait;
+		if (wait > lane->wait_max)
+			lane->wait_max = wait;
+
+		g_mutex_unlock(&lane->mutex);
+
+		_process_dev_act(act);
+
+		_record_latency(act->prio, g_get_monotonic_time() - act->enq_time);
+
+		_free_act(act);
+
+		g_mutex_lock(&lane->mutex);
+
+		adev->busy = false;
+
+		if (!g_queue_is_empty(&adev->actq)) {
+			/* back of the line, other devices of the lane go first */
+			_ready_dev(lane, adev);
+		} else {
+			g_hash_table_remove(lane->dev_table, GUINT_TO_POINTER(adev->devid));
+			g_slice_free(HSB_ACT_DEV_T, adev);
+		}
+	}
+
+	g_mutex_unlock(&lane->mutex);
+
+	return NULL;
+}
+
+/* takes effect at init_action(), clamped to 1..HSB_ACT_MAX_WORKERS there */
+int set_act_workers(int drvid, int workers)
+{
+	if (drvid < 0 || drvid >= HSB_DRV_ID_LAST)
+		return HSB_E_BAD_PARAM;
+
+	gl_lane_workers[drvid] = workers;
+
+	return HSB_E_OK;
+}
+
+int init_action(void)
+{
+	HSB_ACT_LANE_T *lane;
+	pthread_t thread_id;
+	int id, cnt;
+
+	gl_act_pool = obj_pool_new("action", sizeof(HSB_ACT_T), HSB_ACT_POOL_SIZE);
+
+	for (id = 0; id < HSB_DRV_ID_LAST; id++) {
+		lane = &gl_lanes[id];
+
+		lane->drvid = id;
+		lane->workers = gl_lane_workers[id];
+		if (lane->workers <= 0)
+			lane->workers = HSB_ACT_WORKERS_DEFAULT;
+		else if (lane->workers > HSB_ACT_MAX_WORKERS)
+			lane->workers = HSB_ACT_MAX_WORKERS;
+
+		g_mutex_init(&lane->mutex);
+		g_cond_init(&lane->cond);
+		for (cnt = 0; cnt < HSB_ACT_PRIO_NUM; cnt++)
+			g_queue_init(&lane->readyq[cnt]);
+		lane->dev_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+		for (cnt = 0; cnt < lane->workers; cnt++) {
+			if (pthread_create(&thread_id, NULL, (thread_entry_func)_lane_thread, lane))
+			{
+				hsb_critical("create lane %d worker failed\n", id);
+				return HSB_E_OTHERS;
+			}
+		}
+	}
+
+	return HSB_E_OK;
+}
+
+/* request id and connection of the client command this thread handles */
+static __thread uint32_t gl_req_id;
+static __thread uint32_t gl_reply_gen;
+
+void set_act_req(uint32_t req_id, uint32_t reply_gen)
+{
+	gl_req_id = req_id;
+	gl_reply_gen = reply_gen;
+}
+
+uint32_t get_act_req_id(void)
+{
+	return gl_req_id;
+}
+
+uint32_t get_act_reply_gen(void)
+{
+	return gl_reply_gen;
+}
+
+HSB_ACT_T *alloc_dev_act(void)
+{
+	HSB_ACT_T *act = (HSB_ACT_T *)obj_pool_alloc0(gl_act_pool);
+
+	if (act) {
+		act->req_id = gl_req_id;
+		act->reply_gen = gl_reply_gen;
+	}
+
+	return act;
+}
+
+static int _push_act(HSB_ACT_T *act, bool alarm)
+{
+	uint32_t devid = _act_devid(act);
+	HSB_ACT_LANE_T *lane = _select_lane(act, devid);
+	HSB_ACT_DEV_T *adev;
+
+	act->enq_time = g_get_monotonic_time();
+	act->prio = alarm ? HSB_ACT_PRIO_ALARM : _act_prio(act);
+	act->node.data = act;
+	g_queue_init(&act->merged);
+
+	g_mutex_lock(&lane->mutex);
+
+	adev = g_hash_table_lookup(lane->dev_table, GUINT_TO_POINTER(devid));
+	if (!adev) {
+		adev = g_slice_new0(HSB_ACT_DEV_T);
+		adev->devid = devid;
+		adev->node.data = adev;
+		g_queue_init(&adev->actq);
+
+		g_hash_table_insert(lane->dev_table, GUINT_TO_POINTER(devid), adev);
+	}
+
+	if (alarm) {
+		GList *node;
+		guint pos = 0;
+
+		/* jump the device queue, move it up if it already waits */
+		if (!adev->busy && adev->actq.length) {
+			g_queue_unlink(&lane->readyq[adev->prio], &adev->node);
+			lane->ready--;
+		}
+
+		/* behind the alarms already queued, they run in arrival order */
+		for (node = adev->actq.head; node; node = node->next, pos++) {
+			if (((HSB_ACT_T *)node->data)->prio != HSB_ACT_PRIO_ALARM)
+				break;
+		}
+
+		g_queue_push_nth_link(&adev->actq, pos, &act->node);
+
+		if (!adev->busy) {
+			_ready_dev(lane, adev);
+			g_cond_signal(&lane->cond);
+		}
+	} else {
+		if (adev->actq.tail && _merge_status(lane, adev, adev->actq.tail->data, act)) {
+			lane->merged++;
+			g_mutex_unlock(&lane->mutex);
+			return HSB_E_OK;
+		}
+
+		g_queue_push_tail_link(&adev->actq, &act->node);
+
+		if (!adev->busy && 1 == adev->actq.length) {
+			_ready_dev(lane, adev);
+			g_cond_signal(&lane->cond);
+		}
+	}
+
+	lane->depth++;
+	if (lane->depth > lane->max_depth)
+		lane->max_depth = lane->depth;
+
+	g_mutex_unlock(&lane->mutex);
+
+	return HSB_E_OK;
+}
+
+int push_dev_act(HSB_ACT_T *act)
+{
+	return _push_act(act, false);
+}
+
+int push_alarm_act(HSB_ACT_T *act)
+{
+	return _push_act(act, true);
+}
+
+int get_action_stats(char *buf, int len)
+{
+	HSB_ACT_LANE_T *lane;
+	guint depth, max_depth;
+	guint64 done, merged;
+	gint64 wait_total, wait_max;
+	int id, off = 0;
+
+	for (id = 0; id < HSB_DRV_ID_LAST && off < len; id++) {
+		lane = &gl_lanes[id];
+
+		g_mutex_lock(&lane->mutex);
+		depth = lane->depth;
+		max_depth = lane->max_depth;
+		done = lane->done;
+		merged = lane->merged;
+		wait_total = lane->wait_total;
+		wait_max = lane->wait_max;
+		g_mutex_unlock(&lane->mutex);
+
+		off += snprintf(buf + off, len - off,
+			"lane %d: workers %d depth %u max %u done %llu merged %llu wait avg %lldus max %lldus\n",
+			id, lane->workers, depth, max_depth,
+			(unsigned long long)done, (unsigned long long)merged,
+			(long long)(done ? wait_total / done : 0),
+			(long long)wait_max);
+	}
+
+	return (off < len) ? off : len - 1;
+}
+
+int get_action_latency_stats(char *buf, int len)
+{
+	int prio, bucket, off = 0;
+
+	for (prio = 0; prio < HSB_ACT_PRIO_NUM && off < len; prio++) {
+		off += snprintf(buf + off, len - off, "%s:", gl_prio_name[prio]);
+
+		for (bucket = 0; bucket < HSB_ACT_HIST_NUM && off < len; bucket++) {
+			off += snprintf(buf + off, len - off, " %s%dms %d",
+				(bucket == HSB_ACT_HIST_NUM - 1) ? ">=" : "<",
+				(bucket == HSB_ACT_HIST_NUM - 1) ? (1 << (bucket - 1)) : (1 << bucket),
+				g_atomic_int_get(&gl_latency_hist[prio][bucket]));
+		}
+
+		if (off < len)
+			off += snprintf(buf + off, len - off, "\n");
+	}
+
+	return (off < len) ? off : len - 1;
+}
@@ -0,0 +1,47 @@
+#ifndef _ACTION_H_
+#define _ACTION_H_
+
+#include <glib.h>
+#include <stdint.h>
+#include "device.h"
+
+/*
+ * Default worker threads per driver lane, lane 0 serves the box and
+ * unknown devices. set_act_workers() overrides them before init.
+ */
+#define HSB_ACT_WORKERS_DEFAULT		(1)
+#define HSB_ACT_WORKERS_CJ_WIFI		(4)
+#define HSB_ACT_WORKERS_CJ_ZIGBEE	(1)	/* one request in flight on the radio */
+#define HSB_ACT_WORKERS_IR		(1)
+
+#define HSB_ACT_MAX_WORKERS		(8)
+
+/* preallocated actions, more come from g_slice and show as pool fallback */
+#define HSB_ACT_POOL_SIZE		(128)
+
+typedef enum {
+	HSB_ACT_PRIO_ALARM = 0,		/* guard mode alarm reactions */
+	HSB_ACT_PRIO_INTERACTIVE,	/* client commands waiting for a reply */
+	HSB_ACT_PRIO_AUTOMATION,	/* linkage, timer and scene actions */
+	HSB_ACT_PRIO_MAINTENANCE,	/* probes */
+	HSB_ACT_PRIO_NUM,
+} HSB_ACT_PRIO_T;
+
+/* a ready device waiting longer than this is served ahead of its class */
+#define HSB_ACT_AGING_USEC		(2000000)
+
+/* latency histogram buckets: < 1ms, < 2ms, < 4ms ... the last one open */
+#define HSB_ACT_HIST_NUM		(12)
+
+int set_act_workers(int drvid, int workers);
+int init_action(void);
+void set_act_req(uint32_t req_id, uint32_t reply_gen);
+uint32_t get_act_req_id(void);
+uint32_t get_act_reply_gen(void);
+HSB_ACT_T *alloc_dev_act(void);
+int push_dev_act(HSB_ACT_T *act);
+int push_alarm_act(HSB_ACT_T *act);
+int get_action_stats(char *buf, int len);
+int get_action_latency_stats(char *buf, int len);
+
+#endif /* _ACTION_H_ */
@@ -0,0 +1,108 @@
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "alarm.h"
+#include "linkage.h"
+#include "network.h"
+#include "hsb_error.h"
+#include "debug.h"
+
+/*
+ * Sensor triggers in guard mode take a short path: clients are told
+ * first, ahead of anything already queued for them, then the linkage
+ * actions go out on the alarm class of the action lanes. The driver
+ * receive time rides in the notification, so the TCP send records the
+ * whole receive to send latency.
+ */
+
+typedef struct {
+	GMutex			mutex;
+
+	guint			raised;
+	guint			sent;
+	gint64			total;
+	gint64			max;
+	guint			hist[HSB_ALARM_HIST_NUM];
+} HSB_ALARM_CB_T;
+
+static HSB_ALARM_CB_T gl_alarm_cb = { 0 };
+
+/* receive time of the packet the driver thread is handling, 0 once used */
+static __thread gint64 gl_rx_time;
+
+void alarm_rx_stamp(void)
+{
+	gl_rx_time = g_get_monotonic_time();
+}
+
+int raise_alarm(const HSB_EVT_T *evt)
+{
+	HSB_RESP_T resp = { 0 };
+	int ret;
+
+	resp.type = HSB_RESP_TYPE_EVENT;
+	resp.reply = NULL;
+	resp.rx_time = gl_rx_time ? gl_rx_time : g_get_monotonic_time();
+	gl_rx_time = 0;
+	memcpy(&resp.u.event, evt, sizeof(*evt));
+
+	ret = notify_resp(&resp, NULL);
+
+	check_alarm_linkage(evt);
+
+	g_mutex_lock(&gl_alarm_cb.mutex);
+	gl_alarm_cb.raised++;
+	g_mutex_unlock(&gl_alarm_cb.mutex);
+
+	hsb_debug("alarm: %d, %d\n", evt->devid, evt->param1);
+
+	return ret;
+}
+
+void alarm_sent(const HSB_RESP_T *resp)
+{
+	gint64 usec = g_get_monotonic_time() - resp->rx_time;
+	gint64 limit = HSB_ALARM_HIST_BASE_USEC;
+	int bucket = 0;
+
+	while (bucket < HSB_ALARM_HIST_NUM - 1 && usec >= limit) {
+		bucket++;
+		limit <<= 1;
+	}
+
+	g_mutex_lock(&gl_alarm_cb.mutex);
+
+	gl_alarm_cb.sent++;
+	gl_alarm_cb.total += usec;
+	if (usec > gl_alarm_cb.max)
+		gl_alarm_cb.max = usec;
+	gl_alarm_cb.hist[bucket]++;
+
+	g_mutex_unlock(&gl_alarm_cb.mutex);
+}
+
+int get_alarm_stats(char *buf, int len)
+{
+	int bucket, off;
+
+	g_mutex_lock(&gl_alarm_cb.mutex);
+
+	off = snprintf(buf, len, "alarm: raised %u sent %u avg %lldus max %lldus\n",
+			gl_alarm_cb.raised, gl_alarm_cb.sent,
+			gl_alarm_cb.sent ? (long long)(gl_alarm_cb.total / gl_alarm_cb.sent) : 0LL,
+			(long long)gl_alarm_cb.max);
+
+	for (bucket = 0; bucket < HSB_ALARM_HIST_NUM && off < len; bucket++) {
+		off += snprintf(buf + off, len - off, "%s%dus %u%s",
+			(bucket == HSB_ALARM_HIST_NUM - 1) ? ">=" : "<",
+			HSB_ALARM_HIST_BASE_USEC << ((bucket == HSB_ALARM_HIST_NUM - 1) ? bucket - 1 : bucket),
+			gl_alarm_cb.hist[bucket],
+			(bucket == HSB_ALARM_HIST_NUM - 1) ? "\n" : " ");
+	}
+
+	g_mutex_unlock(&gl_alarm_cb.mutex);
+
+	return (off < len) ? off : len - 1;
+}
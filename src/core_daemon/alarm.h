@@ -0,0 +1,17 @@
+#ifndef _ALARM_H_
+#define _ALARM_H_
+
+#include <glib.h>
+#include <stdint.h>
+#include "device.h"
+
+/* send latency buckets: < 64us, < 128us ... the last one open */
+#define HSB_ALARM_HIST_BASE_USEC	(64)
+#define HSB_ALARM_HIST_NUM		(14)
+
+void alarm_rx_stamp(void);
+int raise_alarm(const HSB_EVT_T *evt);
+void alarm_sent(const HSB_RESP_T *resp);
+int get_alarm_stats(char *buf, int len);
+
+#endif /* _ALARM_H_ */
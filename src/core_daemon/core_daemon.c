@@ -22,16 +22,55 @@
 #include "unix_socket.h"
 #include "network.h"
 #include "device.h"
+#include "timer_sched.h"
+#include "action.h"
+#include "alarm.h"
+#include "obj_pool.h"
 
+/* commands on the control socket, e.g. "stats action" from un_send */
+static void process_control_cmd(daemon_listen_data *dla)
+{
+	char reply[MAXLINE];
+	int len = 0;
+
+	if (0 == dla->reply_path[0])
+		return;
+
+	if (0 == strncmp(dla->cmd_buf, "stats", 5)) {
+		char *section = dla->cmd_buf + 5;
+
+		while (*section == ' ')
+			section++;
+
+		if (0 == *section || 0 == strcmp(section, "action"))
+			len = get_action_stats(reply, sizeof(reply));
+		else if (0 == strcmp(section, "latency"))
+			len = get_action_latency_stats(reply, sizeof(reply));
+		else if (0 == strcmp(section, "alarm"))
+			len = get_alarm_stats(reply, sizeof(reply));
+		else if (0 == strcmp(section, "pool"))
+			len = obj_pool_stats(reply, sizeof(reply));
+		else if (0 == strcmp(section, "net"))
+			len = get_network_stats(reply, sizeof(reply));
+	}
+
+	if (len <= 0)
+		len = snprintf(reply, sizeof(reply), "unknown command\n");
+
+	unix_socket_send_to(hsb_core_daemon_config.unix_listen_fd,
+			dla->reply_path, reply, len);
+}
 
 int main (int argc, char **argv)
 {
 	int opt ;
 	gboolean background = FALSE;    
+	int max_client = MAX_TCP_CLIENT_NUM;
+	int drvid, workers;
 
 	debug_verbose = DEBUG_DEFAULT_LEVEL;
 	opterr = 0;
-	while ((opt = getopt (argc, argv, "d:b")) != -1)
+	while ((opt = getopt (argc, argv, "d:bc:w:")) != -1)
 		switch (opt) {
 		case 'b':
 			background = TRUE;
@@ -39,6 +78,15 @@ int main (int argc, char **argv)
 		case 'd':
 			debug_verbose = atoi(optarg);
 			break;
+		case 'c':
+			max_client = atoi(optarg);
+			break;
+		case 'w':
+			/* -w drvid:workers, e.g. -w 1:4 for the wifi lane */
+			if (2 != sscanf(optarg, "%d:%d", &drvid, &workers) ||
+			    HSB_E_OK != set_act_workers(drvid, workers))
+				hsb_critical("bad worker option %s\n", optarg);
+			break;
 		default:
 			break;
 		}
@@ -49,7 +97,7 @@ int main (int argc, char **argv)
 		exit(0);
 	}
 
-	if (init_network_module())
+	if (init_network_module(max_client))
 	{
 		hsb_critical("init net error\n");
 		exit(0);
@@ -63,14 +111,16 @@ int main (int argc, char **argv)
 
 	daemon_listen_data dla;
 	while (1) {
-		struct timeval tv = { 1, 0 };
-again:
+		struct timeval tv;
+
+		/* sleep until the next timer or delay is due */
+		timer_sched_timeout(&tv);
+
 		daemon_select(hsb_core_daemon_config.unix_listen_fd, &tv, &dla);
-		if (dla.recv_time != 0) {
-			goto again;
-		} else {
-			check_timer_and_delay();
-		}
+		if (dla.recv_time != 0)
+			process_control_cmd(&dla);
+
+		check_timer_and_delay();
 	}
 
 	return 0;
@@ -3,12 +3,17 @@
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
+#include <stdlib.h>
 #include "device.h"
 #include "debug.h"
 #include "hsb_error.h"
 #include "hsb_config.h"
 #include "thread_utils.h"
 #include "scene.h"
+#include "timer_sched.h"
+#include "linkage.h"
+#include "action.h"
+#include "alarm.h"
 #include "utils.h"
 
 #include <libxml/xmlmemory.h>
@@ -16,20 +21,42 @@
 #include <libxml/tree.h>
 
 typedef struct {
-	GQueue			queue;
+	uint32_t		drvid;
+	uint8_t			mac[8];
+	GQueue			devq;
+} HSB_DEV_MAC_ENTRY_T;
+
+typedef struct {
+	GQueue			queue;		/* online devices, in order */
 	GMutex			mutex;
 
 	GQueue			offq;
 
+	GHashTable		*id_table;	/* devid -> device, online and offline */
+	GHashTable		*mac_table;	/* drvid + mac -> HSB_DEV_MAC_ENTRY_T */
+	GHashTable		*ip_table;	/* ip -> online device */
+
+	/* lock-free read side, see find_dev() */
+	GHashTable		*snapshot;	/* devid -> online device, read only */
+	gint			epoch;
+	gint			readers[2];
+	GQueue			retireq;	/* HSB_DEV_RETIRE_T */
+
 	GQueue			driverq;
 	uint32_t		dev_id;
 
 	HSB_WORK_MODE_T		work_mode;
-	uint32_t		sec_today;
+	time_t			last_check;
 
-	thread_data_control	async_thread_ctl;
+	gint			version;	/* bumped on every change a snapshot sees */
 } HSB_DEVICE_CB_T;
 
+typedef struct {
+	GHashTable		*snapshot;
+	HSB_DEV_T		*pdev;
+	gboolean		quiet[2];	/* reader counter seen zero since retire */
+} HSB_DEV_RETIRE_T;
+
 static HSB_DEVICE_CB_T gl_dev_cb = { 0 };
 
 #define HSB_DEVICE_CB_LOCK()	do { \
@@ -40,10 +67,377 @@ static HSB_DEVICE_CB_T gl_dev_cb = { 0 };
 	g_mutex_unlock(&gl_dev_cb.mutex); \
 } while (0)
 
+#define HSB_STATE_CHANGED()	g_atomic_int_inc(&gl_dev_cb.version)
+
 #define INT_TO_BUF(val, buf)	do { \
 	snprintf(buf, sizeof(buf), "%d", val); \
 } while (0)
 
+static guint _mac_hash(gconstpointer key)
+{
+	const HSB_DEV_MAC_ENTRY_T *entry = (const HSB_DEV_MAC_ENTRY_T *)key;
+	guint hash = entry->drvid;
+	int id;
+
+	for (id = 0; id < sizeof(entry->mac); id++)
+		hash = hash * 31 + entry->mac[id];
+
+	return hash;
+}
+
+static gboolean _mac_equal(gconstpointer a, gconstpointer b)
+{
+	const HSB_DEV_MAC_ENTRY_T *ea = (const HSB_DEV_MAC_ENTRY_T *)a;
+	const HSB_DEV_MAC_ENTRY_T *eb = (const HSB_DEV_MAC_ENTRY_T *)b;
+
+	return (ea->drvid == eb->drvid &&
+		0 == memcmp(ea->mac, eb->mac, sizeof(ea->mac)));
+}
+
+/* the index helpers below must be called with HSB_DEVICE_CB_LOCK held */
+static void _index_dev(HSB_DEV_T *pdev)
+{
+	HSB_DEV_MAC_ENTRY_T key, *entry;
+
+	g_hash_table_insert(gl_dev_cb.id_table, GUINT_TO_POINTER(pdev->id), pdev);
+
+	key.drvid = pdev->drvid;
+	memcpy(key.mac, pdev->info.mac, sizeof(key.mac));
+
+	entry = g_hash_table_lookup(gl_dev_cb.mac_table, &key);
+	if (!entry) {
+		entry = g_slice_new0(HSB_DEV_MAC_ENTRY_T);
+		entry->drvid = key.drvid;
+		memcpy(entry->mac, key.mac, sizeof(entry->mac));
+		g_queue_init(&entry->devq);
+
+		g_hash_table_insert(gl_dev_cb.mac_table, entry, entry);
+	}
+
+	g_queue_push_tail(&entry->devq, pdev);
+}
+
+static void _unindex_dev(HSB_DEV_T *pdev)
+{
+	HSB_DEV_MAC_ENTRY_T key, *entry;
+
+	g_hash_table_remove(gl_dev_cb.id_table, GUINT_TO_POINTER(pdev->id));
+	HSB_STATE_CHANGED();
+
+	key.drvid = pdev->drvid;
+	memcpy(key.mac, pdev->info.mac, sizeof(key.mac));
+
+	entry = g_hash_table_lookup(gl_dev_cb.mac_table, &key);
+	if (entry) {
+		g_queue_remove(&entry->devq, pdev);
+
+		if (g_queue_is_empty(&entry->devq)) {
+			g_hash_table_remove(gl_dev_cb.mac_table, entry);
+			g_slice_free(HSB_DEV_MAC_ENTRY_T, entry);
+		}
+	}
+}
+
+static void _link_online(HSB_DEV_T *pdev)
+{
+	pdev->state = HSB_DEV_STATE_ONLINE;
+	pdev->node.data = pdev;
+	g_queue_push_tail_link(&gl_dev_cb.queue, &pdev->node);
+	HSB_STATE_CHANGED();
+
+	if (pdev->prty.ip.s_addr)
+		g_hash_table_insert(gl_dev_cb.ip_table,
+				GUINT_TO_POINTER(pdev->prty.ip.s_addr), pdev);
+}
+
+static void _unlink_online(HSB_DEV_T *pdev)
+{
+	g_queue_unlink(&gl_dev_cb.queue, &pdev->node);
+
+	if (pdev->prty.ip.s_addr &&
+	    pdev == g_hash_table_lookup(gl_dev_cb.ip_table,
+				GUINT_TO_POINTER(pdev->prty.ip.s_addr)))
+		g_hash_table_remove(gl_dev_cb.ip_table,
+				GUINT_TO_POINTER(pdev->prty.ip.s_addr));
+}
+
+static void _link_offline(HSB_DEV_T *pdev)
+{
+	pdev->node.data = pdev;
+	g_queue_push_tail_link(&gl_dev_cb.offq, &pdev->node);
+	HSB_STATE_CHANGED();
+}
+
+static void _unlink_offline(HSB_DEV_T *pdev)
+{
+	g_queue_unlink(&gl_dev_cb.offq, &pdev->node);
+}
+
+static HSB_DEV_T *_find_offline_dev(uint32_t drvid, uint8_t *mac)
+{
+	HSB_DEV_MAC_ENTRY_T key, *entry;
+	HSB_DEV_T *pdev;
+	GList *node;
+
+	key.drvid = drvid;
+	memcpy(key.mac, mac, sizeof(key.mac));
+
+	entry = g_hash_table_lookup(gl_dev_cb.mac_table, &key);
+	if (!entry)
+		return NULL;
+
+	for (node = entry->devq.head; node; node = node->next) {
+		pdev = (HSB_DEV_T *)node->data;
+		if (pdev->state != HSB_DEV_STATE_ONLINE)
+			return pdev;
+	}
+
+	return NULL;
+}
+
+/* flag bit0 selects an action, otherwise a single status is set */
+int do_dev_act_async(uint32_t devid, uint8_t flag, uint16_t act_id,
+			uint16_t param1, uint32_t param2)
+{
+	if (CHECK_BIT(flag, 0)) {
+		HSB_ACTION_T action;
+		action.devid = devid;
+		action.id = act_id;
+		action.param1 = param1;
+		action.param2 = param2;
+		return set_dev_action_async(&action, NULL);
+	} else  {
+		HSB_STATUS_T stat;
+		stat.devid = devid;
+		stat.num = 1;
+		stat.id[0] = act_id;
+		stat.val[0] = param1;
+		return set_dev_status_async(&stat, NULL);
+	}
+}
+
+/* like do_dev_act_async, ahead of everything queued for the device */
+int do_dev_alarm_act(uint32_t devid, uint8_t flag, uint16_t act_id,
+			uint16_t param1, uint32_t param2)
+{
+	HSB_ACT_T *act = alloc_dev_act();
+	if (!act)
+		return HSB_E_NO_MEMORY;
+
+	if (CHECK_BIT(flag, 0)) {
+		act->type = HSB_ACT_TYPE_DO_ACTION;
+		act->u.action.devid = devid;
+		act->u.action.id = act_id;
+		act->u.action.param1 = param1;
+		act->u.action.param2 = param2;
+	} else {
+		act->type = HSB_ACT_TYPE_SET_STATUS;
+		act->u.status.devid = devid;
+		act->u.status.num = 1;
+		act->u.status.id[0] = act_id;
+		act->u.status.val[0] = param1;
+	}
+
+	return push_alarm_act(act);
+}
+
+/* next local time the timer fires strictly after @after, 0 for never */
+static time_t _timer_next_fire(const HSB_TIMER_T *ptimer, time_t after)
+{
+	struct tm tm, tm_after;
+	time_t fire;
+	int day;
+
+	if (ptimer->year || ptimer->mon || ptimer->mday) {
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = ptimer->year;
+		tm.tm_mon = ptimer->mon;
+		tm.tm_mday = ptimer->mday;
+		tm.tm_hour = ptimer->hour;
+		tm.tm_min = ptimer->min;
+		tm.tm_sec = ptimer->sec;
+		tm.tm_isdst = -1;
+
+		fire = mktime(&tm);
+
+		return (fire > after) ? fire : 0;
+	}
+
+	localtime_r(&after, &tm_after);
+
+	/* mktime() normalizes the day and fills in tm_wday */
+	for (day = 0; day <= 7; day++) {
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = tm_after.tm_year;
+		tm.tm_mon = tm_after.tm_mon;
+		tm.tm_mday = tm_after.tm_mday + day;
+		tm.tm_hour = ptimer->hour;
+		tm.tm_min = ptimer->min;
+		tm.tm_sec = ptimer->sec;
+		tm.tm_isdst = -1;
+
+		fire = mktime(&tm);
+
+		if (fire > after && CHECK_BIT(ptimer->wday, tm.tm_wday))
+			return fire;
+	}
+
+	return 0;
+}
+
+/* the scheduling helpers below must be called with HSB_DEVICE_CB_LOCK held */
+static void _sched_dev_timer(HSB_DEV_T *pdev, int id, time_t after)
+{
+	HSB_TIMER_T *ptimer = &pdev->timer[id];
+	time_t fire = 0;
+
+	/* flag bit1 enables the timer */
+	if (pdev->timer_status[id].active && CHECK_BIT(ptimer->flag, 1))
+		fire = _timer_next_fire(ptimer, after);
+
+	if (fire)
+		timer_sched_set(pdev->id, HSB_SCHED_TYPE_TIMER, id, fire);
+	else
+		timer_sched_del(pdev->id, HSB_SCHED_TYPE_TIMER, id);
+}
+
+static void _sched_dev(HSB_DEV_T *pdev, time_t now)
+{
+	HSB_DELAY_STATUS_T *dstatus;
+	int id;
+
+	for (id = 0; id < HSB_DEV_MAX_TIMER_NUM; id++)
+		_sched_dev_timer(pdev, id, now);
+
+	for (id = 0; id < HSB_DEV_MAX_DELAY_NUM; id++) {
+		dstatus = &pdev->delay_status[id];
+		if (!dstatus->active || !dstatus->started)
+			continue;
+
+		if (dstatus->start_tm > now)
+			dstatus->start_tm = now;
+
+		timer_sched_set(pdev->id, HSB_SCHED_TYPE_DELAY, id,
+				dstatus->start_tm + pdev->delay[id].delay_sec);
+	}
+}
+
+static void _unsched_dev(HSB_DEV_T *pdev)
+{
+	int id;
+
+	for (id = 0; id < HSB_DEV_MAX_TIMER_NUM; id++)
+		timer_sched_del(pdev->id, HSB_SCHED_TYPE_TIMER, id);
+
+	for (id = 0; id < HSB_DEV_MAX_DELAY_NUM; id++)
+		timer_sched_del(pdev->id, HSB_SCHED_TYPE_DELAY, id);
+}
+
+static void _sched_all_dev(time_t now)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_hash_table_iter_init(&iter, gl_dev_cb.id_table);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		_sched_dev((HSB_DEV_T *)value, now);
+}
+
+/*
+ * Readers never take HSB_DEVICE_CB_LOCK. Writers build a new read only
+ * snapshot of the online devices under the lock, publish it and flip the
+ * epoch. A reader bumps the counter of the epoch parity it entered in, so
+ * the replaced snapshot and removed devices are freed only after both
+ * counters have been seen at zero, i.e. every reader that could still hold
+ * them has left.
+ */
+static int _dev_read_lock(void)
+{
+	int idx;
+
+	for (;;) {
+		idx = g_atomic_int_get(&gl_dev_cb.epoch) & 1;
+		g_atomic_int_inc(&gl_dev_cb.readers[idx]);
+
+		if (idx == (g_atomic_int_get(&gl_dev_cb.epoch) & 1))
+			return idx;
+
+		g_atomic_int_add(&gl_dev_cb.readers[idx], -1);
+	}
+}
+
+static void _dev_read_unlock(int idx)
+{
+	g_atomic_int_add(&gl_dev_cb.readers[idx], -1);
+}
+
+/* the helpers below must be called with HSB_DEVICE_CB_LOCK held */
+static void _reclaim_dev(void)
+{
+	HSB_DEV_RETIRE_T *retire;
+	GList *link, *next;
+	int idx, cur;
+	bool flip = false;
+
+	cur = g_atomic_int_get(&gl_dev_cb.epoch) & 1;
+
+	for (link = gl_dev_cb.retireq.head; link; link = next) {
+		next = link->next;
+		retire = (HSB_DEV_RETIRE_T *)link->data;
+
+		for (idx = 0; idx < 2; idx++) {
+			if (!retire->quiet[idx] &&
+			    0 == g_atomic_int_get(&gl_dev_cb.readers[idx]))
+				retire->quiet[idx] = TRUE;
+		}
+
+		if (!retire->quiet[0] || !retire->quiet[1]) {
+			if (!retire->quiet[cur])
+				flip = true;
+			continue;
+		}
+
+		g_queue_delete_link(&gl_dev_cb.retireq, link);
+
+		if (retire->snapshot)
+			g_hash_table_destroy(retire->snapshot);
+		if (retire->pdev)
+			put_dev(retire->pdev);
+
+		g_slice_free(HSB_DEV_RETIRE_T, retire);
+	}
+
+	/* move new readers away from the counter we are waiting on */
+	if (flip)
+		g_atomic_int_inc(&gl_dev_cb.epoch);
+}
+
+static void _publish_dev(HSB_DEV_T *removed)
+{
+	HSB_DEV_RETIRE_T *retire;
+	GHashTable *snapshot;
+	HSB_DEV_T *pdev;
+	GList *link;
+
+	snapshot = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+	for (link = gl_dev_cb.queue.head; link; link = link->next) {
+		pdev = (HSB_DEV_T *)link->data;
+		g_hash_table_insert(snapshot, GUINT_TO_POINTER(pdev->id), pdev);
+	}
+
+	retire = g_slice_new0(HSB_DEV_RETIRE_T);
+	retire->snapshot = g_atomic_pointer_get(&gl_dev_cb.snapshot);
+	retire->pdev = removed;
+
+	g_atomic_pointer_set(&gl_dev_cb.snapshot, snapshot);
+	g_atomic_int_inc(&gl_dev_cb.epoch);
+
+	g_queue_push_tail(&gl_dev_cb.retireq, retire);
+
+	_reclaim_dev();
+}
+
 static int _add_node(xmlNodePtr parent, const char *name, char *val)
 {
 	xmlNodePtr child, value;
@@ -272,19 +666,15 @@ int save_config(void)
 
 	xmlDocSetRootElement(doc, root);
 
-	int id, len;
-	GQueue *queue;
+	int id;
+	GList *link;
 	HSB_DEV_T *pdev;
 
-	queue = &gl_dev_cb.queue;
-	len = g_queue_get_length(queue);
-	for (id = 0; id < len; id++)
+	HSB_DEVICE_CB_LOCK();
+
+	for (link = gl_dev_cb.queue.head; link; link = link->next)
 	{
-		pdev = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
-		if (!pdev) {
-			hsb_critical("device null\n");
-			continue;
-		}
+		pdev = (HSB_DEV_T *)link->data;
 
 		node = make_dev_node(pdev);
 
@@ -292,15 +682,9 @@ int save_config(void)
 		xmlAddChild(root, node);
 	}
 
-	queue = &gl_dev_cb.offq;
-	len = g_queue_get_length(queue);
-	for (id = 0; id < len; id++)
+	for (link = gl_dev_cb.offq.head; link; link = link->next)
 	{
-		pdev = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
-		if (!pdev) {
-			hsb_critical("device null\n");
-			continue;
-		}
+		pdev = (HSB_DEV_T *)link->data;
 
 		node = make_dev_node(pdev);
 
@@ -308,6 +692,8 @@ int save_config(void)
 		xmlAddChild(root, node);
 	}
 
+	HSB_DEVICE_CB_UNLOCK();
+
 	/* add scene */
 	uint32_t num;
 	HSB_SCENE_T *pscene = NULL;
@@ -335,12 +721,7 @@ int save_config(void)
 
 static int parse_dev(xmlNodePtr node, HSB_DEV_T **ppdev)
 {
-	GQueue *devq, *offq;
 	HSB_DEV_T *pdev;
-
-	devq = &gl_dev_cb.queue;
-	offq = &gl_dev_cb.offq;
-
 	xmlNodePtr cur;
 	xmlChar *key;
 	uint32_t devid;
@@ -494,7 +875,11 @@ static int parse_dev(xmlNodePtr node, HSB_DEV_T **ppdev)
 	*ppdev = pdev;
 
 	hsb_debug("add a device [%d] to offq\n", devid);
-	g_queue_push_tail(offq, pdev);
+
+	HSB_DEVICE_CB_LOCK();
+	_index_dev(pdev);
+	_link_offline(pdev);
+	HSB_DEVICE_CB_UNLOCK();
 
 	return HSB_E_OK;
 fail:
@@ -661,28 +1046,40 @@ static int load_config(void)
 	return HSB_E_OK;
 }
 
-int get_dev_id_list(uint32_t *dev_id, int *dev_num)
+int foreach_dev(HSB_DEV_ITER_FUNC func, void *data)
 {
-	guint len, id;
-	GQueue *queue = &gl_dev_cb.queue;
-	HSB_DEV_T	*pdev;
-	int num = 0;
+	GList *link;
+	int ret = 0;
 
 	HSB_DEVICE_CB_LOCK();
 
-	len = g_queue_get_length(queue);
-	for (id = 0; id < len; id++) {
-		pdev = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
-		if (!pdev) {
-			hsb_critical("device null\n");
-			num = 0;
+	for (link = gl_dev_cb.queue.head; link; link = link->next) {
+		ret = func((HSB_DEV_T *)link->data, data);
+		if (ret)
 			break;
-		}
+	}
+
+	HSB_DEVICE_CB_UNLOCK();
+
+	return ret;
+}
+
+/* dev_num holds the room in dev_id on entry, the count on return */
+int get_dev_id_list(uint32_t *dev_id, int *dev_num)
+{
+	GList *link;
+	int num = 0;
+
+	HSB_DEVICE_CB_LOCK();
 
-		dev_id[num] = pdev->id;
+	for (link = gl_dev_cb.queue.head; link && num < *dev_num; link = link->next) {
+		dev_id[num] = ((HSB_DEV_T *)link->data)->id;
 		num++;
 	}
 
+	if (link)
+		hsb_debug("device list truncated at %d\n", num);
+
 	HSB_DEVICE_CB_UNLOCK();
 
 	*dev_num = num;
@@ -690,121 +1087,242 @@ int get_dev_id_list(uint32_t *dev_id, int *dev_num)
 	return 0;
 }
 
-HSB_DEV_T *find_dev(uint32_t dev_id)
+static void _snap_dev(HSB_DEV_SNAP_T *snap, HSB_DEV_T *pdev)
 {
-	guint len, id;
-	GQueue *queue = &gl_dev_cb.queue;
-	HSB_DEV_T	*pdev = NULL;
-
-	len = g_queue_get_length(queue);
-	for (id = 0; id < len; id++) {
-		pdev = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
-		if (!pdev) {
-			hsb_critical("device null\n");
-			continue;
-		}
+	snap->id = pdev->id;
+	snap->drvid = pdev->drvid;
+	snap->state = pdev->state;
+	memcpy(&snap->info, &pdev->info, sizeof(HSB_DEV_INFO_T));
+	memcpy(&snap->config, &pdev->config, sizeof(HSB_DEV_CONFIG_T));
+	memcpy(&snap->status, &pdev->status, sizeof(HSB_DEV_STATUS_T));
+}
 
-		if (pdev->id == dev_id)
-			return pdev;
-	}
+static int _snap_cmp(const void *a, const void *b)
+{
+	uint32_t ida = ((const HSB_DEV_SNAP_T *)a)->id;
+	uint32_t idb = ((const HSB_DEV_SNAP_T *)b)->id;
 
-	return NULL;
+	return (ida > idb) - (ida < idb);
 }
 
-int report_all_device(void *data)
+/*
+ * Every device in id order plus the work mode, stamped with the state
+ * version they were copied at. Drivers write status without the lock,
+ * so the copy is retried when the version moves underneath it. If it
+ * still moved on the last try the copy may be torn and HSB_E_BUSY is
+ * returned with it. The caller frees *psnap with g_free().
+ */
+int get_dev_snapshot(HSB_DEV_SNAP_T **psnap, int *num, uint32_t *version,
+			HSB_WORK_MODE_T *mode)
 {
-	guint len, id;
-	GQueue *queue = &gl_dev_cb.queue;
-	HSB_DEV_T	*pdev;
+	GHashTableIter iter;
+	gpointer key, value;
+	HSB_DEV_SNAP_T *snap;
+	int cnt = 0, retry, ret = HSB_E_BUSY;
+	gint ver;
 
 	HSB_DEVICE_CB_LOCK();
 
-	len = g_queue_get_length(queue);
-	for (id = 0; id < len; id++) {
-		pdev = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
-		if (!pdev) {
-			hsb_critical("device null\n");
-			break;
-		}
-
-		HSB_RESP_T resp = { 0 };
+	snap = g_new(HSB_DEV_SNAP_T, g_hash_table_size(gl_dev_cb.id_table) + 1);
 
-		resp.type = HSB_RESP_TYPE_EVENT;
-		resp.reply = NULL;
-		resp.u.event.devid = pdev->id;
-		resp.u.event.id = HSB_EVT_TYPE_DEV_UPDATED;
-		resp.u.event.param1 = HSB_DEV_UPDATED_TYPE_ONLINE;
-		resp.u.event.param2 = pdev->info.dev_type;
+	for (retry = 0; retry < 3; retry++) {
+		ver = g_atomic_int_get(&gl_dev_cb.version);
+		*mode = gl_dev_cb.work_mode;
 
+		cnt = 0;
+		g_hash_table_iter_init(&iter, gl_dev_cb.id_table);
+		while (g_hash_table_iter_next(&iter, &key, &value))
+			_snap_dev(&snap[cnt++], (HSB_DEV_T *)value);
 
-		notify_resp(&resp, data);
+		if (ver == g_atomic_int_get(&gl_dev_cb.version)) {
+			ret = HSB_E_OK;
+			break;
+		}
 	}
 
 	HSB_DEVICE_CB_UNLOCK();
 
-	return 0;
-}
+	qsort(snap, cnt, sizeof(HSB_DEV_SNAP_T), _snap_cmp);
 
+	*psnap = snap;
+	*num = cnt;
+	*version = (uint32_t)ver;
 
-static int link_device(HSB_DEV_T *pdev)
+	return ret;
+}
+
+/*
+ * Devices with id >= cursor in id order, online and offline, at most
+ * *num of them. The ids are stable, so a device added or removed between
+ * two pages never shifts the others.
+ */
+int get_dev_page(uint32_t cursor, HSB_DEV_SNAP_T *snap, int *num, bool *more)
 {
-	if (pdev->driver->id != 3)
-		return HSB_E_OK;
+	GHashTableIter iter;
+	gpointer key, value;
+	HSB_DEV_T *pdev;
+	int max = *num;
+	int cnt = 0, matched = 0;
+	int pos;
 
-	guint len, id;
-	GQueue *queue = &gl_dev_cb.queue;
-	HSB_DEV_T	*pdevice = NULL;
+	if (max <= 0)
+		return HSB_E_BAD_PARAM;
 
-	len = g_queue_get_length(queue);
-	for (id = 0; id < len; id++) {
-		pdevice = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
-		if (!pdevice) {
-			hsb_critical("device null\n");
+	HSB_DEVICE_CB_LOCK();
+
+	g_hash_table_iter_init(&iter, gl_dev_cb.id_table);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		pdev = (HSB_DEV_T *)value;
+		if (pdev->id < cursor)
 			continue;
-		}
 
-		if (pdev == pdevice)
+		matched++;
+
+		/* keep the max smallest ids, sorted */
+		if (cnt == max && pdev->id > snap[cnt - 1].id)
 			continue;
 
-		if (0 < strlen(pdev->config.location) &&
-		    0 < strlen(pdevice->config.location) &&
-		    0 == strncmp(pdevice->config.location,
-				 pdev->config.location,
-				 sizeof(pdev->config.location)) &&
-		    pdevice->info.dev_type == HSB_DEV_TYPE_REMOTE_CTL)
-		{
-			pdev->ir_dev = pdevice;
-			break;
+		pos = (cnt < max) ? cnt : cnt - 1;
+		while (pos > 0 && snap[pos - 1].id > pdev->id) {
+			snap[pos] = snap[pos - 1];
+			pos--;
 		}
+
+		_snap_dev(&snap[pos], pdev);
+
+		if (cnt < max)
+			cnt++;
 	}
 
-	if (id == len)
-		pdev->ir_dev = NULL;
+	HSB_DEVICE_CB_UNLOCK();
+
+	*num = cnt;
+	*more = (matched > cnt);
 
 	return HSB_E_OK;
 }
 
-static int update_link(HSB_DEV_T *pdev)
+/*
+ * The device returned by find_dev() stays allocated only while the caller
+ * holds HSB_DEVICE_CB_LOCK or is inside a driver op of that device. Use
+ * get_dev()/put_dev() to keep it across blocking calls.
+ */
+HSB_DEV_T *find_dev(uint32_t dev_id)
 {
-	if (pdev->info.dev_type != HSB_DEV_TYPE_REMOTE_CTL)
-		return HSB_E_OK;
+	HSB_DEV_T *pdev = NULL;
+	GHashTable *snapshot;
+	int idx;
 
-	bool online = (pdev->state == HSB_DEV_STATE_ONLINE) ? true : false;
+	idx = _dev_read_lock();
 
-	guint len, id;
-	GQueue *queue = &gl_dev_cb.queue;
-	HSB_DEV_T	*pdevice = NULL;
+	snapshot = g_atomic_pointer_get(&gl_dev_cb.snapshot);
+	if (snapshot)
+		pdev = g_hash_table_lookup(snapshot, GUINT_TO_POINTER(dev_id));
 
-	len = g_queue_get_length(queue);
-	for (id = 0; id < len; id++) {
-		pdevice = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
-		if (!pdevice) {
-			hsb_critical("device null\n");
-			continue;
-		}
+	_dev_read_unlock(idx);
 
-		if (pdev == pdevice)
-			continue;
+	return pdev;
+}
+
+HSB_DEV_T *get_dev(uint32_t dev_id)
+{
+	HSB_DEV_T *pdev = NULL;
+	GHashTable *snapshot;
+	int idx;
+
+	idx = _dev_read_lock();
+
+	snapshot = g_atomic_pointer_get(&gl_dev_cb.snapshot);
+	if (snapshot)
+		pdev = g_hash_table_lookup(snapshot, GUINT_TO_POINTER(dev_id));
+	if (pdev)
+		g_atomic_int_inc(&pdev->ref);
+
+	_dev_read_unlock(idx);
+
+	return pdev;
+}
+
+void put_dev(HSB_DEV_T *pdev)
+{
+	if (g_atomic_int_dec_and_test(&pdev->ref))
+		destroy_dev(pdev);
+}
+
+/* the mac and ip indexes are writer side tables, look them up locked */
+HSB_DEV_T *find_dev_by_mac(uint32_t drvid, uint8_t *mac)
+{
+	HSB_DEV_MAC_ENTRY_T key, *entry;
+	HSB_DEV_T *pdev = NULL;
+	GList *node;
+
+	key.drvid = drvid;
+	memcpy(key.mac, mac, sizeof(key.mac));
+
+	HSB_DEVICE_CB_LOCK();
+
+	entry = g_hash_table_lookup(gl_dev_cb.mac_table, &key);
+	if (entry) {
+		for (node = entry->devq.head; node; node = node->next) {
+			if (((HSB_DEV_T *)node->data)->state == HSB_DEV_STATE_ONLINE) {
+				pdev = (HSB_DEV_T *)node->data;
+				break;
+			}
+		}
+	}
+
+	HSB_DEVICE_CB_UNLOCK();
+
+	return pdev;
+}
+
+static int link_device(HSB_DEV_T *pdev)
+{
+	if (pdev->driver->id != 3)
+		return HSB_E_OK;
+
+	GList *link;
+	HSB_DEV_T	*pdevice = NULL;
+
+	for (link = gl_dev_cb.queue.head; link; link = link->next) {
+		pdevice = (HSB_DEV_T *)link->data;
+
+		if (pdev == pdevice)
+			continue;
+
+		if (0 < strlen(pdev->config.location) &&
+		    0 < strlen(pdevice->config.location) &&
+		    0 == strncmp(pdevice->config.location,
+				 pdev->config.location,
+				 sizeof(pdev->config.location)) &&
+		    pdevice->info.dev_type == HSB_DEV_TYPE_REMOTE_CTL)
+		{
+			pdev->ir_dev = pdevice;
+			break;
+		}
+	}
+
+	if (!link)
+		pdev->ir_dev = NULL;
+
+	return HSB_E_OK;
+}
+
+static int update_link(HSB_DEV_T *pdev)
+{
+	if (pdev->info.dev_type != HSB_DEV_TYPE_REMOTE_CTL)
+		return HSB_E_OK;
+
+	bool online = (pdev->state == HSB_DEV_STATE_ONLINE) ? true : false;
+
+	GList *link;
+	HSB_DEV_T	*pdevice = NULL;
+
+	for (link = gl_dev_cb.queue.head; link; link = link->next) {
+		pdevice = (HSB_DEV_T *)link->data;
+
+		if (pdev == pdevice)
+			continue;
 
 		if (!online) {
 			if (pdevice->ir_dev == pdev) {
@@ -828,28 +1346,33 @@ static int update_link(HSB_DEV_T *pdev)
 
 int get_dev_cfg(uint32_t dev_id, HSB_DEV_CONFIG_T *cfg)
 {
-	HSB_DEV_T *pdev = find_dev(dev_id);
+	HSB_DEV_T *pdev = get_dev(dev_id);
 
 	if (!pdev)
 		return HSB_E_BAD_PARAM;
 
 	memcpy(cfg, &pdev->config, sizeof(*cfg));
 
+	put_dev(pdev);
+
 	return HSB_E_OK;
 }
 
 int set_dev_cfg(uint32_t dev_id, const HSB_DEV_CONFIG_T *cfg)
 {
-	HSB_DEV_T *pdev = find_dev(dev_id);
+	HSB_DEV_T *pdev = get_dev(dev_id);
 
 	if (!pdev)
 		return HSB_E_BAD_PARAM;
 
 	memcpy(&pdev->config, cfg, sizeof(*cfg));
+	HSB_STATE_CHANGED();
 
 	link_device(pdev);
 	update_link(pdev);
 
+	put_dev(pdev);
+
 	save_config();
 
 	return HSB_E_OK;
@@ -858,17 +1381,19 @@ int set_dev_cfg(uint32_t dev_id, const HSB_DEV_CONFIG_T *cfg)
 int set_dev_channel(uint32_t devid, char *name, uint32_t cid)
 {
 	int ret;
-	HSB_DEV_T *pdev = find_dev(devid);
+	HSB_DEV_T *pdev = get_dev(devid);
 
 	if (!pdev)
 		return HSB_E_BAD_PARAM;
 
-	HSB_CHANNEL_DB_T *pdb = pdev->pchan_db;
-
-	if (!pdb)
+	if (!pdev->pchan_db) {
+		put_dev(pdev);
 		return HSB_E_NOT_SUPPORTED;
+	}
+
+	ret = set_channel(pdev->pchan_db, name, cid);
 
-	ret = set_channel(pdb, name, cid);
+	put_dev(pdev);
 
 	save_config();
 
@@ -878,17 +1403,19 @@ int set_dev_channel(uint32_t devid, char *name, uint32_t cid)
 int del_dev_channel(uint32_t devid, char *name)
 {
 	int ret;
-	HSB_DEV_T *pdev = find_dev(devid);
+	HSB_DEV_T *pdev = get_dev(devid);
 
 	if (!pdev)
 		return HSB_E_BAD_PARAM;
 
-	HSB_CHANNEL_DB_T *pdb = pdev->pchan_db;
-
-	if (!pdb)
+	if (!pdev->pchan_db) {
+		put_dev(pdev);
 		return HSB_E_NOT_SUPPORTED;
+	}
 
-	ret = del_channel(pdb, name);
+	ret = del_channel(pdev->pchan_db, name);
+
+	put_dev(pdev);
 
 	save_config();
 
@@ -897,47 +1424,50 @@ int del_dev_channel(uint32_t devid, char *name)
 
 int get_dev_channel(uint32_t devid, char *name, uint32_t *cid)
 {
-	HSB_DEV_T *pdev = find_dev(devid);
+	int ret = HSB_E_NOT_SUPPORTED;
+	HSB_DEV_T *pdev = get_dev(devid);
 
 	if (!pdev)
 		return HSB_E_BAD_PARAM;
 
-	HSB_CHANNEL_DB_T *pdb = pdev->pchan_db;
+	if (pdev->pchan_db)
+		ret = get_channel(pdev->pchan_db, name, cid);
 
-	if (!pdb)
-		return HSB_E_NOT_SUPPORTED;
+	put_dev(pdev);
 
-	return get_channel(pdb, name, cid);
+	return ret;
 }
 
 int get_dev_channel_num(uint32_t devid, int *num)
 {
-	HSB_DEV_T *pdev = find_dev(devid);
+	int ret = HSB_E_NOT_SUPPORTED;
+	HSB_DEV_T *pdev = get_dev(devid);
 
 	if (!pdev)
 		return HSB_E_BAD_PARAM;
 
-	HSB_CHANNEL_DB_T *pdb = pdev->pchan_db;
+	if (pdev->pchan_db)
+		ret = get_channel_num(pdev->pchan_db, num);
 
-	if (!pdb)
-		return HSB_E_NOT_SUPPORTED;
+	put_dev(pdev);
 
-	return get_channel_num(pdb, num);
+	return ret;
 }
 
 int get_dev_channel_by_id(uint32_t devid, int id, char *name, uint32_t *cid)
 {
-	HSB_DEV_T *pdev = find_dev(devid);
+	int ret = HSB_E_NOT_SUPPORTED;
+	HSB_DEV_T *pdev = get_dev(devid);
 
 	if (!pdev)
 		return HSB_E_BAD_PARAM;
 
-	HSB_CHANNEL_DB_T *pdb = pdev->pchan_db;
+	if (pdev->pchan_db)
+		ret = get_channel_by_id(pdev->pchan_db, id, name, cid);
 
-	if (!pdb)
-		return HSB_E_NOT_SUPPORTED;
+	put_dev(pdev);
 
-	return get_channel_by_id(pdb, id, name, cid);
+	return ret;
 }
 
 static HSB_DEV_DRV_T *_get_dev_drv(uint32_t devid)
@@ -986,13 +1516,15 @@ int get_dev_status(HSB_STATUS_T *status)
 {
 	int ret = HSB_E_NOT_SUPPORTED;
 
-	HSB_DEV_T *pdev = find_dev(status->devid);
+	HSB_DEV_T *pdev = get_dev(status->devid);
 
 	if (!pdev)
 		return HSB_E_ENTRY_NOT_FOUND;
 
 	if (pdev->op && pdev->op->get_status)
-		return pdev->op->get_status(status);
+		ret = pdev->op->get_status(status);
+
+	put_dev(pdev);
 
 	return ret;
 }
@@ -1011,6 +1543,8 @@ int sync_dev_status(HSB_DEV_T *pdev, const HSB_STATUS_T *status)
 		pdev->status.val[id] =  val;
 	}
 
+	HSB_STATE_CHANGED();
+
 	return HSB_E_OK;
 }
 
@@ -1035,7 +1569,7 @@ int set_dev_status(const HSB_STATUS_T *status)
 	if (0 == status->devid && status->id[0] == HSB_STATUS_TYPE_WORK_MODE)
 		return set_box_work_mode(status->val[0]);
 
-	HSB_DEV_T *pdev = find_dev(status->devid);
+	HSB_DEV_T *pdev = get_dev(status->devid);
 
 	if (!pdev)
 		return HSB_E_ENTRY_NOT_FOUND;
@@ -1048,6 +1582,8 @@ int set_dev_status(const HSB_STATUS_T *status)
 			
 	}
 
+	put_dev(pdev);
+
 	return ret;
 }
 
@@ -1055,13 +1591,15 @@ int set_dev_action(const HSB_ACTION_T *act)
 {
 	int ret = HSB_E_NOT_SUPPORTED;
 
-	HSB_DEV_T *pdev = find_dev(act->devid);
+	HSB_DEV_T *pdev = get_dev(act->devid);
 
 	if (!pdev)
 		return HSB_E_ENTRY_NOT_FOUND;
 
 	if (pdev->op && pdev->op->set_action)
-		return pdev->op->set_action(act);
+		ret = pdev->op->set_action(act);
+
+	put_dev(pdev);
 
 	return ret;
 }
@@ -1147,11 +1685,15 @@ int add_dev(uint32_t drv_id, HSB_DEV_TYPE_T dev_type, HSB_DEV_CONFIG_T *cfg)
 
 int del_dev(uint32_t devid)
 {
-	HSB_DEV_T *pdev = find_dev(devid);
+	HSB_DEV_DRV_T *pdrv;
+	HSB_DEV_T *pdev = get_dev(devid);
 	if (!pdev)
 		return HSB_E_BAD_PARAM;
 
-	HSB_DEV_DRV_T *pdrv = pdev->driver;
+	/* the driver outlives its devices, drop the device before removing it */
+	pdrv = pdev->driver;
+	put_dev(pdev);
+
 	if (!pdrv)
 		return HSB_E_BAD_PARAM;
 
@@ -1207,23 +1749,13 @@ int register_dev_drv(HSB_DEV_DRV_T *drv)
 
 HSB_DEV_T *find_dev_by_ip(struct in_addr *ip)
 {
-	guint len, id;
-	GQueue *queue = &gl_dev_cb.queue;
-	HSB_DEV_T	*pdev = NULL;
-
-	len = g_queue_get_length(queue);
-	for (id = 0; id < len; id++) {
-		pdev = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
-		if (!pdev) {
-			hsb_critical("device null\n");
-			continue;
-		}
+	HSB_DEV_T *pdev;
 
-		if (ip->s_addr == pdev->prty.ip.s_addr)
-			return pdev;
-	}
+	HSB_DEVICE_CB_LOCK();
+	pdev = g_hash_table_lookup(gl_dev_cb.ip_table, GUINT_TO_POINTER(ip->s_addr));
+	HSB_DEVICE_CB_UNLOCK();
 
-	return NULL;
+	return pdev;
 }
 
 HSB_DEV_T *alloc_dev(uint32_t devid)
@@ -1235,6 +1767,7 @@ HSB_DEV_T *alloc_dev(uint32_t devid)
 	/* set default value */
 	pdev->id = devid;
 	pdev->work_mode = HSB_WORK_MODE_ALL;
+	pdev->ref = 1;
 
 	return pdev;
 }
@@ -1248,6 +1781,7 @@ HSB_DEV_T *create_dev(void)
 	/* set default value */
 	pdev->id = alloc_dev_id();
 	pdev->work_mode = HSB_WORK_MODE_ALL;
+	pdev->ref = 1;
 
 	return pdev;
 }
@@ -1261,12 +1795,11 @@ int destroy_dev(HSB_DEV_T *dev)
 
 int register_dev(HSB_DEV_T *dev)
 {
-	guint len, id;
-	GQueue *queue = &gl_dev_cb.queue;
-
 	HSB_DEVICE_CB_LOCK();
 
-	g_queue_push_tail(queue, dev);
+	_index_dev(dev);
+	_link_online(dev);
+	_publish_dev(NULL);
 
 	HSB_DEVICE_CB_UNLOCK();
 
@@ -1277,10 +1810,10 @@ int register_dev(HSB_DEV_T *dev)
 
 int remove_dev(HSB_DEV_T *dev)
 {
-	GQueue *queue = &gl_dev_cb.queue;
-
 	HSB_DEVICE_CB_LOCK();
-	g_queue_remove(queue, dev);
+	_unlink_online(dev);
+	_unindex_dev(dev);
+	_publish_dev(NULL);
 	HSB_DEVICE_CB_UNLOCK();
 
 	dev_updated(dev->id, HSB_DEV_UPDATED_TYPE_OFFLINE, dev->info.dev_type);
@@ -1290,20 +1823,15 @@ int remove_dev(HSB_DEV_T *dev)
 
 static int recover_dev(void)
 {
-	int ret;
-	guint id;
-	GQueue *queue = &gl_dev_cb.offq;
+	GList *link, *next;
 	HSB_DEV_T	*pdev = NULL;
 	HSB_DEV_DRV_T	*drv = NULL;
 
-	id = 0;
-	while (id < g_queue_get_length(queue))
+	/* dev_recovered() unlinks the device from offq, so fetch next first */
+	for (link = gl_dev_cb.offq.head; link; link = next)
 	{
-		pdev = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
-		if (!pdev) {
-			hsb_critical("device null\n");
-			continue;
-		}
+		next = link->next;
+		pdev = (HSB_DEV_T *)link->data;
 
 		drv = _find_drv(pdev->drvid);
 		if (!drv) {
@@ -1311,14 +1839,8 @@ static int recover_dev(void)
 			continue;
 		}
 
-		ret = HSB_E_OTHERS;
 		if (drv->op && drv->op->recover_dev)
-			ret = drv->op->recover_dev(pdev->id, pdev->info.dev_type);
-
-		if (HSB_E_OK == ret)
-			continue;
-
-		id++;
+			drv->op->recover_dev(pdev->id, pdev->info.dev_type);
 	}
 
 	return HSB_E_OK;
@@ -1344,30 +1866,31 @@ int dev_online(uint32_t drvid,
 		uint32_t *devid)
 {
 	int ret = HSB_E_OK;
-	GQueue *offq = &gl_dev_cb.offq;
-	GQueue *queue = &gl_dev_cb.queue;
 	HSB_DEV_T *pdev = NULL;
-	guint len, id;
 
 	HSB_DEVICE_CB_LOCK();
 
-	len = g_queue_get_length(offq);
-	for (id = 0; id < len; id++) {
-		pdev = (HSB_DEV_T *)g_queue_peek_nth(offq, id);
-		if (!pdev) {
-			hsb_critical("device null\n");
-			continue;
-		}
+	pdev = _find_offline_dev(drvid, info->mac);
+	if (pdev) {
+		/* drvid and mac are the index key and stay unchanged */
+		_unlink_offline(pdev);
 
-		if (drvid == pdev->drvid &&
-		    0 == memcmp(pdev->info.mac, info->mac, 8)) {
-			break;
-		}
+		if (support_channel && !pdev->pchan_db)
+			pdev->pchan_db = alloc_channel_db();
+		pdev->driver = _find_drv(drvid);
+		pdev->op = op;
+		pdev->priv_data = priv;
+
+		memcpy(&pdev->info, info, sizeof(*info));
+		memcpy(&pdev->status, status, sizeof(*status));
+
+		_link_online(pdev);
+		_publish_dev(NULL);
 	}
 
 	HSB_DEVICE_CB_UNLOCK();
 
-	if (id == len) { /* not found in offq */
+	if (!pdev) { /* not found in offq */
 		pdev = create_dev();
 		if (support_channel)
 			pdev->pchan_db = alloc_channel_db();
@@ -1375,7 +1898,6 @@ int dev_online(uint32_t drvid,
 		pdev->driver = _find_drv(drvid);
 		pdev->op = op;
 		pdev->priv_data = priv;
-		pdev->state = HSB_DEV_STATE_ONLINE;
 
 		memcpy(&pdev->status, status, sizeof(*status));
 		memcpy(&pdev->info, info, sizeof(*info));
@@ -1390,7 +1912,9 @@ int dev_online(uint32_t drvid,
 		}
 
 		HSB_DEVICE_CB_LOCK();
-		g_queue_push_tail(queue, pdev);
+		_index_dev(pdev);
+		_link_online(pdev);
+		_publish_dev(NULL);
 		HSB_DEVICE_CB_UNLOCK();
 
 		link_device(pdev);
@@ -1402,23 +1926,6 @@ int dev_online(uint32_t drvid,
 		/* TODO */
 		save_config();
 	} else {
-		g_queue_pop_nth(offq, id);
-
-		if (support_channel && !pdev->pchan_db)
-			pdev->pchan_db = alloc_channel_db();
-		pdev->drvid = drvid;
-		pdev->driver = _find_drv(drvid);
-		pdev->op = op;
-		pdev->priv_data = priv;
-		pdev->state = HSB_DEV_STATE_ONLINE;
-
-		memcpy(&pdev->info, info, sizeof(*info));
-		memcpy(&pdev->status, status, sizeof(*status));
-
-		HSB_DEVICE_CB_LOCK();
-		g_queue_push_tail(queue, pdev);
-		HSB_DEVICE_CB_UNLOCK();
-
 		link_device(pdev);
 		update_link(pdev);
 
@@ -1435,36 +1942,23 @@ int dev_online(uint32_t drvid,
 int dev_offline(uint32_t devid)
 {
 	int ret = HSB_E_OK;
-	GQueue *offq = &gl_dev_cb.offq;
-	GQueue *queue = &gl_dev_cb.queue;
 	HSB_DEV_T *pdev = NULL;
-	guint len, id;
 
 	HSB_DEVICE_CB_LOCK();
 
-	len = g_queue_get_length(queue);
-	for (id = 0; id < len; id++) {
-		pdev = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
-		if (!pdev) {
-			hsb_critical("device null\n");
-			continue;
-		}
-
-		if (pdev->id == devid)
-			break;
-	}
-
-	if (id == len) {
+	pdev = find_dev(devid);
+	if (!pdev) {
 		hsb_critical("dev %d not found in queue\n", devid);
 		HSB_DEVICE_CB_UNLOCK();
 		return HSB_E_OTHERS;
 	}
 
-	pdev->state = HSB_DEV_STATE_OFFLINE;
+	_unlink_online(pdev);
 
-	g_queue_pop_nth(queue, id);
+	pdev->state = HSB_DEV_STATE_OFFLINE;
 
-	g_queue_push_tail(offq, pdev);
+	_link_offline(pdev);
+	_publish_dev(NULL);
 
 	HSB_DEVICE_CB_UNLOCK();
 
@@ -1478,33 +1972,26 @@ int dev_offline(uint32_t devid)
 int dev_removed(uint32_t devid)
 {
 	int ret = HSB_E_OK;
-	GQueue *queue = &gl_dev_cb.queue;
 	HSB_DEV_T *pdev = NULL;
-	guint len, id;
 
 	HSB_DEVICE_CB_LOCK();
 
-	len = g_queue_get_length(queue);
-	for (id = 0; id < len; id++) {
-		pdev = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
-		if (!pdev) {
-			hsb_critical("device null\n");
-			continue;
-		}
-
-		if (pdev->id == devid)
-			break;
-	}
-
-	if (id == len) {
+	pdev = find_dev(devid);
+	if (!pdev) {
 		hsb_critical("dev %d not found in queue\n", devid);
 		HSB_DEVICE_CB_UNLOCK();
 		return HSB_E_OTHERS;
 	}
 
+	_unlink_online(pdev);
+	_unindex_dev(pdev);
+	_unsched_dev(pdev);
+
 	pdev->state = HSB_DEV_STATE_OFFLINE;
 
-	g_queue_pop_nth(queue, id);
+	/* readers may still hold it, the registry reference is dropped later */
+	g_atomic_int_inc(&pdev->ref);
+	_publish_dev(pdev);
 
 	HSB_DEVICE_CB_UNLOCK();
 
@@ -1512,7 +1999,9 @@ int dev_removed(uint32_t devid)
 
 	dev_updated(devid, HSB_DEV_UPDATED_TYPE_OFFLINE, pdev->info.dev_type);
 
-	destroy_dev(pdev);
+	del_linkage_by_dev(devid);
+
+	put_dev(pdev);
 
 	return ret;
 }
@@ -1526,34 +2015,21 @@ int dev_recovered(uint32_t devid,
 		void *priv)
 {
 	int ret = HSB_E_OK;
-	GQueue *offq = &gl_dev_cb.offq;
-	GQueue *queue = &gl_dev_cb.queue;
 	HSB_DEV_T *pdev = NULL;
-	guint len, id;
 
 	HSB_DEVICE_CB_LOCK();
 
-	len = g_queue_get_length(offq);
-	for (id = 0; id < len; id++) {
-		pdev = (HSB_DEV_T *)g_queue_peek_nth(offq, id);
-		if (!pdev) {
-			hsb_critical("device null\n");
-			continue;
-		}
-
-		if (devid == pdev->id) {
-			break;
-		}
-	}
-
-	HSB_DEVICE_CB_UNLOCK();
-
-	if (id == len) { /* not found in offq */
+	pdev = g_hash_table_lookup(gl_dev_cb.id_table, GUINT_TO_POINTER(devid));
+	if (!pdev || pdev->state == HSB_DEV_STATE_ONLINE) { /* not found in offq */
+		HSB_DEVICE_CB_UNLOCK();
 		hsb_critical("not found in offq!\n");
 		return HSB_E_OTHERS;
 	}
 
-	g_queue_pop_nth(offq, id);
+	_unlink_offline(pdev);
+
+	/* drvid and mac may change, so re-key the indexes */
+	_unindex_dev(pdev);
 
 	if (support_channel && !pdev->pchan_db)
 		pdev->pchan_db = alloc_channel_db();
@@ -1561,13 +2037,14 @@ int dev_recovered(uint32_t devid,
 	pdev->driver = _find_drv(drvid);
 	pdev->op = op;
 	pdev->priv_data = priv;
-	pdev->state = HSB_DEV_STATE_ONLINE;
 
 	memcpy(&pdev->info, info, sizeof(*info));
 	memcpy(&pdev->status, status, sizeof(*status));
 
-	HSB_DEVICE_CB_LOCK();
-	g_queue_push_tail(queue, pdev);
+	_index_dev(pdev);
+	_link_online(pdev);
+	_publish_dev(NULL);
+
 	HSB_DEVICE_CB_UNLOCK();
 
 	link_device(pdev);
@@ -1582,56 +2059,42 @@ int dev_recovered(uint32_t devid,
 
 }
 
-static int check_linkage(uint32_t devid, HSB_EVT_T *evt)
+static void _start_dev_delay(uint32_t devid, const HSB_EVT_T *evt)
 {
-	HSB_DEV_T *pdev = find_dev(devid);
-	if (!pdev)
-		return HSB_E_OTHERS;
-
-	HSB_WORK_MODE_T work_mode = gl_dev_cb.work_mode;
-	HSB_LINKAGE_T *link = pdev->link;
-	HSB_LINKAGE_STATUS_T *status = pdev->link_status;
+	HSB_DELAY_T *pdelay;
+	HSB_DELAY_STATUS_T *dstatus;
+	HSB_DEV_T *pdev;
+	time_t now = time(NULL);
+	int id;
 
-	if (!CHECK_BIT(pdev->work_mode, work_mode))
-		return HSB_E_OTHERS;
+	HSB_DEVICE_CB_LOCK();
 
-	int id;
-	uint8_t flag;
+	pdev = find_dev(devid);
+	if (!pdev) {
+		HSB_DEVICE_CB_UNLOCK();
+		return;
+	}
 
-	for (id = 0; id < HSB_DEV_MAX_LINKAGE_NUM; id++, link++, status++) {
-		if (!status->active)
-			continue;
+	for (id = 0; id < HSB_DEV_MAX_DELAY_NUM; id++) {
+		pdelay = &pdev->delay[id];
+		dstatus = &pdev->delay_status[id];
 
-		if (!CHECK_BIT(link->work_mode, work_mode))
+		if (!dstatus->active ||
+		    evt->id != pdelay->evt_id ||
+		    evt->param1 != pdelay->evt_param1 ||
+		    evt->param2 != pdelay->evt_param2)
 			continue;
 
-		if (evt->id != link->evt_id ||
-		    evt->param1 != link->evt_param1 ||
-		    evt->param2 != link->evt_param2)
-			continue;
+		/* a repeated event restarts the delay */
+		dstatus->started = true;
+		dstatus->start_tm = now;
 
-		flag = link->flag;
-		if (CHECK_BIT(flag, 0)) {
-			HSB_ACTION_T action;
-			action.devid = link->act_devid;
-			action.id = link->act_id;
-			action.param1 = link->act_param1;
-			action.param2 = link->act_param2;
-			set_dev_action_async(&action, NULL);
-		} else  {
-			HSB_STATUS_T stat;
-			stat.devid = link->act_devid;
-			stat.num = 1;
-			stat.id[0] = link->act_id;
-			stat.val[0] = link->act_param1;
-			set_dev_status_async(&stat, NULL);
-		}
+		timer_sched_set(devid, HSB_SCHED_TYPE_DELAY, id, now + pdelay->delay_sec);
 	}
 
-	return HSB_E_OK;
+	HSB_DEVICE_CB_UNLOCK();
 }
 
-
 static _dev_event(uint32_t devid, HSB_EVT_TYPE_T type, uint16_t param1, uint32_t param2)
 {
 	HSB_RESP_T resp = { 0 };
@@ -1643,7 +2106,17 @@ static _dev_event(uint32_t devid, HSB_EVT_TYPE_T type, uint16_t param1, uint32_t
 	resp.u.event.param1 = param1;
 	resp.u.event.param2 = param2;
 
-	check_linkage(devid, &resp.u.event);
+	if (HSB_EVT_TYPE_SENSOR_TRIGGERED == type &&
+	    HSB_WORK_MODE_GUARD == gl_dev_cb.work_mode) {
+		int ret = raise_alarm(&resp.u.event);
+
+		_start_dev_delay(devid, &resp.u.event);
+
+		return ret;
+	}
+
+	check_linkage(&resp.u.event);
+	_start_dev_delay(devid, &resp.u.event);
 
 	hsb_debug("get event: %d, %d, %d, %x\n", devid, type, param1, param2);
 
@@ -1652,16 +2125,18 @@ static _dev_event(uint32_t devid, HSB_EVT_TYPE_T type, uint16_t param1, uint32_t
 
 int dev_status_updated(uint32_t devid, HSB_STATUS_T *status)
 {
-	HSB_DEV_T *pdev = find_dev(devid);
-	if (pdev)
+	HSB_DEV_T *pdev = get_dev(devid);
+	if (pdev) {
 		sync_dev_status(pdev, (const HSB_STATUS_T *)status);
+		put_dev(pdev);
+	}
 
 	HSB_RESP_T resp = { 0 };
 	resp.type = HSB_RESP_TYPE_STATUS_UPDATE;
 	resp.reply = NULL;
 	memcpy(&resp.u.status, status, sizeof(*status));
 
-	// TODO: check linkage
+	check_status_linkage(devid, status);
 
 	return notify_resp(&resp, NULL);
 }
@@ -1698,6 +2173,7 @@ int set_box_work_mode(HSB_WORK_MODE_T mode)
 		return HSB_E_BAD_PARAM;
 
 	gl_dev_cb.work_mode = mode;
+	HSB_STATE_CHANGED();
 
 	dev_mode_changed(mode);
 
@@ -1724,7 +2200,7 @@ static void probe_all_devices(void)
 
 int probe_dev_async(const HSB_PROBE_T *probe, void *reply)
 {
-	HSB_ACT_T *act = g_slice_new0(HSB_ACT_T);
+	HSB_ACT_T *act = alloc_dev_act();
 	if (!act)
 		return HSB_E_NO_MEMORY;
 
@@ -1732,14 +2208,12 @@ int probe_dev_async(const HSB_PROBE_T *probe, void *reply)
 	act->reply = reply;
 	act->u.probe.drvid = probe->drvid;
 
-	thread_control_push_data(&gl_dev_cb.async_thread_ctl, act);
-
-	return HSB_E_OK;
+	return push_dev_act(act);
 }
 
 int set_dev_status_async(const HSB_STATUS_T *status, void *reply)
 {
-	HSB_ACT_T *act = g_slice_new0(HSB_ACT_T);
+	HSB_ACT_T *act = alloc_dev_act();
 	if (!act)
 		return HSB_E_NO_MEMORY;
 
@@ -1747,14 +2221,12 @@ int set_dev_status_async(const HSB_STATUS_T *status, void *reply)
 	act->reply = reply;
 	memcpy(&act->u.status, status, sizeof(*status));
 
-	thread_control_push_data(&gl_dev_cb.async_thread_ctl, act);
-
-	return HSB_E_OK;
+	return push_dev_act(act);
 }
 
 int get_dev_status_async(uint32_t devid, void *reply)
 {
-	HSB_ACT_T *act = g_slice_new0(HSB_ACT_T);
+	HSB_ACT_T *act = alloc_dev_act();
 	if (!act)
 		return HSB_E_NO_MEMORY;
 
@@ -1762,14 +2234,12 @@ int get_dev_status_async(uint32_t devid, void *reply)
 	act->reply = reply;
 	act->u.status.devid = devid;
 
-	thread_control_push_data(&gl_dev_cb.async_thread_ctl, act);
-
-	return HSB_E_OK;
+	return push_dev_act(act);
 }
 
 int set_dev_action_async(const HSB_ACTION_T *action, void *reply)
 {
-	HSB_ACT_T *act = g_slice_new0(HSB_ACT_T);
+	HSB_ACT_T *act = alloc_dev_act();
 	if (!act)
 		return HSB_E_NO_MEMORY;
 
@@ -1777,11 +2247,152 @@ int set_dev_action_async(const HSB_ACTION_T *action, void *reply)
 	act->reply = reply;
 	memcpy(&act->u.action, action, sizeof(*action));
 
-	thread_control_push_data(&gl_dev_cb.async_thread_ctl, act);
+	return push_dev_act(act);
+}
+
+/* requests merged into @act share its result */
+static void _reply_merged_act(HSB_ACT_T *act, int ret)
+{
+	HSB_ACT_T *merged;
+	GList *node;
+
+	for (node = act->merged.head; node; node = node->next) {
+		merged = (HSB_ACT_T *)node->data;
+		if (!merged->reply)
+			continue;
+
+		HSB_RESP_T resp = { 0 };
+		resp.type = HSB_RESP_TYPE_RESULT;
+		resp.reply = merged->reply;
+		resp.req_id = merged->req_id;
+		resp.reply_gen = merged->reply_gen;
+		resp.u.result.devid = merged->u.status.devid;
+		resp.u.result.cmd = HSB_CMD_SET_STATUS;
+		resp.u.result.ret_val = ret;
+
+		notify_resp(&resp, NULL);
+	}
+}
+
+void free_status_batch(HSB_STATUS_BATCH_T *batch)
+{
+	g_free(batch);
+}
+
+static void _finish_batch_item(HSB_STATUS_BATCH_T *batch)
+{
+	HSB_RESP_T resp = { 0 };
+
+	if (!g_atomic_int_dec_and_test(&batch->pending))
+		return;
+
+	resp.type = HSB_RESP_TYPE_STATUS_BATCH;
+	resp.reply = batch->reply;
+	resp.req_id = batch->req_id;
+	resp.reply_gen = batch->reply_gen;
+	resp.u.batch = batch;
+
+	/* the notify path owns the batch from here */
+	notify_resp(&resp, NULL);
+}
+
+static void _process_batch_act(HSB_ACT_T *act)
+{
+	HSB_STATUS_BATCH_ITEM_T *item = &act->batch->items[act->batch_idx];
+
+	if (HSB_ACT_TYPE_SET_STATUS == act->type) {
+		item->ret = set_dev_status(&act->u.status);
+	} else {
+		item->ret = get_dev_status(&act->u.status);
+		if (HSB_E_OK == item->ret)
+			memcpy(&item->status, &act->u.status, sizeof(HSB_STATUS_T));
+	}
+
+	_finish_batch_item(act->batch);
+}
+
+/* one action per device, the lanes run them in parallel across drivers */
+static int _dispatch_batch(HSB_STATUS_BATCH_T *batch)
+{
+	HSB_STATUS_BATCH_ITEM_T *item;
+	HSB_ACT_T *act;
+	int id;
+
+	/* one extra count so the reply can't go out while still dispatching */
+	batch->pending = batch->num + 1;
+
+	for (id = 0; id < batch->num; id++) {
+		item = &batch->items[id];
+
+		act = alloc_dev_act();
+		if (!act) {
+			item->ret = HSB_E_NO_MEMORY;
+			_finish_batch_item(batch);
+			continue;
+		}
+
+		act->type = (HSB_CMD_SET_STATUS_BATCH == batch->cmd) ?
+				HSB_ACT_TYPE_SET_STATUS : HSB_ACT_TYPE_GET_STATUS;
+		act->reply = batch->reply;
+		act->batch = batch;
+		act->batch_idx = id;
+		memcpy(&act->u.status, &item->status, sizeof(HSB_STATUS_T));
+
+		push_dev_act(act);
+	}
+
+	_finish_batch_item(batch);
 
 	return HSB_E_OK;
 }
 
+static HSB_STATUS_BATCH_T *_alloc_batch(uint16_t cmd, int num, void *reply)
+{
+	HSB_STATUS_BATCH_T *batch;
+
+	if (num <= 0 || num > HSB_STATUS_BATCH_MAX)
+		return NULL;
+
+	batch = g_malloc0(sizeof(*batch) + num * sizeof(HSB_STATUS_BATCH_ITEM_T));
+	batch->cmd = cmd;
+	batch->reply = reply;
+	batch->req_id = get_act_req_id();
+	batch->reply_gen = get_act_reply_gen();
+	batch->num = num;
+
+	return batch;
+}
+
+int get_dev_status_batch_async(const uint32_t *devid, int num, void *reply)
+{
+	HSB_STATUS_BATCH_T *batch;
+	int id;
+
+	batch = _alloc_batch(HSB_CMD_GET_STATUS_BATCH, num, reply);
+	if (!batch)
+		return HSB_E_BAD_PARAM;
+
+	for (id = 0; id < num; id++)
+		batch->items[id].status.devid = devid[id];
+
+	return _dispatch_batch(batch);
+}
+
+int set_dev_status_batch_async(const HSB_STATUS_T *status, int num, void *reply)
+{
+	HSB_STATUS_BATCH_T *batch;
+	int id;
+
+	batch = _alloc_batch(HSB_CMD_SET_STATUS_BATCH, num, reply);
+	if (!batch)
+		return HSB_E_BAD_PARAM;
+
+	for (id = 0; id < num; id++)
+		memcpy(&batch->items[id].status, &status[id], sizeof(HSB_STATUS_T));
+
+	return _dispatch_batch(batch);
+}
+
 void _process_dev_act(HSB_ACT_T *act)
 {
 	int ret;
@@ -1789,6 +2400,13 @@ void _process_dev_act(HSB_ACT_T *act)
 	HSB_RESP_T resp = { 0 };
 	void *reply = act->reply;
 	resp.reply = reply;
+	resp.req_id = act->req_id;
+	resp.reply_gen = act->reply_gen;
+
+	if (act->batch) {
+		_process_batch_act(act);
+		return;
+	}
 
 	switch (type) {
 		case HSB_ACT_TYPE_PROBE:
@@ -1808,6 +2426,9 @@ void _process_dev_act(HSB_ACT_T *act)
 		{
 			HSB_STATUS_T *pstat = &act->u.status;
 			ret = set_dev_status(pstat);
+
+			_reply_merged_act(act, ret);
+
 			if (!reply)
 				return;
 
@@ -1864,85 +2485,42 @@ void _process_dev_act(HSB_ACT_T *act)
 	return;
 }
 
-static void *async_process_thread(thread_data_control *thread_data)
+/* the device tables alone, for init_dev_module() and misc/registry_bench */
+int init_dev_registry(void)
 {
-	HSB_ACT_T *data = NULL;
-
-	pthread_mutex_lock(&thread_data->mutex);
-	
-	while (thread_data->active)
-	{
-		while (0 == g_queue_get_length(thread_data->data_queue) &&
-			thread_data->active)
-		{
-			struct timespec ts;
-			clock_gettime(CLOCK_REALTIME, &ts);
-			ts.tv_sec++;
-			int error_no = pthread_cond_timedwait(&thread_data->cond, &thread_data->mutex, &ts);
-			if (ETIMEDOUT == error_no)
-				continue;
-		}
-
-		if (thread_data->active == FALSE)
-			break;
-
-		data = (HSB_ACT_T *)g_queue_pop_head(thread_data->data_queue);
-		pthread_mutex_unlock(&thread_data->mutex);
-		if (data == NULL)
-		{
-			pthread_mutex_lock(&thread_data->mutex);
-			continue;
-		}
-
-		/* process data */
-		_process_dev_act(data);
-
-		/* free data */
-		g_slice_free(HSB_ACT_T, data);
-
-		pthread_mutex_lock(&thread_data->mutex);
-	}
-
-	pthread_mutex_unlock(&thread_data->mutex);
-
-	return NULL;
-}
-
-static int init_private_thread(void)
-{
-	thread_data_control *tptr;
-
-	tptr = &gl_dev_cb.async_thread_ctl;
-
- 	thread_control_init(tptr);
-	thread_control_activate(tptr);
+	g_queue_init(&gl_dev_cb.queue);
+	g_mutex_init(&gl_dev_cb.mutex);
+	g_queue_init(&gl_dev_cb.driverq);
+	g_queue_init(&gl_dev_cb.offq);
 
-	pthread_t thread_id;
-	if (pthread_create(&tptr->thread_id, NULL, (thread_entry_func)async_process_thread, tptr))
-	{
-		hsb_critical("create async thread failed\n");
-		return -1;
-	}
+	gl_dev_cb.id_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+	gl_dev_cb.mac_table = g_hash_table_new(_mac_hash, _mac_equal);
+	gl_dev_cb.ip_table = g_hash_table_new(g_direct_hash, g_direct_equal);
 
-	return 0;
+	return HSB_E_OK;
 }
 
 int init_dev_module(void)
 {
-	g_queue_init(&gl_dev_cb.queue);
-	g_mutex_init(&gl_dev_cb.mutex);
-	g_queue_init(&gl_dev_cb.driverq);
-	g_queue_init(&gl_dev_cb.offq);
+	init_dev_registry();
 
 	init_scene();
+	init_timer_sched();
+	init_linkage();
 
 	/* reserve hsb id=0 */
 	gl_dev_cb.dev_id = 1;
 
-	init_private_thread();
+	init_action();
 
 	load_config();
 
+	gl_dev_cb.last_check = time(NULL);
+
+	HSB_DEVICE_CB_LOCK();
+	_sched_all_dev(gl_dev_cb.last_check);
+	HSB_DEVICE_CB_UNLOCK();
+
 	init_virtual_switch_drv();
 	init_cz_drv();
 	init_ir_drv();
@@ -1959,6 +2537,8 @@ int get_dev_timer(uint32_t dev_id, uint16_t timer_id, HSB_TIMER_T *timer)
 	HSB_DEV_T *dev;
 	int ret = HSB_E_OK;
 
+	HSB_DEVICE_CB_LOCK();
+
 	dev = find_dev(dev_id);
 
 	if (!dev) {
@@ -1977,6 +2557,8 @@ int get_dev_timer(uint32_t dev_id, uint16_t timer_id, HSB_TIMER_T *timer)
 	memcpy(timer, tm, sizeof(*tm));
 
 _out:
+	HSB_DEVICE_CB_UNLOCK();
+
 	return ret;
 }
 
@@ -1986,6 +2568,8 @@ int set_dev_timer(uint32_t dev_id, const HSB_TIMER_T *timer)
 	int ret = HSB_E_OK;
 	uint16_t timer_id = timer->id;
 
+	HSB_DEVICE_CB_LOCK();
+
 	dev = find_dev(dev_id);
 
 	if (!dev) {
@@ -2006,9 +2590,14 @@ int set_dev_timer(uint32_t dev_id, const HSB_TIMER_T *timer)
 	status->active = true;
 	status->expired = false;
 
-	save_config();
+	_sched_dev_timer(dev, timer_id, time(NULL));
 
 _out:
+	HSB_DEVICE_CB_UNLOCK();
+
+	if (HSB_E_OK == ret)
+		save_config();
+
 	return ret;
 }
 
@@ -2017,6 +2606,8 @@ int del_dev_timer(uint32_t dev_id, uint16_t timer_id)
 	HSB_DEV_T *dev;
 	int ret = HSB_E_OK;
 
+	HSB_DEVICE_CB_LOCK();
+
 	dev = find_dev(dev_id);
 
 	if (!dev) {
@@ -2035,9 +2626,14 @@ int del_dev_timer(uint32_t dev_id, uint16_t timer_id)
 	memset(tm, 0, sizeof(*tm));
 	memset(status, 0, sizeof(*status));
 
-	save_config();
+	timer_sched_del(dev_id, HSB_SCHED_TYPE_TIMER, timer_id);
 
 _out:
+	HSB_DEVICE_CB_UNLOCK();
+
+	if (HSB_E_OK == ret)
+		save_config();
+
 	return ret;
 }
 
@@ -2046,6 +2642,8 @@ int get_dev_delay(uint32_t dev_id, uint16_t delay_id, HSB_DELAY_T *delay)
 	HSB_DEV_T *dev;
 	int ret = HSB_E_OK;
 
+	HSB_DEVICE_CB_LOCK();
+
 	dev = find_dev(dev_id);
 
 	if (!dev) {
@@ -2069,6 +2667,8 @@ int get_dev_delay(uint32_t dev_id, uint16_t delay_id, HSB_DELAY_T *delay)
 	memcpy(delay, dl, sizeof(*dl));
 
 _out:
+	HSB_DEVICE_CB_UNLOCK();
+
 	return ret;
 }
 
@@ -2078,6 +2678,8 @@ int set_dev_delay(uint32_t dev_id, const HSB_DELAY_T *delay)
 	int ret = HSB_E_OK;
 	uint16_t delay_id = delay->id;
 
+	HSB_DEVICE_CB_LOCK();
+
 	dev = find_dev(dev_id);
 
 	if (!dev) {
@@ -2096,7 +2698,14 @@ int set_dev_delay(uint32_t dev_id, const HSB_DELAY_T *delay)
 	memcpy(dl, delay, sizeof(*dl));
 	status->active = true;
 
+	/* a running delay keeps its start time with the new length */
+	if (status->started)
+		timer_sched_set(dev_id, HSB_SCHED_TYPE_DELAY, delay_id,
+				status->start_tm + dl->delay_sec);
+
 _out:
+	HSB_DEVICE_CB_UNLOCK();
+
 	return ret;
 }
 
@@ -2105,6 +2714,8 @@ int del_dev_delay(uint32_t dev_id, uint16_t delay_id)
 	HSB_DEV_T *dev;
 	int ret = HSB_E_OK;
 
+	HSB_DEVICE_CB_LOCK();
+
 	dev = find_dev(dev_id);
 
 	if (!dev) {
@@ -2127,286 +2738,117 @@ int del_dev_delay(uint32_t dev_id, uint16_t delay_id)
 
 	memset(dl, 0, sizeof(*dl));
 	status->active = false;
+	status->started = false;
+
+	timer_sched_del(dev_id, HSB_SCHED_TYPE_DELAY, delay_id);
 
 _out:
+	HSB_DEVICE_CB_UNLOCK();
+
 	return ret;
 }
 
-int get_dev_linkage(uint32_t dev_id, uint16_t link_id, HSB_LINKAGE_T *link)
+static void _fire_dev_timer(uint32_t devid, uint16_t id, time_t fire_tm, time_t now)
 {
-	HSB_DEV_T *dev;
-	int ret = HSB_E_OK;
-
-	dev = find_dev(dev_id);
-
-	if (!dev) {
-		ret = HSB_E_BAD_PARAM;
-		goto _out;
-	}
-
-	if (link_id >= (sizeof(dev->link) / sizeof(dev->link[0]))) {
-		ret = HSB_E_BAD_PARAM;
-		goto _out;
-	}
+	HSB_WORK_MODE_T work_mode = gl_dev_cb.work_mode;
+	HSB_TIMER_T *ptimer;
+	HSB_DEV_T *pdev;
 
-	HSB_LINKAGE_T *lk = &dev->link[link_id];
-	HSB_LINKAGE_STATUS_T *status = &dev->link_status[link_id];
+	HSB_DEVICE_CB_LOCK();
 
-	if (!status->active) {
-		ret = HSB_E_BAD_PARAM;
-		goto _out;
+	pdev = g_hash_table_lookup(gl_dev_cb.id_table, GUINT_TO_POINTER(devid));
+	if (!pdev || id >= HSB_DEV_MAX_TIMER_NUM || !pdev->timer_status[id].active) {
+		HSB_DEVICE_CB_UNLOCK();
+		return;
 	}
 
-	memcpy(link, lk, sizeof(*lk));
+	ptimer = &pdev->timer[id];
 
-_out:
-	return ret;
-
-}
+	if (now - fire_tm > HSB_TIMER_CATCHUP_SEC) {
+		hsb_debug("dev %d timer %d missed by %d sec\n", devid, id, (int)(now - fire_tm));
+	} else if (pdev->state == HSB_DEV_STATE_ONLINE &&
+		   CHECK_BIT(pdev->work_mode, work_mode) &&
+		   CHECK_BIT(ptimer->work_mode, work_mode)) {
+		do_dev_act_async(devid, ptimer->flag, ptimer->act_id,
+				ptimer->act_param1, ptimer->act_param2);
 
-int set_dev_linkage(uint32_t dev_id, const HSB_LINKAGE_T *link)
-{
-	HSB_DEV_T *dev;
-	int ret = HSB_E_OK;
-	uint16_t link_id = link->id;
-
-	dev = find_dev(dev_id);
-
-	if (!dev) {
-		ret = HSB_E_BAD_PARAM;
-		goto _out;
-	}
+		hsb_debug("timer expired\n");
 
-	if (link_id >= (sizeof(dev->link) / sizeof(dev->link[0]))) {
-		ret = HSB_E_BAD_PARAM;
-		goto _out;
+		if (CHECK_BIT(ptimer->wday, 7)) { /* One shot */
+			pdev->timer_status[id].active = false;
+			pdev->timer_status[id].expired = true;
+			HSB_DEVICE_CB_UNLOCK();
+			return;
+		}
 	}
 
-	HSB_LINKAGE_T *lk = &dev->link[link_id];
-	HSB_LINKAGE_STATUS_T *status = &dev->link_status[link_id];
-
-	memcpy(lk, link, sizeof(*lk));
-	status->active = true;
+	/* missed runs are not replayed, go on with the next occurrence */
+	_sched_dev_timer(pdev, id, MAX(now, fire_tm));
 
-_out:
-	return ret;
+	HSB_DEVICE_CB_UNLOCK();
 }
 
-
-int del_dev_linkage(uint32_t dev_id, uint16_t link_id)
+static void _fire_dev_delay(uint32_t devid, uint16_t id)
 {
-	HSB_DEV_T *dev;
-	int ret = HSB_E_OK;
-
-	dev = find_dev(dev_id);
+	HSB_WORK_MODE_T work_mode = gl_dev_cb.work_mode;
+	HSB_DELAY_T *pdelay;
+	HSB_DELAY_STATUS_T *dstatus;
+	HSB_DEV_T *pdev;
 
-	if (!dev) {
-		ret = HSB_E_BAD_PARAM;
-		goto _out;
-	}
+	HSB_DEVICE_CB_LOCK();
 
-	if (link_id >= (sizeof(dev->link) / sizeof(dev->link[0]))) {
-		ret = HSB_E_BAD_PARAM;
-		goto _out;
+	pdev = g_hash_table_lookup(gl_dev_cb.id_table, GUINT_TO_POINTER(devid));
+	if (!pdev || id >= HSB_DEV_MAX_DELAY_NUM) {
+		HSB_DEVICE_CB_UNLOCK();
+		return;
 	}
 
-	HSB_LINKAGE_T *lk = &dev->link[link_id];
-	HSB_LINKAGE_STATUS_T *status = &dev->link_status[link_id];
+	pdelay = &pdev->delay[id];
+	dstatus = &pdev->delay_status[id];
 
-	if (!status->active) {
-		ret = HSB_E_BAD_PARAM;
-		goto _out;
+	if (dstatus->active && dstatus->started &&
+	    pdev->state == HSB_DEV_STATE_ONLINE &&
+	    CHECK_BIT(pdelay->work_mode, work_mode)) {
+		do_dev_act_async(devid, pdelay->flag, pdelay->act_id,
+				pdelay->act_param1, pdelay->act_param2);
 	}
 
-	memset(lk, 0, sizeof(*lk));
-	status->active = false;
+	dstatus->started = false;
 
-_out:
-	return ret;
-}
-
-static int compare_date(HSB_TIMER_T *ptimer, struct tm *tm_now)
-{
-	if (ptimer->year == 0 &&
-		ptimer->mon == 0 &&
-		ptimer->mday == 0)
-	{
-		return -1;
-	}
-
-	
-	if (tm_now->tm_year == ptimer->year &&
-		tm_now->tm_mon == ptimer->mon &&
-		tm_now->tm_mday == ptimer->mday)
-	{
-		return 0;
-	}
-
-	return 1;
+	HSB_DEVICE_CB_UNLOCK();
 }
 
-
-static void _check_dev_timer_and_delay(void *data, void *user_data)
+int check_timer_and_delay(void)
 {
-	HSB_DEV_T *pdev = (HSB_DEV_T *)data;
-
-	if (!pdev) {
-		hsb_critical("null device\n");
-		return;
-	}
-
-	HSB_WORK_MODE_T work_mode = gl_dev_cb.work_mode;
-
 	time_t now = time(NULL);
-	struct tm tm_now;
-	localtime_r(&now, &tm_now);
-	uint32_t sec_today = tm_now.tm_hour * 3600 + tm_now.tm_min * 60 + tm_now.tm_sec;
-	uint32_t sec_timer;
-	bool bnextday = false;
-	int cnt, ret;
-	uint8_t flag, weekday;
-	HSB_TIMER_T *ptimer = pdev->timer;
-	HSB_TIMER_STATUS_T *tstatus = pdev->timer_status;
-	HSB_DELAY_T *pdelay = pdev->delay;
-	HSB_DELAY_STATUS_T *dstatus = pdev->delay_status;
-
-	if (sec_today < gl_dev_cb.sec_today && sec_today < 10) {
-		bnextday = true;
-		
-		for (cnt = 0; cnt < HSB_DEV_MAX_TIMER_NUM; cnt++, ptimer++, tstatus++) {
-			flag = ptimer->flag;
-			//if (!tstatus->active)
-			if (!CHECK_BIT(flag, 1))
-				continue;
-
-			ret = compare_date(ptimer, &tm_now);
-			if (0 == ret) {
-				tstatus->expired = false;
-			} else if (1 == ret) {
-				tstatus->expired = true;
-			} else if (-1 == ret) {
-				weekday = ptimer->wday;
-				if (!CHECK_BIT(weekday, tm_now.tm_wday))
-					tstatus->expired = true;
-				else
-					tstatus->expired = false;
-			}
-		}
-	}
-
-	gl_dev_cb.sec_today = sec_today;
-
-	if (!CHECK_BIT(pdev->work_mode, work_mode))
-		return;
-
-	ptimer = pdev->timer;
-	tstatus = pdev->timer_status;
-
-	for (cnt = 0; cnt < HSB_DEV_MAX_TIMER_NUM; cnt++, ptimer++, tstatus++) {
-		flag = ptimer->flag;
-		/* 1.chekc active & expired */
-		//if (!tstatus->active || tstatus->expired)
-		if (!CHECK_BIT(flag, 1) || tstatus->expired)
-			continue;
-
-		/* 2.check work mode */
-		if (!CHECK_BIT(ptimer->work_mode, work_mode))
-			continue;
-
-		/* 3.check flag & weekday */
-		weekday = ptimer->wday;
-		ret = compare_date(ptimer, &tm_now);
-
-		if (-1 == ret) {
-			if (!CHECK_BIT(weekday, tm_now.tm_wday)) {
-				continue;
-			}
-		} else if (1 == ret) {
-			tstatus->expired = true;
-			continue;
-		}
-
-		/* 4.check time */
-		sec_timer = ptimer->hour * 3600 + ptimer->min * 60 + ptimer->sec;
-
-		if (sec_timer > sec_today || sec_today - sec_timer > 5)
-			continue;
-
-		/* 5.do action */
-		if (CHECK_BIT(flag, 0)) {
-			HSB_ACTION_T action;
-			action.devid = pdev->id;
-			action.id = ptimer->act_id;
-			action.param1 = ptimer->act_param1;
-			action.param2 = ptimer->act_param2;
-			set_dev_action_async(&action, NULL);
-		} else  {
-			HSB_STATUS_T stat;
-			stat.devid = pdev->id;
-			stat.num = 1;
-			stat.id[0] = ptimer->act_id;
-			stat.val[0] = ptimer->act_param1;
-			set_dev_status_async(&stat, NULL);
-		}
-
-		hsb_debug("timer expired\n");
+	HSB_SCHED_TYPE_T type;
+	uint32_t devid;
+	uint16_t id;
+	time_t fire_tm;
 
-		if (CHECK_BIT(weekday, 7)) { /* One shot */
-			//memset(ptimer, 0, sizeof(*ptimer));
-			tstatus->active = false;
-			tstatus->expired = true;
-			continue;
-		}
+	/* wall clock stepped back, the scheduled fire times are stale */
+	if (now < gl_dev_cb.last_check) {
+		hsb_debug("clock stepped back %d sec\n", (int)(gl_dev_cb.last_check - now));
 
-		tstatus->expired = true;
+		HSB_DEVICE_CB_LOCK();
+		_sched_all_dev(now);
+		HSB_DEVICE_CB_UNLOCK();
 	}
 
-	pdelay = pdev->delay;
-	dstatus = pdev->delay_status;
-
-	for (cnt = 0; cnt < HSB_DEV_MAX_DELAY_NUM; cnt++, pdelay++, dstatus++) {
-		/* check active & started */
-		if (!dstatus->active || !dstatus->started)
-			continue;
-
-		/* check work mode */
-		if (!CHECK_BIT(pdelay->work_mode, work_mode))
-			continue;
-
-		/* check time */
-		if (now - dstatus->start_tm < pdelay->delay_sec)
-			continue;
-
-		/* do action */
-		flag = pdelay->flag;
-		if (CHECK_BIT(flag, 0)) {
-			HSB_ACTION_T action;
-			action.devid = pdev->id;
-			action.id = pdelay->act_id;
-			action.param1 = pdelay->act_param1;
-			action.param2 = pdelay->act_param2;
-			set_dev_action_async(&action, NULL);
-		} else  {
-			HSB_STATUS_T stat;
-			stat.devid = pdev->id;
-			stat.num = 1;
-			stat.id[0] = pdelay->act_id;
-			stat.val[0] = pdelay->act_param1;
-			set_dev_status_async(&stat, NULL);
-		}
+	gl_dev_cb.last_check = now;
 
-		dstatus->started = false;
+	while (HSB_E_OK == timer_sched_pop(now, &devid, &type, &id, &fire_tm)) {
+		if (HSB_SCHED_TYPE_TIMER == type)
+			_fire_dev_timer(devid, id, fire_tm, now);
+		else
+			_fire_dev_delay(devid, id);
 	}
 
-	return;
-}
-
-int check_timer_and_delay(void)
-{
-	GQueue *queue = &gl_dev_cb.queue;
-	g_queue_foreach(queue, _check_dev_timer_and_delay, NULL);
+	/* finish grace periods left open when no writer came by */
+	HSB_DEVICE_CB_LOCK();
+	_reclaim_dev();
+	HSB_DEVICE_CB_UNLOCK();
 
 	return HSB_E_OK;
 }
 
-
@@ -41,6 +41,25 @@ typedef struct {
 	uint16_t		cmd;
 } HSB_RESULT_T;
 
+/* at most this many devices in one batch command */
+#define HSB_STATUS_BATCH_MAX	(64)
+
+typedef struct {
+	int		ret;
+	HSB_STATUS_T	status;
+} HSB_STATUS_BATCH_ITEM_T;
+
+/* one batch command, its reply goes out when the last device is done */
+typedef struct {
+	uint16_t		cmd;		/* HSB_CMD_GET/SET_STATUS_BATCH */
+	void			*reply;
+	uint32_t		req_id;
+	uint32_t		reply_gen;
+	gint			pending;
+	int			num;
+	HSB_STATUS_BATCH_ITEM_T	items[];
+} HSB_STATUS_BATCH_T;
+
 typedef enum {
 	HSB_ACT_TYPE_PROBE = 0,
 	HSB_ACT_TYPE_SET_STATUS,
@@ -51,11 +70,20 @@ typedef enum {
 typedef struct {
 	HSB_ACT_TYPE_T		type;
 	void			*reply;
+	uint32_t		req_id;		/* client request id, 0 none */
+	uint32_t		reply_gen;	/* connection of @reply that sent it */
 	union {
 		HSB_PROBE_T	probe;
 		HSB_STATUS_T	status;
 		HSB_ACTION_T	action;
 	} u;
+
+	GList			node;		/* link in the device action queue */
+	int			prio;		/* HSB_ACT_PRIO_T */
+	gint64			enq_time;	/* monotonic usec */
+	GQueue			merged;		/* set-status requests folded into this one */
+	HSB_STATUS_BATCH_T	*batch;		/* part of a batch command */
+	int			batch_idx;
 } HSB_ACT_T;
 
 typedef enum {
@@ -63,21 +91,29 @@ typedef enum {
 	HSB_RESP_TYPE_EVENT,
 	HSB_RESP_TYPE_STATUS,
 	HSB_RESP_TYPE_STATUS_UPDATE,
+	HSB_RESP_TYPE_STATUS_BATCH,
+	HSB_RESP_TYPE_SNAPSHOT,		/* built when it is sent */
 } HSB_RESP_TYPE_T;
 
-typedef struct {
+typedef struct _HSB_RESP_T {
 	HSB_RESP_TYPE_T		type;
 	void			*reply;
+	uint32_t		req_id;		/* echoed to the client, 0 none */
+	uint32_t		reply_gen;	/* dropped unless @reply is still this connection */
 	union {
 		HSB_EVT_T	event;
 		HSB_STATUS_T	status;
 		HSB_RESULT_T	result;
+		HSB_STATUS_BATCH_T	*batch;	/* owned by the response */
 	} u;
+
+	gint64			rx_time;	/* alarm only, monotonic usec at driver receive */
+	uint32_t		seq;		/* broadcast sequence, 0 for direct replies */
+	struct _HSB_RESP_T	*next;		/* client notify queue link */
 } HSB_RESP_T;
 
 #define HSB_DEV_MAX_TIMER_NUM		(32)
 #define HSB_DEV_MAX_DELAY_NUM		(8)
-#define HSB_DEV_MAX_LINKAGE_NUM		(8)
 #define HSB_DEV_MAX_NAME_LEN		(16)
 #define HSB_DEV_MAX_LOCATION_LEN	(16)
 
@@ -182,10 +218,6 @@ typedef struct _HSB_LINKAGE_T {
 	uint32_t	act_param2;
 } HSB_LINKAGE_T;
 
-typedef struct {
-	bool		active;
-} HSB_LINKAGE_STATUS_T;
-
 typedef struct _HSB_DEV_T {
 	uint32_t		id;
 
@@ -206,9 +238,6 @@ typedef struct _HSB_DEV_T {
 	HSB_DELAY_T		delay[HSB_DEV_MAX_DELAY_NUM];
 	HSB_DELAY_STATUS_T	delay_status[HSB_DEV_MAX_DELAY_NUM];
 
-	HSB_LINKAGE_T		link[HSB_DEV_MAX_LINKAGE_NUM];
-	HSB_LINKAGE_STATUS_T	link_status[HSB_DEV_MAX_LINKAGE_NUM];
-
 	union {
 		struct in_addr	ip;
 	} prty;
@@ -223,12 +252,37 @@ typedef struct _HSB_DEV_T {
 	void			*priv_data;
 
 	uint64_t		op_msec;
+
+	GList			node;	/* link in the online queue or offq */
+	gint			ref;
 } HSB_DEV_T;
 
+/* return non-zero to stop the iteration */
+typedef int (*HSB_DEV_ITER_FUNC)(HSB_DEV_T *pdev, void *data);
+
+/* what a client needs to draw one device, copied under the lock */
+typedef struct {
+	uint32_t		id;
+	uint32_t		drvid;
+	uint32_t		state;
+	HSB_DEV_INFO_T		info;
+	HSB_DEV_CONFIG_T	config;
+	HSB_DEV_STATUS_T	status;
+} HSB_DEV_SNAP_T;
+
 int init_dev_module(void);
+int init_dev_registry(void);
+int foreach_dev(HSB_DEV_ITER_FUNC func, void *data);
 int get_dev_id_list(uint32_t *dev_id, int *dev_num);
+int get_dev_page(uint32_t cursor, HSB_DEV_SNAP_T *snap, int *num, bool *more);
+int get_dev_snapshot(HSB_DEV_SNAP_T **psnap, int *num, uint32_t *version,
+			HSB_WORK_MODE_T *mode);
 int get_dev_info(uint32_t dev_id, HSB_DEV_T *pdev);
 HSB_DEV_T *find_dev(uint32_t dev_id);
+HSB_DEV_T *get_dev(uint32_t dev_id);
+void put_dev(HSB_DEV_T *pdev);
+HSB_DEV_T *find_dev_by_mac(uint32_t drvid, uint8_t *mac);
+HSB_DEV_T *find_dev_by_ip(struct in_addr *ip);
 int get_dev_cfg(uint32_t dev_id, HSB_DEV_CONFIG_T *cfg);
 int set_dev_cfg(uint32_t dev_id, const HSB_DEV_CONFIG_T *cfg);
 
@@ -243,6 +297,14 @@ int probe_dev_async(const HSB_PROBE_T *probe, void *reply);
 int add_dev(uint32_t drv_id, HSB_DEV_TYPE_T dev_type, HSB_DEV_CONFIG_T *cfg);
 int del_dev(uint32_t devid);
 int set_dev_action_async(const HSB_ACTION_T *act, void *reply);
+int get_dev_status_batch_async(const uint32_t *devid, int num, void *reply);
+int set_dev_status_batch_async(const HSB_STATUS_T *status, int num, void *reply);
+void free_status_batch(HSB_STATUS_BATCH_T *batch);
+void _process_dev_act(HSB_ACT_T *act);
+int do_dev_act_async(uint32_t devid, uint8_t flag, uint16_t act_id,
+			uint16_t param1, uint32_t param2);
+int do_dev_alarm_act(uint32_t devid, uint8_t flag, uint16_t act_id,
+			uint16_t param1, uint32_t param2);
 
 int get_dev_timer(uint32_t dev_id, uint16_t timer_id, HSB_TIMER_T *timer);
 int set_dev_timer(uint32_t dev_id, const HSB_TIMER_T *timer);
@@ -250,9 +312,6 @@ int del_dev_timer(uint32_t dev_id, uint16_t timer_id);
 int get_dev_delay(uint32_t dev_id, uint16_t delay_id, HSB_DELAY_T *delay);
 int set_dev_delay(uint32_t dev_id, const HSB_DELAY_T *delay);
 int del_dev_delay(uint32_t dev_id, uint16_t delay_id);
-int get_dev_linkage(uint32_t dev_id, uint16_t link_id, HSB_LINKAGE_T *link);
-int set_dev_linkage(uint32_t dev_id, const HSB_LINKAGE_T *link);
-int del_dev_linkage(uint32_t dev_id, uint16_t link_id);
 
 HSB_DEV_T *alloc_dev(uint32_t devid);
 HSB_DEV_T *create_dev(void);
@@ -299,7 +358,6 @@ int get_dev_channel(uint32_t devid, char *name, uint32_t *cid);
 int get_dev_channel_num(uint32_t devid, int *num);
 int get_dev_channel_by_id(uint32_t devid, int id, char *name, uint32_t *cid);
 
-int report_all_device(void *data);
 
 int sync_dev_status(HSB_DEV_T *pdev, const HSB_STATUS_T *status);
 int load_dev_status(HSB_DEV_T *pdev, HSB_STATUS_T *status);
@@ -13,6 +13,7 @@
 #include "hsb_error.h"
 #include "hsb_config.h"
 #include "utils.h"
+#include "alarm.h"
 
 //#define CZ_TEST
 
@@ -785,6 +786,7 @@ static void *_monitor_thread(void *arg)
 		print_buf(rbuf + nread, ret);
 #endif
 
+		alarm_rx_stamp();
 		deal_recv_buf(rbuf, cmd_len);
 	}
 
@@ -9,6 +9,7 @@
 #include "thread_utils.h"
 #include "device.h"
 #include "hsb_error.h"
+#include "alarm.h"
 
 typedef struct {
 	GQueue	queue;
@@ -553,6 +554,7 @@ static void *_monitor_thread(void *arg)
 		/* get message */
 		dev_len = sizeof(struct sockaddr_in);
 		ret = recvfrom(fd, rbuf, cmd_len, 0, (struct sockaddr *)&dev_addr, &dev_len);
+		alarm_rx_stamp();
 
 		if (ret < 4)
 			continue;
@@ -0,0 +1,417 @@
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "linkage.h"
+#include "scene.h"
+#include "hsb_error.h"
+#include "hsb_config.h"
+#include "debug.h"
+
+/*
+ * Linkage rules are indexed twice: by the event they wait for, so an
+ * event only visits the rules it triggers, and by (source devid, link id)
+ * for the get/set/del commands. Source devid 0 is the box itself, e.g.
+ * for work mode changes. Status rules of one (devid, status id) share a
+ * bucket, so a status update only evaluates the predicates watching it.
+ */
+
+typedef struct {
+	uint32_t		devid;
+	uint16_t		evt_id;
+	uint16_t		evt_param1;
+	uint32_t		evt_param2;
+} HSB_LINKAGE_KEY_T;
+
+typedef struct {
+	HSB_LINKAGE_KEY_T	key;
+	GQueue			rules;
+} HSB_LINKAGE_BUCKET_T;
+
+typedef struct {
+	gint64			id;	/* devid << 32 | link id */
+	HSB_LINKAGE_T		link;
+	HSB_LINKAGE_BUCKET_T	*bucket;
+	GList			node;	/* link in bucket->rules */
+	gint			armed;	/* status rules: predicate was false */
+} HSB_LINKAGE_RULE_T;
+
+typedef struct {
+	GRWLock			lock;
+
+	GHashTable		*evt_table;	/* key -> HSB_LINKAGE_BUCKET_T */
+	GHashTable		*id_table;	/* id -> HSB_LINKAGE_RULE_T */
+} HSB_LINKAGE_CB_T;
+
+static HSB_LINKAGE_CB_T gl_link_cb = { 0 };
+
+#define LINKAGE_ID(devid, link_id)	(((gint64)(devid) << 32) | (link_id))
+
+static guint _key_hash(gconstpointer key)
+{
+	const HSB_LINKAGE_KEY_T *k = (const HSB_LINKAGE_KEY_T *)key;
+	guint hash = k->devid;
+
+	hash = hash * 31 + k->evt_id;
+	hash = hash * 31 + k->evt_param1;
+	hash = hash * 31 + k->evt_param2;
+
+	return hash;
+}
+
+static gboolean _key_equal(gconstpointer a, gconstpointer b)
+{
+	const HSB_LINKAGE_KEY_T *ka = (const HSB_LINKAGE_KEY_T *)a;
+	const HSB_LINKAGE_KEY_T *kb = (const HSB_LINKAGE_KEY_T *)b;
+
+	return (ka->devid == kb->devid &&
+		ka->evt_id == kb->evt_id &&
+		ka->evt_param1 == kb->evt_param1 &&
+		ka->evt_param2 == kb->evt_param2);
+}
+
+/* the helpers below must be called with the writer lock held */
+static void _link_rule(HSB_LINKAGE_RULE_T *rule)
+{
+	HSB_LINKAGE_KEY_T key;
+	HSB_LINKAGE_BUCKET_T *bucket;
+
+	key.devid = (uint32_t)(rule->id >> 32);
+	key.evt_id = rule->link.evt_id;
+	key.evt_param1 = rule->link.evt_param1;
+	key.evt_param2 = rule->link.evt_param2;
+
+	/* evt_param2 of a status rule is its predicate, not part of the key */
+	if (HSB_EVT_TYPE_STATUS_UPDATED == key.evt_id)
+		key.evt_param2 = 0;
+
+	bucket = g_hash_table_lookup(gl_link_cb.evt_table, &key);
+	if (!bucket) {
+		bucket = g_slice_new0(HSB_LINKAGE_BUCKET_T);
+		memcpy(&bucket->key, &key, sizeof(key));
+		g_queue_init(&bucket->rules);
+
+		g_hash_table_insert(gl_link_cb.evt_table, &bucket->key, bucket);
+	}
+
+	rule->bucket = bucket;
+	rule->node.data = rule;
+	g_queue_push_tail_link(&bucket->rules, &rule->node);
+}
+
+static void _unlink_rule(HSB_LINKAGE_RULE_T *rule)
+{
+	HSB_LINKAGE_BUCKET_T *bucket = rule->bucket;
+
+	g_queue_unlink(&bucket->rules, &rule->node);
+	rule->bucket = NULL;
+
+	if (g_queue_is_empty(&bucket->rules)) {
+		g_hash_table_remove(gl_link_cb.evt_table, &bucket->key);
+		g_slice_free(HSB_LINKAGE_BUCKET_T, bucket);
+	}
+}
+
+static bool _status_match(uint32_t param2, uint16_t val)
+{
+	uint16_t ref = HSB_LINKAGE_STATUS_VAL(param2);
+
+	switch (HSB_LINKAGE_STATUS_EXPR(param2)) {
+		case HSB_SCENE_EXPR_EQUAL:
+			return (val == ref);
+		case HSB_SCENE_EXPR_GT:
+			return (val > ref);
+		case HSB_SCENE_EXPR_GE:
+			return (val >= ref);
+		case HSB_SCENE_EXPR_LT:
+			return (val < ref);
+		case HSB_SCENE_EXPR_LE:
+			return (val <= ref);
+		default:
+			break;
+	}
+
+	return false;
+}
+
+/* the value left the triggered range by at least the hysteresis */
+static bool _status_rearm(uint32_t param2, uint16_t val)
+{
+	int ref = HSB_LINKAGE_STATUS_VAL(param2);
+	int hyst = HSB_LINKAGE_STATUS_HYST(param2);
+
+	switch (HSB_LINKAGE_STATUS_EXPR(param2)) {
+		case HSB_SCENE_EXPR_EQUAL:
+			return (val != ref);
+		case HSB_SCENE_EXPR_GT:
+			return (val <= ref - hyst);
+		case HSB_SCENE_EXPR_GE:
+			return (val < ref - hyst);
+		case HSB_SCENE_EXPR_LT:
+			return (val >= ref + hyst);
+		case HSB_SCENE_EXPR_LE:
+			return (val > ref + hyst);
+		default:
+			break;
+	}
+
+	return false;
+}
+
+/* arm the rule unless the device already sits in the triggered range */
+static gint _status_armed(uint32_t dev_id, const HSB_LINKAGE_T *link)
+{
+	HSB_DEV_T *pdev = get_dev(dev_id);
+	gint armed = TRUE;
+
+	if (!pdev)
+		return armed;
+
+	if (link->evt_param1 < pdev->status.num &&
+	    _status_match(link->evt_param2, pdev->status.val[link->evt_param1]))
+		armed = FALSE;
+
+	put_dev(pdev);
+
+	return armed;
+}
+
+int init_linkage(void)
+{
+	g_rw_lock_init(&gl_link_cb.lock);
+
+	gl_link_cb.evt_table = g_hash_table_new(_key_hash, _key_equal);
+	gl_link_cb.id_table = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+	return HSB_E_OK;
+}
+
+static int _check_linkage(const HSB_EVT_T *evt, bool alarm)
+{
+	HSB_WORK_MODE_T work_mode = get_box_work_mode();
+	HSB_LINKAGE_BUCKET_T *bucket;
+	HSB_LINKAGE_RULE_T *rule;
+	HSB_LINKAGE_KEY_T key;
+	HSB_DEV_T *pdev;
+	GList *node;
+
+	if (evt->devid) {
+		pdev = get_dev(evt->devid);
+		if (!pdev)
+			return HSB_E_OTHERS;
+
+		if (!CHECK_BIT(pdev->work_mode, work_mode)) {
+			put_dev(pdev);
+			return HSB_E_OTHERS;
+		}
+
+		put_dev(pdev);
+	}
+
+	key.devid = evt->devid;
+	key.evt_id = evt->id;
+	key.evt_param1 = evt->param1;
+	key.evt_param2 = evt->param2;
+
+	g_rw_lock_reader_lock(&gl_link_cb.lock);
+
+	bucket = g_hash_table_lookup(gl_link_cb.evt_table, &key);
+	if (bucket) {
+		for (node = bucket->rules.head; node; node = node->next) {
+			rule = (HSB_LINKAGE_RULE_T *)node->data;
+
+			if (!CHECK_BIT(rule->link.work_mode, work_mode))
+				continue;
+
+			if (alarm)
+				do_dev_alarm_act(rule->link.act_devid, rule->link.flag,
+						rule->link.act_id, rule->link.act_param1,
+						rule->link.act_param2);
+			else
+				do_dev_act_async(rule->link.act_devid, rule->link.flag,
+						rule->link.act_id, rule->link.act_param1,
+						rule->link.act_param2);
+		}
+	}
+
+	g_rw_lock_reader_unlock(&gl_link_cb.lock);
+
+	return HSB_E_OK;
+}
+
+int check_linkage(const HSB_EVT_T *evt)
+{
+	return _check_linkage(evt, false);
+}
+
+/* sirens and lights of a guard mode alarm go ahead of queued work */
+int check_alarm_linkage(const HSB_EVT_T *evt)
+{
+	return _check_linkage(evt, true);
+}
+
+int check_status_linkage(uint32_t dev_id, const HSB_STATUS_T *status)
+{
+	HSB_WORK_MODE_T work_mode = get_box_work_mode();
+	HSB_LINKAGE_BUCKET_T *bucket;
+	HSB_LINKAGE_RULE_T *rule;
+	HSB_LINKAGE_KEY_T key;
+	HSB_DEV_T *pdev;
+	GList *node;
+	uint16_t val;
+	int cnt;
+
+	pdev = get_dev(dev_id);
+	if (!pdev)
+		return HSB_E_OTHERS;
+
+	if (!CHECK_BIT(pdev->work_mode, work_mode)) {
+		put_dev(pdev);
+		return HSB_E_OTHERS;
+	}
+
+	put_dev(pdev);
+
+	key.devid = dev_id;
+	key.evt_id = HSB_EVT_TYPE_STATUS_UPDATED;
+	key.evt_param2 = 0;
+
+	g_rw_lock_reader_lock(&gl_link_cb.lock);
+
+	for (cnt = 0; cnt < status->num; cnt++) {
+		key.evt_param1 = status->id[cnt];
+		val = status->val[cnt];
+
+		bucket = g_hash_table_lookup(gl_link_cb.evt_table, &key);
+		if (!bucket)
+			continue;
+
+		for (node = bucket->rules.head; node; node = node->next) {
+			rule = (HSB_LINKAGE_RULE_T *)node->data;
+
+			if (!_status_match(rule->link.evt_param2, val)) {
+				if (_status_rearm(rule->link.evt_param2, val))
+					g_atomic_int_set(&rule->armed, TRUE);
+				continue;
+			}
+
+			/* edge triggered, only the update that arms off fires */
+			if (!g_atomic_int_compare_and_exchange(&rule->armed, TRUE, FALSE))
+				continue;
+
+			if (!CHECK_BIT(rule->link.work_mode, work_mode))
+				continue;
+
+			do_dev_act_async(rule->link.act_devid, rule->link.flag,
+					rule->link.act_id, rule->link.act_param1,
+					rule->link.act_param2);
+		}
+	}
+
+	g_rw_lock_reader_unlock(&gl_link_cb.lock);
+
+	return HSB_E_OK;
+}
+
+int get_dev_linkage(uint32_t dev_id, uint16_t link_id, HSB_LINKAGE_T *link)
+{
+	HSB_LINKAGE_RULE_T *rule;
+	gint64 id = LINKAGE_ID(dev_id, link_id);
+	int ret = HSB_E_OK;
+
+	g_rw_lock_reader_lock(&gl_link_cb.lock);
+
+	rule = g_hash_table_lookup(gl_link_cb.id_table, &id);
+	if (rule)
+		memcpy(link, &rule->link, sizeof(*link));
+	else
+		ret = HSB_E_BAD_PARAM;
+
+	g_rw_lock_reader_unlock(&gl_link_cb.lock);
+
+	return ret;
+}
+
+int set_dev_linkage(uint32_t dev_id, const HSB_LINKAGE_T *link)
+{
+	HSB_LINKAGE_RULE_T *rule;
+	gint64 id = LINKAGE_ID(dev_id, link->id);
+
+	if (dev_id && !find_dev(dev_id))
+		return HSB_E_BAD_PARAM;
+
+	if (HSB_EVT_TYPE_STATUS_UPDATED == link->evt_id &&
+	    (0 == dev_id || HSB_LINKAGE_STATUS_EXPR(link->evt_param2) > HSB_SCENE_EXPR_LE))
+		return HSB_E_BAD_PARAM;
+
+	g_rw_lock_writer_lock(&gl_link_cb.lock);
+
+	rule = g_hash_table_lookup(gl_link_cb.id_table, &id);
+	if (rule) {
+		_unlink_rule(rule);
+	} else {
+		rule = g_slice_new0(HSB_LINKAGE_RULE_T);
+		rule->id = id;
+
+		g_hash_table_insert(gl_link_cb.id_table, &rule->id, rule);
+	}
+
+	memcpy(&rule->link, link, sizeof(*link));
+	_link_rule(rule);
+
+	if (HSB_EVT_TYPE_STATUS_UPDATED == link->evt_id)
+		rule->armed = _status_armed(dev_id, link);
+
+	g_rw_lock_writer_unlock(&gl_link_cb.lock);
+
+	return HSB_E_OK;
+}
+
+int del_dev_linkage(uint32_t dev_id, uint16_t link_id)
+{
+	HSB_LINKAGE_RULE_T *rule;
+	gint64 id = LINKAGE_ID(dev_id, link_id);
+
+	g_rw_lock_writer_lock(&gl_link_cb.lock);
+
+	rule = g_hash_table_lookup(gl_link_cb.id_table, &id);
+	if (!rule) {
+		g_rw_lock_writer_unlock(&gl_link_cb.lock);
+		return HSB_E_BAD_PARAM;
+	}
+
+	g_hash_table_remove(gl_link_cb.id_table, &id);
+	_unlink_rule(rule);
+
+	g_rw_lock_writer_unlock(&gl_link_cb.lock);
+
+	g_slice_free(HSB_LINKAGE_RULE_T, rule);
+
+	return HSB_E_OK;
+}
+
+/* drop the rules triggered by a removed device */
+int del_linkage_by_dev(uint32_t dev_id)
+{
+	HSB_LINKAGE_RULE_T *rule;
+	GHashTableIter iter;
+	gpointer key, value;
+
+	g_rw_lock_writer_lock(&gl_link_cb.lock);
+
+	g_hash_table_iter_init(&iter, gl_link_cb.id_table);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		rule = (HSB_LINKAGE_RULE_T *)value;
+		if ((uint32_t)(rule->id >> 32) != dev_id)
+			continue;
+
+		g_hash_table_iter_remove(&iter);
+		_unlink_rule(rule);
+		g_slice_free(HSB_LINKAGE_RULE_T, rule);
+	}
+
+	g_rw_lock_writer_unlock(&gl_link_cb.lock);
+
+	return HSB_E_OK;
+}
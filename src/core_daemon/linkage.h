@@ -0,0 +1,28 @@
+#ifndef _LINKAGE_H_
+#define _LINKAGE_H_
+
+#include <glib.h>
+#include <stdint.h>
+#include "device.h"
+
+/*
+ * A linkage with evt_id HSB_EVT_TYPE_STATUS_UPDATED watches status
+ * evt_param1 of its source device and fires when the predicate packed in
+ * evt_param2 turns true. It re-arms once the value has moved back past
+ * the threshold by the hysteresis.
+ */
+#define HSB_LINKAGE_STATUS_VAL(param2)		((param2) & 0xFFFF)
+#define HSB_LINKAGE_STATUS_EXPR(param2)		(((param2) >> 16) & 0xFF)	/* HSB_SCENE_EXPR_T */
+#define HSB_LINKAGE_STATUS_HYST(param2)		(((param2) >> 24) & 0xFF)
+
+int init_linkage(void);
+int check_linkage(const HSB_EVT_T *evt);
+int check_alarm_linkage(const HSB_EVT_T *evt);
+int check_status_linkage(uint32_t dev_id, const HSB_STATUS_T *status);
+int del_linkage_by_dev(uint32_t dev_id);
+
+int get_dev_linkage(uint32_t dev_id, uint16_t link_id, HSB_LINKAGE_T *link);
+int set_dev_linkage(uint32_t dev_id, const HSB_LINKAGE_T *link);
+int del_dev_linkage(uint32_t dev_id, uint16_t link_id);
+
+#endif /* _LINKAGE_H_ */
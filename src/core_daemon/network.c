@@ -1,4 +1,5 @@
 
+#define _GNU_SOURCE	/* recvmmsg, sendmmsg */
 #include <stdint.h>
 #include <stdio.h>
 #include <sys/time.h>
@@ -7,6 +8,12 @@
 #include <pthread.h>
 #include <string.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
 #include "debug.h"
 #include "hsb_error.h"
 #include "hsb_config.h"
@@ -15,7 +22,12 @@
 #include "network.h"
 #include "network_utils.h"
 #include "net_protocol.h"
+#include "net_codec.h"
 #include "scene.h"
+#include "linkage.h"
+#include "alarm.h"
+#include "action.h"
+#include "obj_pool.h"
 #include "utils.h"
 
 #define MAKE_CMD_HDR(_buf, _cmd, _len)	do { \
@@ -26,6 +38,18 @@
 #define REPLY_OK	(1)
 #define REPLY_FAIL	(0)
 
+#define REPLY_BUF_SIZE	(1024)
+#define GET_DEVS_MAX	((REPLY_BUF_SIZE - 4) / 4)
+/* a device takes at most 60 + 8 * 4 bytes in a page */
+#define DEV_REC_MAX	(60 + 8 * 4)
+#define DEV_PAGE_NUM	(10)
+
+static uint8_t *_reply_room(void *reply);
+static void _reply_commit(void *reply, int len);
+static uint8_t *_reply_next(void *reply, int len);
+static int _client_hello(void *reply, uint8_t *buf, int len, uint8_t *rbuf);
+static int _client_subscribe(void *reply, uint8_t *buf, int len, uint8_t *rbuf);
+
 static int check_tcp_pkt_valid(uint8_t *buf, int len)
 {
 	if (!buf || len <= 0)
@@ -45,15 +69,13 @@ static int check_tcp_pkt_valid(uint8_t *buf, int len)
 
 static int _reply_result(uint8_t *buf, int errcode, uint32_t devid, uint16_t cmd)
 {
-	int len = 12;
-
-	MAKE_CMD_HDR(buf, HSB_CMD_RESULT, len);
-
-	SET_CMD_FIELD(buf, 4, uint32_t, devid);
-	SET_CMD_FIELD(buf, 8, uint16_t, cmd);
-	SET_CMD_FIELD(buf, 10, uint16_t, errcode);
+	HSB_MSG_RESULT_T msg = {
+		.devid = devid,
+		.cmd = cmd,
+		.ret = errcode,
+	};
 
-	return len;
+	return hsb_msg_result_encode(buf, HSB_CMD_RESULT, &msg);
 }
 
 static int _reply_dev_id_list(uint8_t *buf, uint32_t *dev_id, int dev_num)
@@ -70,42 +92,96 @@ static int _reply_dev_id_list(uint8_t *buf, uint32_t *dev_id, int dev_num)
 	return len;
 }
 
-static int _reply_get_device_info(uint8_t *buf, HSB_DEV_T *dev)
+#define DEV_RECORD_LEN(_snap)	(60 + 4 * (_snap)->status.num)
+
+/*
+ * [devid][drvid][cls][interface][dev_type][mac 8][state][n][rsv 2]
+ * [name 16][location 16][n * (id, val)]
+ */
+static int _put_dev_record(uint8_t *buf, HSB_DEV_SNAP_T *pdev)
 {
-	int len = 26;
+	HSB_MSG_DEV_RECORD_T rec = {
+		.devid = pdev->id,
+		.drvid = pdev->drvid,
+		.cls = pdev->info.cls,
+		.interface = pdev->info.interface,
+		.dev_type = pdev->info.dev_type,
+		.state = pdev->state,
+		.num = pdev->status.num,
+	};
+	int off = HSB_MSG_DEV_RECORD_LEN;
+	int cnt;
 
-	MAKE_CMD_HDR(buf, HSB_CMD_GET_INFO_RESP, len);
+	memcpy(rec.mac, pdev->info.mac, sizeof(rec.mac));
+	memcpy(rec.name, pdev->config.name, sizeof(rec.name));
+	memcpy(rec.location, pdev->config.location, sizeof(rec.location));
+	hsb_msg_dev_record_put(buf, &rec);
 
-	SET_CMD_FIELD(buf, 4, uint32_t, dev->id); /* device id */
-	SET_CMD_FIELD(buf, 8, uint32_t, dev->driver->id); /* driver id */
-	SET_CMD_FIELD(buf, 12, uint16_t, dev->info.cls); /* device class */
-	SET_CMD_FIELD(buf, 14, uint16_t, dev->info.interface); /* device interface */
-	SET_CMD_FIELD(buf, 16, uint32_t, dev->info.dev_type);
-	memcpy(buf + 18, dev->info.mac, 8); /* mac address */
+	for (cnt = 0; cnt < pdev->status.num; cnt++, off += 4) {
+		SET_CMD_FIELD(buf, off, uint16_t, cnt);
+		SET_CMD_FIELD(buf, off + 2, uint16_t, pdev->status.val[cnt]);
+	}
 
-	return len;
+	return off;
+}
+
+/* [hdr][next cursor][num][more] then the device records */
+static int _reply_dev_page(uint8_t *buf, HSB_DEV_SNAP_T *snap, int num,
+				uint32_t next, bool more)
+{
+	int off = 12;
+	int id;
+
+	/* a full page must fit the reply buffer */
+	(void)sizeof(char[(12 + DEV_PAGE_NUM * DEV_REC_MAX <= REPLY_BUF_SIZE) ? 1 : -1]);
+
+	SET_CMD_FIELD(buf, 4, uint32_t, next);
+	SET_CMD_FIELD(buf, 8, uint16_t, num);
+	SET_CMD_FIELD(buf, 10, uint16_t, more ? 1 : 0);
+
+	for (id = 0; id < num; id++)
+		off += _put_dev_record(buf + off, &snap[id]);
+
+	MAKE_CMD_HDR(buf, HSB_CMD_GET_DEVS_PAGE_RESP, off);
+
+	return off;
+}
+
+static int _reply_get_device_info(uint8_t *buf, HSB_DEV_T *dev)
+{
+	HSB_MSG_DEV_INFO_T msg = {
+		.devid = dev->id,
+		.drvid = dev->driver->id,
+		.cls = dev->info.cls,
+		.interface = dev->info.interface,
+		.dev_type = dev->info.dev_type,
+	};
+
+	memcpy(msg.mac, dev->info.mac, sizeof(msg.mac));
+
+	return hsb_msg_dev_info_encode(buf, HSB_CMD_GET_INFO_RESP, &msg);
 }
 
 static int _reply_get_device_cfg(uint8_t *buf, uint32_t dev_id, HSB_DEV_CONFIG_T *cfg)
 {
-	int len = 8 + sizeof(cfg->name) + sizeof(cfg->location);
+	HSB_MSG_DEV_CONFIG_T msg = { .devid = dev_id };
 
-	MAKE_CMD_HDR(buf, HSB_CMD_GET_CONFIG_RESP, len);
-	SET_CMD_FIELD(buf, 4, uint32_t, dev_id); /* device id */
-	memcpy(buf + 8, cfg, sizeof(*cfg));
+	memcpy(msg.name, cfg->name, sizeof(msg.name));
+	memcpy(msg.location, cfg->location, sizeof(msg.location));
 
-	return len;
+	return hsb_msg_dev_config_encode(buf, HSB_CMD_GET_CONFIG_RESP, &msg);
 }
 
 static int _reply_get_device_channel(uint8_t *buf, uint32_t dev_id, char *name, uint32_t cid)
 {
-	int len = 12 + HSB_CHANNEL_MAX_NAME_LEN;
-	MAKE_CMD_HDR(buf, HSB_CMD_GET_CHANNEL_RESP, len);
-	SET_CMD_FIELD(buf, 4, uint32_t, dev_id); /* device id */
-	memcpy(buf + 8, name, HSB_CHANNEL_MAX_NAME_LEN);
-	SET_CMD_FIELD(buf, 8 + HSB_CHANNEL_MAX_NAME_LEN, uint32_t, cid);
+	HSB_MSG_CHANNEL_T msg = {
+		.devid = dev_id,
+		.cid = cid,
+	};
 
-	return len;
+	memcpy(msg.name, name, sizeof(msg.name));
+
+	return hsb_msg_channel_encode(buf, HSB_CMD_GET_CHANNEL_RESP, &msg);
 }
 
 /*
@@ -126,79 +202,68 @@ static int _reply_get_device_status(uint8_t *buf, uint32_t dev_id, HSB_STATUS_T
 }
 */
 
-static int  _reply_get_timer(uint8_t *buf, uint32_t dev_id, HSB_TIMER_T *tm)
+static int _reply_get_timer(uint8_t *buf, uint32_t dev_id, HSB_TIMER_T *tm)
 {
-	int len = 28;
-	
-	MAKE_CMD_HDR(buf, HSB_CMD_GET_TIMER_RESP, len);
-
-	SET_CMD_FIELD(buf, 4, uint32_t, dev_id);
-	SET_CMD_FIELD(buf, 8, uint16_t, tm->id);
-	SET_CMD_FIELD(buf, 10, uint8_t, tm->work_mode);
-	SET_CMD_FIELD(buf, 11, uint8_t, tm->flag);
-	SET_CMD_FIELD(buf, 12, uint8_t, tm->hour);
-	SET_CMD_FIELD(buf, 13, uint8_t, tm->min);
-	SET_CMD_FIELD(buf, 14, uint8_t, tm->sec);
-	SET_CMD_FIELD(buf, 15, uint8_t, tm->wday);
-	int year = 0, mon = 0;
+	HSB_MSG_TIMER_T msg = {
+		.devid = dev_id,
+		.id = tm->id,
+		.work_mode = tm->work_mode,
+		.flag = tm->flag,
+		.hour = tm->hour,
+		.min = tm->min,
+		.sec = tm->sec,
+		.wday = tm->wday,
+		.mday = tm->mday,
+		.act_id = tm->act_id,
+		.act_param1 = tm->act_param1,
+		.act_param2 = tm->act_param2,
+	};
+
+	/* struct tm style inside, the full year and 1-12 on the wire */
 	if (tm->year > 0) {
-		year = tm->year + 1900;
-		mon = tm->mon + 1;
+		msg.year = tm->year + 1900;
+		msg.mon = tm->mon + 1;
 	}
 
-	hsb_debug("get year %d mon %d\n", year, mon);
-	hsb_debug("tm->year %d tm->mon %d\n", tm->year, tm->mon);
-
-	SET_CMD_FIELD(buf, 16, uint16_t, year);
-	SET_CMD_FIELD(buf, 18, uint8_t, mon);
-	SET_CMD_FIELD(buf, 19, uint8_t, tm->mday);
-	SET_CMD_FIELD(buf, 20, uint16_t, tm->act_id);
-	SET_CMD_FIELD(buf, 22, uint16_t, tm->act_param1);
-	SET_CMD_FIELD(buf, 24, uint32_t, tm->act_param2);
-
-	return len;
+	return hsb_msg_timer_encode(buf, HSB_CMD_GET_TIMER_RESP, &msg);
 }
 
-static int  _reply_get_delay(uint8_t *buf, uint32_t dev_id, HSB_DELAY_T *delay)
+static int _reply_get_delay(uint8_t *buf, uint32_t dev_id, HSB_DELAY_T *delay)
 {
-	int len = 32;
-	
-	MAKE_CMD_HDR(buf, HSB_CMD_GET_DELAY_RESP, len);
-
-	SET_CMD_FIELD(buf, 4, uint32_t, dev_id);
-	SET_CMD_FIELD(buf, 8, uint16_t, delay->id);
-	SET_CMD_FIELD(buf, 10, uint8_t, delay->work_mode);
-	SET_CMD_FIELD(buf, 11, uint8_t, delay->flag);
-	SET_CMD_FIELD(buf, 12, uint16_t, delay->evt_id);
-	SET_CMD_FIELD(buf, 14, uint16_t, delay->evt_param1);
-	SET_CMD_FIELD(buf, 16, uint32_t, delay->evt_param2);
-	SET_CMD_FIELD(buf, 20, uint16_t, delay->act_id);
-	SET_CMD_FIELD(buf, 22, uint16_t, delay->act_param1);
-	SET_CMD_FIELD(buf, 24, uint32_t, delay->act_param2);
-	SET_CMD_FIELD(buf, 28, uint32_t, delay->delay_sec);
-
-	return len;
+	HSB_MSG_DELAY_T msg = {
+		.devid = dev_id,
+		.id = delay->id,
+		.work_mode = delay->work_mode,
+		.flag = delay->flag,
+		.evt_id = delay->evt_id,
+		.evt_param1 = delay->evt_param1,
+		.evt_param2 = delay->evt_param2,
+		.act_id = delay->act_id,
+		.act_param1 = delay->act_param1,
+		.act_param2 = delay->act_param2,
+		.delay_sec = delay->delay_sec,
+	};
+
+	return hsb_msg_delay_encode(buf, HSB_CMD_GET_DELAY_RESP, &msg);
 }
 
-static int  _reply_get_linkage(uint8_t *buf, uint32_t dev_id, HSB_LINKAGE_T *link)
+static int _reply_get_linkage(uint8_t *buf, uint32_t dev_id, HSB_LINKAGE_T *link)
 {
-	int len = 32;
-	
-	MAKE_CMD_HDR(buf, HSB_CMD_GET_LINKAGE_RESP, len);
-
-	SET_CMD_FIELD(buf, 4, uint32_t, dev_id);
-	SET_CMD_FIELD(buf, 8, uint16_t,link->id);
-	SET_CMD_FIELD(buf, 10, uint8_t,link->work_mode);
-	SET_CMD_FIELD(buf, 11, uint8_t,link->flag);
-	SET_CMD_FIELD(buf, 12, uint16_t, link->evt_id);
-	SET_CMD_FIELD(buf, 14, uint16_t, link->evt_param1);
-	SET_CMD_FIELD(buf, 16, uint32_t, link->evt_param2);
-	SET_CMD_FIELD(buf, 20, uint32_t, link->act_devid);
-	SET_CMD_FIELD(buf, 24, uint16_t, link->act_id);
-	SET_CMD_FIELD(buf, 26, uint16_t, link->act_param1);
-	SET_CMD_FIELD(buf, 28, uint32_t, link->act_param2);
-
-	return len;
+	HSB_MSG_LINKAGE_T msg = {
+		.devid = dev_id,
+		.id = link->id,
+		.work_mode = link->work_mode,
+		.flag = link->flag,
+		.evt_id = link->evt_id,
+		.evt_param1 = link->evt_param1,
+		.evt_param2 = link->evt_param2,
+		.act_devid = link->act_devid,
+		.act_id = link->act_id,
+		.act_param1 = link->act_param1,
+		.act_param2 = link->act_param2,
+	};
+
+	return hsb_msg_linkage_encode(buf, HSB_CMD_GET_LINKAGE_RESP, &msg);
 }
 
 static int parse_scene(HSB_SCENE_T *scene, uint8_t *buf, int len)
@@ -351,34 +416,81 @@ static int _get_dev_status(uint8_t *buf, int len, HSB_STATUS_T *status)
 
 static int _make_online_event(uint8_t *buf, uint32_t devid)
 {
-	int ret, id;
+	HSB_MSG_DEV_ONLINE_T msg;
 	HSB_DEV_T dev;
-	ret = get_dev_info(devid, &dev);
+	int len, id;
+
+	get_dev_info(devid, &dev);
 
-	int len = 60 + 4 * dev.status.num;
+	msg.devid = dev.id;
+	msg.drvid = dev.driver->id;
+	msg.cls = dev.info.cls;
+	msg.interface = dev.info.interface;
+	msg.dev_type = dev.info.dev_type;
+	memcpy(msg.mac, dev.info.mac, sizeof(msg.mac));
+	memcpy(msg.name, dev.config.name, sizeof(msg.name));
+	memcpy(msg.location, dev.config.location, sizeof(msg.location));
+
+	hsb_msg_dev_online_put(buf, &msg);
+
+	len = HSB_MSG_DEV_ONLINE_LEN;
+	for (id = 0; id < dev.status.num; id++, len += 4) {
+		SET_CMD_FIELD(buf, len, uint16_t, id);
+		SET_CMD_FIELD(buf, len + 2, uint16_t, dev.status.val[id]);
+	}
 
 	MAKE_CMD_HDR(buf, HSB_CMD_DEV_ONLINE, len);
 
-	SET_CMD_FIELD(buf, 4, uint32_t, dev.id); /* device id */
-	SET_CMD_FIELD(buf, 8, uint32_t, dev.driver->id); /* driver id */
-	SET_CMD_FIELD(buf, 12, uint16_t, dev.info.cls); /* device class */
-	SET_CMD_FIELD(buf, 14, uint16_t, dev.info.interface); /* device interface */
-	SET_CMD_FIELD(buf, 16, uint32_t, dev.info.dev_type);
-	memcpy(buf + 20, dev.info.mac, 8); /* mac address */
+	return len;
+}
 
-	memcpy(buf + 28, dev.config.name, 16);
-	memcpy(buf + 44, dev.config.location, 16);
+static int _batch_resp_len(HSB_STATUS_BATCH_T *batch)
+{
+	int len = 8;
+	int id;
 
-	for (id = 0; id < dev.status.num; id++)
-	{
-		SET_CMD_FIELD(buf, 60 + id * 4, uint16_t, id);
-		SET_CMD_FIELD(buf, 62 + id * 4, uint16_t, dev.status.val[id]);
+	for (id = 0; id < batch->num; id++) {
+		len += 8;
+		if (HSB_CMD_GET_STATUS_BATCH == batch->cmd &&
+			HSB_E_OK == batch->items[id].ret)
+			len += 4 * batch->items[id].status.num;
 	}
 
-
 	return len;
 }
 
+/* [hdr][cmd][num] then per device [devid][ret][n][n * (id, val)] */
+static int _make_batch_resp(uint8_t *buf, HSB_STATUS_BATCH_T *batch)
+{
+	HSB_STATUS_BATCH_ITEM_T *item;
+	int id, cnt, num, off = 8;
+
+	SET_CMD_FIELD(buf, 4, uint16_t, batch->cmd);
+	SET_CMD_FIELD(buf, 6, uint16_t, batch->num);
+
+	for (id = 0; id < batch->num; id++) {
+		item = &batch->items[id];
+		num = 0;
+
+		if (HSB_CMD_GET_STATUS_BATCH == batch->cmd && HSB_E_OK == item->ret)
+			num = item->status.num;
+
+		SET_CMD_FIELD(buf, off, uint32_t, item->status.devid);
+		SET_CMD_FIELD(buf, off + 4, uint16_t, item->ret);
+		SET_CMD_FIELD(buf, off + 6, uint16_t, num);
+		off += 8;
+
+		for (cnt = 0; cnt < num; cnt++, off += 4) {
+			SET_CMD_FIELD(buf, off, uint16_t, item->status.id[cnt]);
+			SET_CMD_FIELD(buf, off + 2, uint16_t, item->status.val[cnt]);
+		}
+	}
+
+	MAKE_CMD_HDR(buf, HSB_CMD_STATUS_BATCH_RESP, off);
+
+	return off;
+}
+
 static int _make_notify_resp(uint8_t *buf, HSB_RESP_T *resp)
 {
 	int len = 0;
@@ -394,19 +506,20 @@ static int _make_notify_resp(uint8_t *buf, HSB_RESP_T *resp)
 			}
 
 
-			len = 16;
-			MAKE_CMD_HDR(buf, HSB_CMD_EVENT, len);
-			SET_CMD_FIELD(buf, 4, uint32_t, resp->u.event.devid);
-			SET_CMD_FIELD(buf, 8, uint16_t, resp->u.event.id);
-			SET_CMD_FIELD(buf, 10, uint16_t, resp->u.event.param1);
-			SET_CMD_FIELD(buf, 12, uint32_t, resp->u.event.param2);
+		{
+			HSB_MSG_EVENT_T evt = {
+				.devid = resp->u.event.devid,
+				.id = resp->u.event.id,
+				.param1 = resp->u.event.param1,
+				.param2 = resp->u.event.param2,
+			};
+
+			len = hsb_msg_event_encode(buf, HSB_CMD_EVENT, &evt);
+		}
 			break;
 		case HSB_RESP_TYPE_RESULT:
-			len = 12;
-			MAKE_CMD_HDR(buf, HSB_CMD_RESULT, len);
-			SET_CMD_FIELD(buf, 4, uint32_t, resp->u.result.devid);
-			SET_CMD_FIELD(buf, 8, uint16_t, resp->u.result.cmd);
-			SET_CMD_FIELD(buf, 10, uint16_t, resp->u.result.ret_val);
+			len = _reply_result(buf, resp->u.result.ret_val,
+					resp->u.result.devid, resp->u.result.cmd);
 			break;
 		case HSB_RESP_TYPE_STATUS:
 		case HSB_RESP_TYPE_STATUS_UPDATE:
@@ -427,6 +540,8 @@ static int _make_notify_resp(uint8_t *buf, HSB_RESP_T *resp)
 			}
 		}
 			break;
+		case HSB_RESP_TYPE_STATUS_BATCH:
+			return _make_batch_resp(buf, resp->u.batch);
 		default:
 			hsb_debug("invalid resp %d\n", resp->type);
 			break;
@@ -435,516 +550,698 @@ static int _make_notify_resp(uint8_t *buf, HSB_RESP_T *resp)
 	return len;
 }
 
-int deal_tcp_packet(int fd, uint8_t *buf, int len, void *reply, int *used)
+/* an async command owes a reply now only when it could not be queued */
+static int _async_result(uint8_t *rbuf, int ret, uint16_t cmd)
 {
-	int ret = 0;
-	int rlen = 0;
-	uint8_t reply_buf[1024];
-	uint16_t cmd, cmdlen;
+	if (HSB_E_OK == ret)
+		return 0;
 
-	//hsb_debug("get tcp packet, len=%d\n", len);
-
-	if (check_tcp_pkt_valid(buf, len)) {
-		hsb_debug("tcp pkt invalid, len=%d\n", len);
-		*used = len;
-		return -1;
-	}
-
-	cmd = GET_CMD_FIELD(buf, 0, uint16_t);
-	cmdlen = GET_CMD_FIELD(buf, 2, uint16_t);
-	memset(reply_buf, 0, sizeof(reply_buf));
+	return _reply_result(rbuf, ret, 0, cmd);
+}
 
-	*used = cmdlen;
-	//hsb_debug("cmd: %x, len: %d\n", cmd, cmdlen);
+/*
+ * Command handlers. Each gets a frame at least as long as its entry in
+ * tcp_cmds asks for and returns the length of the reply it built at rbuf,
+ * 0 for none. rbuf is the tail of the client's output buffer and is not
+ * zeroed, a reply sets every byte it sends. A handler that streams
+ * several replies moves on with _reply_next().
+ */
+static int _deal_hello(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	return _client_hello(reply, buf, len, rbuf);
+}
 
-	switch (cmd) {
-		case HSB_CMD_GET_DEVS:
-		{
-			uint32_t dev_id[128];
-			int dev_num;
-			ret = get_dev_id_list(dev_id, &dev_num);
-			if (HSB_E_OK != ret)
-				rlen = _reply_result(reply_buf, ret, 0, cmd);
-			else
-				rlen = _reply_dev_id_list(reply_buf, dev_id, dev_num);
+static int _deal_subscribe(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	return _client_subscribe(reply, buf, len, rbuf);
+}
 
-			break;
-		}
-		case HSB_CMD_GET_INFO:
-		{
-			HSB_DEV_T dev;
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
-			ret = get_dev_info(dev_id, &dev);
-			if (HSB_E_OK != ret)
-				rlen = _reply_result(reply_buf, ret, dev_id, cmd);
-			else
-				rlen = _reply_get_device_info(reply_buf, &dev);
+static int _deal_heartbeat(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_HEARTBEAT_T msg;
 
-			break;
-		}
-		case HSB_CMD_GET_CONFIG:
-		{
-			HSB_DEV_CONFIG_T cfg;
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
-			ret = get_dev_cfg(dev_id, &cfg);
-			if (HSB_E_OK != ret)
-				rlen = _reply_result(reply_buf, ret, dev_id, cmd);
-			else
-				rlen = _reply_get_device_cfg(reply_buf, dev_id, &cfg);
+	/* any frame counts as alive, only a ping needs an answer */
+	if (hsb_msg_heartbeat_decode(buf, len, &msg) ||
+	    HSB_HEARTBEAT_PING != msg.type)
+		return 0;
 
-			break;
-		}
-		case HSB_CMD_SET_CONFIG:
-		{
-			HSB_DEV_CONFIG_T cfg;
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
+	msg.type = HSB_HEARTBEAT_PONG;
+	msg.rsv = 0;
 
-			memcpy(&cfg, buf + 8, sizeof(cfg));
+	return hsb_msg_heartbeat_encode(rbuf, HSB_CMD_HEARTBEAT, &msg);
+}
 
-			ret = set_dev_cfg(dev_id, &cfg);
+static int _deal_get_devs(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	uint32_t dev_id[GET_DEVS_MAX];
+	int dev_num = GET_DEVS_MAX;
+	int ret;
 
-			rlen = _reply_result(reply_buf, ret, dev_id, cmd);
+	ret = get_dev_id_list(dev_id, &dev_num);
+	if (HSB_E_OK != ret)
+		return _reply_result(rbuf, ret, 0, cmd);
 
-			break;
-		}
-		case HSB_CMD_GET_STATUS:
-		{
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
+	return _reply_dev_id_list(rbuf, dev_id, dev_num);
+}
 
-			ret = get_dev_status_async(dev_id, reply);
+static int _deal_get_devs_page(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_DEV_SNAP_T snap[DEV_PAGE_NUM];
+	uint32_t cursor = GET_CMD_FIELD(buf, 4, uint32_t);
+	int max = 0, sent = 0, rlen = 0;
+	int num, ret;
+	bool more = false;
 
-			rlen = 0;
+	if (len >= 12)
+		max = GET_CMD_FIELD(buf, 8, uint16_t);
 
-			break;
-		}
-		case HSB_CMD_SET_STATUS:
-		{
-			HSB_STATUS_T status = { 0 };
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
+	/* stream pages until max devices or the end, 0 means all */
+	do {
+		if (rlen > 0 && !(rbuf = _reply_next(reply, rlen)))
+			return -1;
 
-			status.devid = dev_id;
+		num = DEV_PAGE_NUM;
+		if (max && max - sent < num)
+			num = max - sent;
 
-			_get_dev_status(buf, len, &status);
+		ret = get_dev_page(cursor, snap, &num, &more);
+		if (HSB_E_OK != ret)
+			return _reply_result(rbuf, ret, 0, cmd);
 
-			ret = set_dev_status_async(&status, reply);
+		if (num)
+			cursor = snap[num - 1].id + 1;
+		sent += num;
 
-			rlen = 0;
+		rlen = _reply_dev_page(rbuf, snap, num, cursor, more);
+	} while (more && (!max || sent < max));
 
-			break;
-		}
-		case HSB_CMD_SET_CHANNEL:
-		{
-			char name[HSB_CHANNEL_MAX_NAME_LEN];
-			uint32_t cid, devid;
+	return rlen;
+}
 
-			devid = GET_CMD_FIELD(buf, 4, uint32_t);
-			strncpy(name, buf + 8, sizeof(name));
-			cid = GET_CMD_FIELD(buf, 8 + sizeof(name), uint32_t);
+static int _deal_get_info(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_DEV_T msg;
+	HSB_DEV_T dev;
+	int ret;
 
-			ret = set_dev_channel(devid, name, cid);
+	hsb_msg_dev_decode(buf, len, &msg);
 
-			rlen = _reply_result(reply_buf, ret, devid, cmd);
+	ret = get_dev_info(msg.devid, &dev);
+	if (HSB_E_OK != ret)
+		return _reply_result(rbuf, ret, msg.devid, cmd);
 
-			break;
-		}
-		case HSB_CMD_DEL_CHANNEL:
-		{
-			char name[HSB_CHANNEL_MAX_NAME_LEN];
-			uint32_t devid;
+	return _reply_get_device_info(rbuf, &dev);
+}
 
-			devid = GET_CMD_FIELD(buf, 4, uint32_t);
-			strncpy(name, buf + 8, sizeof(name));
+static int _deal_get_config(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_DEV_T msg;
+	HSB_DEV_CONFIG_T cfg;
+	int ret;
 
-			ret = del_dev_channel(devid, name);
+	hsb_msg_dev_decode(buf, len, &msg);
 
-			rlen = _reply_result(reply_buf, ret, devid, cmd);
+	ret = get_dev_cfg(msg.devid, &cfg);
+	if (HSB_E_OK != ret)
+		return _reply_result(rbuf, ret, msg.devid, cmd);
 
-			break;
-		}
-		case HSB_CMD_SWITCH_CHANNEL:
-		{
-			char name[HSB_CHANNEL_MAX_NAME_LEN];
-			uint32_t devid, cid;
-			HSB_STATUS_T status = { 0 };
+	return _reply_get_device_cfg(rbuf, msg.devid, &cfg);
+}
 
-			devid = GET_CMD_FIELD(buf, 4, uint32_t);
-			strncpy(name, buf + 8, sizeof(name));
+static int _deal_set_config(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_DEV_CONFIG_T msg;
+	HSB_DEV_CONFIG_T cfg;
+	int ret;
 
-			ret = get_dev_channel(devid, name, &cid);
-			
-			if (HSB_E_OK != ret) {
-				rlen = _reply_result(reply_buf, ret, devid, cmd);
-				break;
-			}
+	hsb_msg_dev_config_decode(buf, len, &msg);
+	memcpy(cfg.name, msg.name, sizeof(cfg.name));
+	memcpy(cfg.location, msg.location, sizeof(cfg.location));
 
-			status.devid = devid;
-			status.num = 1;
-			status.id[0] = HSB_TV_STATUS_CHANNEL;
-			status.val[0] = cid;
+	ret = set_dev_cfg(msg.devid, &cfg);
 
-			ret = set_dev_status_async(&status, reply);
+	return _reply_result(rbuf, ret, msg.devid, cmd);
+}
 
-			rlen = 0;
+static int _deal_get_status(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_DEV_T msg;
 
-			break;
-		}
-		case HSB_CMD_GET_CHANNEL:
-		{
-			uint32_t devid = GET_CMD_FIELD(buf, 4, uint32_t);
+	hsb_msg_dev_decode(buf, len, &msg);
 
-			uint32_t id, num = 0;
-			ret = get_dev_channel_num(devid, &num);
-			if (HSB_E_OK != ret) {
-				rlen = _reply_result(reply_buf, ret, devid, cmd);
-				break;
-			}
+	return _async_result(rbuf, get_dev_status_async(msg.devid, reply), cmd);
+}
 
-			char name[HSB_CHANNEL_MAX_NAME_LEN];
-			uint32_t cid;
+static int _deal_set_status(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_STATUS_T status = { 0 };
 
-			for (id = 0; id < num; id++) {
-				memset(name, 0, sizeof(name));
-				ret = get_dev_channel_by_id(devid, id, name, &cid);
-				if (HSB_E_OK != ret)
-					continue;
+	status.devid = GET_CMD_FIELD(buf, 4, uint32_t);
+	_get_dev_status(buf, len, &status);
 
-				rlen = _reply_get_device_channel(reply_buf, devid, name, cid);
-				if (rlen > 0) {
-					struct timeval tv = { 1, 0 };
-					ret = write_timeout(fd, reply_buf, rlen, &tv);
-				}
-			}
+	return _async_result(rbuf, set_dev_status_async(&status, reply), cmd);
+}
 
-			ret = HSB_E_OK;
-			rlen = _reply_result(reply_buf, ret, devid, cmd);
+static int _deal_get_status_batch(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	uint32_t devid[HSB_STATUS_BATCH_MAX];
+	int num = GET_CMD_FIELD(buf, 4, uint16_t);
+	int id;
 
-			break;
-		}
-		case HSB_CMD_GET_TIMER:
-		{
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
-			uint16_t timer_id = GET_CMD_FIELD(buf, 8, uint16_t);
-			HSB_TIMER_T tm = { 0 };
+	if (num <= 0 || num > HSB_STATUS_BATCH_MAX || len < 8 + 4 * num)
+		return _reply_result(rbuf, HSB_E_BAD_PARAM, 0, cmd);
 
-			ret = get_dev_timer(dev_id, timer_id, &tm);
-			if (HSB_E_OK != ret)
-				rlen = _reply_result(reply_buf, ret, dev_id, cmd);
-			else
-				rlen = _reply_get_timer(reply_buf, dev_id, &tm);
+	for (id = 0; id < num; id++)
+		devid[id] = GET_CMD_FIELD(buf, 8 + 4 * id, uint32_t);
 
-			break;
-		}
-		case HSB_CMD_SET_TIMER:
-		{
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
-			uint16_t timer_id = GET_CMD_FIELD(buf, 8, uint16_t);
-			HSB_TIMER_T tm = { 0 };
-
-			tm.id = timer_id;
-			tm.work_mode = GET_CMD_FIELD(buf, 10, uint8_t);
-			tm.flag = GET_CMD_FIELD(buf, 11, uint8_t);
-			tm.hour = GET_CMD_FIELD(buf, 12, uint8_t);
-			tm.min = GET_CMD_FIELD(buf, 13, uint8_t);
-			tm.sec = GET_CMD_FIELD(buf, 14, uint8_t);
-			tm.wday = GET_CMD_FIELD(buf, 15, uint8_t);
-			int year, mon;
-			year = GET_CMD_FIELD(buf, 16, uint16_t);
-			mon = GET_CMD_FIELD(buf, 18, uint8_t);
-
-			hsb_debug("set year %d mon %d\n", year, mon);
-
-			if (year > 1900) {
-				year -= 1900;
-				mon -= 1;
-			}
+	return _async_result(rbuf, get_dev_status_batch_async(devid, num, reply), cmd);
+}
 
-			tm.year = year;
-			tm.mon = mon;
+static int _deal_set_status_batch(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_STATUS_T status[HSB_STATUS_BATCH_MAX];
+	int num = GET_CMD_FIELD(buf, 4, uint16_t);
+	int id, cnt, off = 8;
 
+	if (num <= 0 || num > HSB_STATUS_BATCH_MAX)
+		return _reply_result(rbuf, HSB_E_BAD_PARAM, 0, cmd);
 
-			hsb_debug("tm->year %d tm->mon %d\n", tm.year, tm.mon);
+	for (id = 0; id < num; id++) {
+		if (off + 8 > len)
+			return _reply_result(rbuf, HSB_E_BAD_PARAM, 0, cmd);
 
-			tm.mday = GET_CMD_FIELD(buf, 19, uint8_t);
-			tm.act_id = GET_CMD_FIELD(buf, 20, uint16_t);
-			tm.act_param1 = GET_CMD_FIELD(buf, 22, uint16_t);
-			tm.act_param2 = GET_CMD_FIELD(buf, 24, uint32_t);
+		memset(&status[id], 0, sizeof(HSB_STATUS_T));
+		status[id].devid = GET_CMD_FIELD(buf, off, uint32_t);
+		status[id].num = GET_CMD_FIELD(buf, off + 4, uint16_t);
+		off += 8;
 
-			hsb_debug("set timer %d, %d/%d/%d %d:%d:%d\n", timer_id,
-				tm.year, tm.mon, tm.mday, tm.hour, tm.min, tm.sec);
+		if (status[id].num > 8 || off + 4 * status[id].num > len)
+			return _reply_result(rbuf, HSB_E_BAD_PARAM, 0, cmd);
 
-			hsb_debug("devid %d, actid %d, param1 %d\n", dev_id, tm.act_id, tm.act_param1);
+		for (cnt = 0; cnt < status[id].num; cnt++, off += 4) {
+			status[id].id[cnt] = GET_CMD_FIELD(buf, off, uint16_t);
+			status[id].val[cnt] = GET_CMD_FIELD(buf, off + 2, uint16_t);
+		}
+	}
 
-			ret = set_dev_timer(dev_id, &tm);
-			if (ret)
-				hsb_debug("set_dev_timer ret=%d\n", ret);
+	return _async_result(rbuf, set_dev_status_batch_async(status, num, reply), cmd);
+}
 
-			rlen = _reply_result(reply_buf, ret, dev_id, cmd);
-			break;
-		}
-		case HSB_CMD_DEL_TIMER:
-		{
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
-			uint16_t timer_id = GET_CMD_FIELD(buf, 8, uint16_t);
+static int _deal_set_channel(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_CHANNEL_T msg;
+	int ret;
 
-			ret = del_dev_timer(dev_id, timer_id);
-			rlen = _reply_result(reply_buf, ret, dev_id, cmd);
-			break;
-		}
-		case HSB_CMD_GET_DELAY:
-		{
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
-			uint16_t delay_id = GET_CMD_FIELD(buf, 8, uint16_t);
-			HSB_DELAY_T delay = { 0 };
+	hsb_msg_channel_decode(buf, len, &msg);
 
-			ret = get_dev_delay(dev_id, delay_id, &delay);
-			if (HSB_E_OK != ret)
-				rlen = _reply_result(reply_buf, ret, dev_id, cmd);
-			else
-				rlen = _reply_get_delay(reply_buf, dev_id, &delay);
+	ret = set_dev_channel(msg.devid, (char *)msg.name, msg.cid);
 
-			break;
-		}
-		case HSB_CMD_SET_DELAY:
-		{
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
-			uint16_t delay_id = GET_CMD_FIELD(buf, 8, uint16_t);
-			HSB_DELAY_T delay = { 0 };
-
-			delay.id = delay_id;
-			delay.work_mode = GET_CMD_FIELD(buf, 10, uint8_t);
-			delay.flag = GET_CMD_FIELD(buf, 11, uint8_t);
-			delay.evt_id = GET_CMD_FIELD(buf, 12, uint16_t);
-			delay.evt_param1 = GET_CMD_FIELD(buf, 14, uint16_t);
-			delay.evt_param2 = GET_CMD_FIELD(buf, 16, uint32_t);
-			delay.act_id = GET_CMD_FIELD(buf, 20, uint16_t);
-			delay.act_param1 = GET_CMD_FIELD(buf, 22, uint16_t);
-			delay.act_param2 = GET_CMD_FIELD(buf, 24, uint32_t);
-			delay.delay_sec = GET_CMD_FIELD(buf, 28, uint32_t);
-
-			ret = set_dev_delay(dev_id, &delay);
-			rlen = _reply_result(reply_buf, ret, dev_id, cmd);
+	return _reply_result(rbuf, ret, msg.devid, cmd);
+}
 
-			break;
-		}
-		case HSB_CMD_DEL_DELAY:
-		{
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
-			uint16_t delay_id = GET_CMD_FIELD(buf, 8, uint16_t);
+static int _deal_del_channel(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_CHANNEL_NAME_T msg;
+	int ret;
 
-			ret = del_dev_delay(dev_id, delay_id);
-			rlen = _reply_result(reply_buf, ret, dev_id, cmd);
+	hsb_msg_channel_name_decode(buf, len, &msg);
 
-			break;
-		}
-		case HSB_CMD_GET_LINKAGE:
-		{
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
-			uint16_t link_id = GET_CMD_FIELD(buf, 8, uint16_t);
-			HSB_LINKAGE_T link = { 0 };
+	ret = del_dev_channel(msg.devid, (char *)msg.name);
 
-			ret = get_dev_linkage(dev_id, link_id, &link);
-			if (HSB_E_OK != ret)
-				rlen = _reply_result(reply_buf, ret, dev_id, cmd);
-			else
-				rlen = _reply_get_linkage(reply_buf, dev_id, &link);
+	return _reply_result(rbuf, ret, msg.devid, cmd);
+}
 
-			break;
-		}
-		case HSB_CMD_SET_LINKAGE:
-		{
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
-			uint16_t link_id = GET_CMD_FIELD(buf, 8, uint16_t);
-			HSB_LINKAGE_T link = { 0 };
-
-			link.id = link_id;
-			link.work_mode = GET_CMD_FIELD(buf, 10, uint8_t);
-			link.flag = GET_CMD_FIELD(buf, 11, uint8_t);
-			link.evt_id = GET_CMD_FIELD(buf, 12, uint16_t);
-			link.evt_param1 = GET_CMD_FIELD(buf, 14, uint16_t);
-			link.evt_param2 = GET_CMD_FIELD(buf, 16, uint32_t);
-			link.act_devid = GET_CMD_FIELD(buf, 20, uint32_t);
-			link.act_id = GET_CMD_FIELD(buf, 24, uint16_t);
-			link.act_param1 = GET_CMD_FIELD(buf, 26, uint16_t);
-			link.act_param2 = GET_CMD_FIELD(buf, 28, uint32_t);
-
-			ret = set_dev_linkage(dev_id, &link);
-			rlen = _reply_result(reply_buf, ret, dev_id, cmd);
-			break;
-		}
-		case HSB_CMD_DEL_LINKAGE:
-		{
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
-			uint16_t link_id = GET_CMD_FIELD(buf, 8, uint16_t);
+static int _deal_switch_channel(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_CHANNEL_NAME_T msg;
+	HSB_STATUS_T status = { 0 };
+	uint32_t cid;
+	int ret;
 
-			ret = del_dev_linkage(dev_id, link_id);
-			rlen = _reply_result(reply_buf, ret, dev_id, cmd);
-			break;
-		}
-		case HSB_CMD_DO_ACTION:
-		{
-			uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
-			uint16_t act_id = GET_CMD_FIELD(buf, 8, uint16_t);
-			uint16_t param1 = GET_CMD_FIELD(buf, 10, uint16_t);
-			uint32_t param2 = GET_CMD_FIELD(buf, 12, uint32_t);
-			HSB_ACTION_T act = { 0 };
-
-			/* TODO */
-			act.devid = dev_id;
-			act.id = act_id;
-			act.param1 = param1;
-			act.param2 = param2;
-
-			ret = set_dev_action_async(&act, reply);
-
-			rlen = 0;
- 	
-			break;
-		}
-		case HSB_CMD_PROBE_DEV:
-		{
-			uint16_t drvid = GET_CMD_FIELD(buf, 4, uint16_t);
-			HSB_PROBE_T probe;
+	hsb_msg_channel_name_decode(buf, len, &msg);
 
-			probe.drvid = drvid;
+	ret = get_dev_channel(msg.devid, (char *)msg.name, &cid);
+	if (HSB_E_OK != ret)
+		return _reply_result(rbuf, ret, msg.devid, cmd);
 
-			hsb_debug("probe\n");
+	status.devid = msg.devid;
+	status.num = 1;
+	status.id[0] = HSB_TV_STATUS_CHANNEL;
+	status.val[0] = cid;
 
-			ret = probe_dev_async(&probe, reply);
+	return _async_result(rbuf, set_dev_status_async(&status, reply), cmd);
+}
 
-			rlen = 0;
+static int _deal_get_channel(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_DEV_T msg;
+	char name[HSB_CHANNEL_MAX_NAME_LEN];
+	uint32_t id, num = 0, cid;
+	int ret;
 
-			break;
-		}
-		case HSB_CMD_ADD_DEV:
-		{
-			uint16_t drvid = GET_CMD_FIELD(buf, 4, uint16_t);
-			uint16_t dev_type = GET_CMD_FIELD(buf, 6, uint16_t);
-			HSB_DEV_CONFIG_T cfg;
+	hsb_msg_dev_decode(buf, len, &msg);
 
-			memcpy(&cfg, buf + 8, sizeof(cfg));
+	ret = get_dev_channel_num(msg.devid, &num);
+	if (HSB_E_OK != ret)
+		return _reply_result(rbuf, ret, msg.devid, cmd);
 
-			hsb_debug("add_dev: %d,%d\n", drvid, dev_type);
+	for (id = 0; id < num; id++) {
+		memset(name, 0, sizeof(name));
+		ret = get_dev_channel_by_id(msg.devid, id, name, &cid);
+		if (HSB_E_OK != ret)
+			continue;
 
-			ret = add_dev(drvid, dev_type, &cfg);
+		rbuf = _reply_next(reply,
+			_reply_get_device_channel(rbuf, msg.devid, name, cid));
+		if (!rbuf)
+			return -1;
+	}
 
-			rlen = _reply_result(reply_buf, ret, 0, cmd);
+	return _reply_result(rbuf, HSB_E_OK, msg.devid, cmd);
+}
 
-			break;
-		}
-		case HSB_CMD_DEL_DEV:
-		{
-			uint32_t devid = GET_CMD_FIELD(buf, 4, uint32_t);
+static int _deal_get_timer(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_DEV_ITEM_T msg;
+	HSB_TIMER_T tm = { 0 };
+	int ret;
 
-			ret = del_dev(devid);
+	hsb_msg_dev_item_decode(buf, len, &msg);
 
-			rlen = _reply_result(reply_buf, ret, 0, cmd);
-			
-			break;
-		}
-		case HSB_CMD_SET_SCENE:
-		{
-			/* alloc_scene */
-			HSB_SCENE_T *scene = alloc_scene();
-			if (!scene) {
-				ret = HSB_E_NO_MEMORY;
-				rlen = _reply_result(reply_buf, ret, 0, cmd);
-				break;
-			}
+	ret = get_dev_timer(msg.devid, msg.id, &tm);
+	if (HSB_E_OK != ret)
+		return _reply_result(rbuf, ret, msg.devid, cmd);
 
-			/* parse_scene */
-			ret = parse_scene(scene, buf, cmdlen);
-			if (HSB_E_OK != ret) {
-				rlen = _reply_result(reply_buf, ret, 0, cmd);
-				break;
-			}
+	return _reply_get_timer(rbuf, msg.devid, &tm);
+}
 
-			hsb_debug("add scene [%s]\n", scene->name);
+static int _deal_set_timer(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_TIMER_T msg;
+	HSB_TIMER_T tm = { 0 };
+	int year, mon, ret;
+
+	hsb_msg_timer_decode(buf, len, &msg);
+
+	tm.id = msg.id;
+	tm.work_mode = msg.work_mode;
+	tm.flag = msg.flag;
+	tm.hour = msg.hour;
+	tm.min = msg.min;
+	tm.sec = msg.sec;
+	tm.wday = msg.wday;
+	tm.mday = msg.mday;
+	tm.act_id = msg.act_id;
+	tm.act_param1 = msg.act_param1;
+	tm.act_param2 = msg.act_param2;
+
+	year = msg.year;
+	mon = msg.mon;
+	if (year > 1900) {
+		year -= 1900;
+		mon -= 1;
+	}
 
-			/* add_scene */
-			ret = add_scene(scene);
-			hsb_debug("add scene [%s] success\n", scene->name);
-			rlen = _reply_result(reply_buf, ret, 0, cmd);
+	tm.year = year;
+	tm.mon = mon;
 
-			break;
-		}
-		case HSB_CMD_DEL_SCENE:
-		{
-			char name[HSB_SCENE_MAX_NAME_LEN];
+	hsb_debug("set timer %d, %d/%d/%d %d:%d:%d\n", tm.id,
+		tm.year, tm.mon, tm.mday, tm.hour, tm.min, tm.sec);
 
-			strncpy(name, buf + 4, sizeof(name));
-			hsb_debug("del scene [%s]\n", name);
+	ret = set_dev_timer(msg.devid, &tm);
+	if (ret)
+		hsb_debug("set_dev_timer ret=%d\n", ret);
 
-			ret = del_scene(name);
+	return _reply_result(rbuf, ret, msg.devid, cmd);
+}
 
-			rlen = _reply_result(reply_buf, ret, 0, cmd);
+static int _deal_del_timer(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_DEV_ITEM_T msg;
 
-			break;
-		}
-		case HSB_CMD_ENTER_SCENE:
-		{
-			char name[HSB_SCENE_MAX_NAME_LEN];
+	hsb_msg_dev_item_decode(buf, len, &msg);
 
-			strncpy(name, buf + 4, sizeof(name));
-			hsb_debug("enter scene [%s]\n", name);
+	return _reply_result(rbuf, del_dev_timer(msg.devid, msg.id), msg.devid, cmd);
+}
 
-			ret = enter_scene(name);
+static int _deal_get_delay(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_DEV_ITEM_T msg;
+	HSB_DELAY_T delay = { 0 };
+	int ret;
 
-			rlen = _reply_result(reply_buf, ret, 0, cmd);
+	hsb_msg_dev_item_decode(buf, len, &msg);
 
-			break;
-		}
-		case HSB_CMD_GET_SCENE:
-		{
-			uint32_t id, num = 0;
+	ret = get_dev_delay(msg.devid, msg.id, &delay);
+	if (HSB_E_OK != ret)
+		return _reply_result(rbuf, ret, msg.devid, cmd);
 
-			hsb_debug("get scene\n");
-			ret = get_scene_num(&num);
-			if (HSB_E_OK != ret) {
-				hsb_debug("get scene num fail\n");
-				rlen = _reply_result(reply_buf, ret, 0, cmd);
-				break;
-			}
+	return _reply_get_delay(rbuf, msg.devid, &delay);
+}
 
-			HSB_SCENE_T *scene = NULL;
+static int _deal_set_delay(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_DELAY_T msg;
+	HSB_DELAY_T delay = { 0 };
+
+	hsb_msg_delay_decode(buf, len, &msg);
+
+	delay.id = msg.id;
+	delay.work_mode = msg.work_mode;
+	delay.flag = msg.flag;
+	delay.evt_id = msg.evt_id;
+	delay.evt_param1 = msg.evt_param1;
+	delay.evt_param2 = msg.evt_param2;
+	delay.act_id = msg.act_id;
+	delay.act_param1 = msg.act_param1;
+	delay.act_param2 = msg.act_param2;
+	delay.delay_sec = msg.delay_sec;
+
+	return _reply_result(rbuf, set_dev_delay(msg.devid, &delay), msg.devid, cmd);
+}
 
-			for (id = 0; id < num; id++) {
-				ret = get_scene(id, &scene);
-				if (HSB_E_OK != ret)
-					continue;
+static int _deal_del_delay(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_DEV_ITEM_T msg;
 
-				rlen = _reply_get_scene(reply_buf, scene);
-				if (rlen > 0) {
-					struct timeval tv = { 1, 0 };
-					ret = write_timeout(fd, reply_buf, rlen, &tv);
-				}
-			}
+	hsb_msg_dev_item_decode(buf, len, &msg);
 
-			ret = HSB_E_OK;
-			rlen = _reply_result(reply_buf, ret, 0, cmd);
+	return _reply_result(rbuf, del_dev_delay(msg.devid, msg.id), msg.devid, cmd);
+}
 
-			break;
-		}
-		default:
-			rlen = _reply_result(reply_buf, REPLY_FAIL, 0, cmd);
-			break;
-	}
+static int _deal_get_linkage(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_DEV_ITEM_T msg;
+	HSB_LINKAGE_T link = { 0 };
+	int ret;
 
-	if (rlen < 0) {
-		hsb_debug("rlen %d<0\n", rlen);
-		return -2;
-	}
+	hsb_msg_dev_item_decode(buf, len, &msg);
 
-	if (rlen > 0) {
-		struct timeval tv = { 1, 0 };
-		ret = write_timeout(fd, reply_buf, rlen, &tv);
-	}
+	ret = get_dev_linkage(msg.devid, msg.id, &link);
+	if (HSB_E_OK != ret)
+		return _reply_result(rbuf, ret, msg.devid, cmd);
 
-	return 0;
+	return _reply_get_linkage(rbuf, msg.devid, &link);
 }
 
-#define UDP_CMD_VALID(x)	(x == HSB_CMD_BOX_DISCOVER || x == HSB_CMD_BOX_DISCOVER_RESP)
+static int _deal_set_linkage(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_LINKAGE_T msg;
+	HSB_LINKAGE_T link = { 0 };
+
+	hsb_msg_linkage_decode(buf, len, &msg);
+
+	link.id = msg.id;
+	link.work_mode = msg.work_mode;
+	link.flag = msg.flag;
+	link.evt_id = msg.evt_id;
+	link.evt_param1 = msg.evt_param1;
+	link.evt_param2 = msg.evt_param2;
+	link.act_devid = msg.act_devid;
+	link.act_id = msg.act_id;
+	link.act_param1 = msg.act_param1;
+	link.act_param2 = msg.act_param2;
+
+	return _reply_result(rbuf, set_dev_linkage(msg.devid, &link), msg.devid, cmd);
+}
 
-static int check_udp_pkt_valid(uint8_t *buf, int len)
+static int _deal_del_linkage(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_DEV_ITEM_T msg;
+
+	hsb_msg_dev_item_decode(buf, len, &msg);
+
+	return _reply_result(rbuf, del_dev_linkage(msg.devid, msg.id), msg.devid, cmd);
+}
+
+static int _deal_do_action(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_ACTION_T msg;
+	HSB_ACTION_T act = { 0 };
+
+	hsb_msg_action_decode(buf, len, &msg);
+
+	act.devid = msg.devid;
+	act.id = msg.id;
+	act.param1 = msg.param1;
+	act.param2 = msg.param2;
+
+	return _async_result(rbuf, set_dev_action_async(&act, reply), cmd);
+}
+
+static int _deal_probe_dev(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_PROBE_T msg;
+	HSB_PROBE_T probe;
+
+	hsb_msg_probe_decode(buf, len, &msg);
+	probe.drvid = msg.drvid;
+
+	hsb_debug("probe\n");
+
+	return _async_result(rbuf, probe_dev_async(&probe, reply), cmd);
+}
+
+static int _deal_add_dev(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_ADD_DEV_T msg;
+	HSB_DEV_CONFIG_T cfg;
+
+	hsb_msg_add_dev_decode(buf, len, &msg);
+	memcpy(cfg.name, msg.name, sizeof(cfg.name));
+	memcpy(cfg.location, msg.location, sizeof(cfg.location));
+
+	hsb_debug("add_dev: %d,%d\n", msg.drvid, msg.dev_type);
+
+	return _reply_result(rbuf, add_dev(msg.drvid, msg.dev_type, &cfg), 0, cmd);
+}
+
+static int _deal_del_dev(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_DEV_T msg;
+
+	hsb_msg_dev_decode(buf, len, &msg);
+
+	return _reply_result(rbuf, del_dev(msg.devid), 0, cmd);
+}
+
+static int _deal_set_scene(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_SCENE_T *scene = alloc_scene();
+	int ret;
+
+	if (!scene)
+		return _reply_result(rbuf, HSB_E_NO_MEMORY, 0, cmd);
+
+	ret = parse_scene(scene, buf, len);
+	if (HSB_E_OK != ret)
+		return _reply_result(rbuf, ret, 0, cmd);
+
+	hsb_debug("add scene [%s]\n", scene->name);
+
+	ret = add_scene(scene);
+
+	return _reply_result(rbuf, ret, 0, cmd);
+}
+
+static int _deal_del_scene(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_SCENE_NAME_T msg;
+
+	hsb_msg_scene_name_decode(buf, len, &msg);
+	hsb_debug("del scene [%.*s]\n", (int)sizeof(msg.name), msg.name);
+
+	return _reply_result(rbuf, del_scene((char *)msg.name), 0, cmd);
+}
+
+static int _deal_enter_scene(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_MSG_SCENE_NAME_T msg;
+
+	hsb_msg_scene_name_decode(buf, len, &msg);
+	hsb_debug("enter scene [%.*s]\n", (int)sizeof(msg.name), msg.name);
+
+	return _reply_result(rbuf, enter_scene((char *)msg.name), 0, cmd);
+}
+
+static int _deal_get_scene(uint16_t cmd, uint8_t *buf, int len, void *reply, uint8_t *rbuf)
+{
+	HSB_SCENE_T *scene = NULL;
+	uint32_t id, num = 0;
+	int ret;
+
+	ret = get_scene_num(&num);
+	if (HSB_E_OK != ret) {
+		hsb_debug("get scene num fail\n");
+		return _reply_result(rbuf, ret, 0, cmd);
+	}
+
+	for (id = 0; id < num; id++) {
+		ret = get_scene(id, &scene);
+		if (HSB_E_OK != ret)
+			continue;
+
+		rbuf = _reply_next(reply, _reply_get_scene(rbuf, scene));
+		if (!rbuf)
+			return -1;
+	}
+
+	return _reply_result(rbuf, HSB_E_OK, 0, cmd);
+}
+
+typedef int (*tcp_cmd_handler)(uint16_t cmd, uint8_t *buf, int len,
+				void *reply, uint8_t *rbuf);
+
+typedef struct {
+	tcp_cmd_handler	handler;
+	uint16_t	min_len;	/* shorter frames get HSB_E_BAD_PARAM */
+	uint16_t	async;		/* answered later through notify_resp */
+} tcp_cmd_entry;
+
+/* X(command, handler, shortest frame, async) */
+#define TCP_CMD_TABLE(X) \
+	X(HELLO, _deal_hello, 8, 0) \
+	X(SUBSCRIBE, _deal_subscribe, HSB_MSG_SUBSCRIBE_LEN, 0) \
+	X(HEARTBEAT, _deal_heartbeat, 4, 0) \
+	X(GET_DEVS, _deal_get_devs, 4, 0) \
+	X(GET_DEVS_PAGE, _deal_get_devs_page, 8, 0) \
+	X(GET_INFO, _deal_get_info, HSB_MSG_DEV_LEN, 0) \
+	X(GET_CONFIG, _deal_get_config, HSB_MSG_DEV_LEN, 0) \
+	X(SET_CONFIG, _deal_set_config, HSB_MSG_DEV_CONFIG_LEN, 0) \
+	X(GET_STATUS, _deal_get_status, HSB_MSG_DEV_LEN, 1) \
+	X(SET_STATUS, _deal_set_status, HSB_MSG_DEV_LEN, 1) \
+	X(GET_STATUS_BATCH, _deal_get_status_batch, 8, 1) \
+	X(SET_STATUS_BATCH, _deal_set_status_batch, 8, 1) \
+	X(SET_CHANNEL, _deal_set_channel, HSB_MSG_CHANNEL_LEN, 0) \
+	X(DEL_CHANNEL, _deal_del_channel, HSB_MSG_CHANNEL_NAME_LEN, 0) \
+	X(SWITCH_CHANNEL, _deal_switch_channel, HSB_MSG_CHANNEL_NAME_LEN, 1) \
+	X(GET_CHANNEL, _deal_get_channel, HSB_MSG_DEV_LEN, 0) \
+	X(GET_TIMER, _deal_get_timer, HSB_MSG_DEV_ITEM_LEN, 0) \
+	X(SET_TIMER, _deal_set_timer, HSB_MSG_TIMER_LEN, 0) \
+	X(DEL_TIMER, _deal_del_timer, HSB_MSG_DEV_ITEM_LEN, 0) \
+	X(GET_DELAY, _deal_get_delay, HSB_MSG_DEV_ITEM_LEN, 0) \
+	X(SET_DELAY, _deal_set_delay, HSB_MSG_DELAY_LEN, 0) \
+	X(DEL_DELAY, _deal_del_delay, HSB_MSG_DEV_ITEM_LEN, 0) \
+	X(GET_LINKAGE, _deal_get_linkage, HSB_MSG_DEV_ITEM_LEN, 0) \
+	X(SET_LINKAGE, _deal_set_linkage, HSB_MSG_LINKAGE_LEN, 0) \
+	X(DEL_LINKAGE, _deal_del_linkage, HSB_MSG_DEV_ITEM_LEN, 0) \
+	X(DO_ACTION, _deal_do_action, HSB_MSG_ACTION_LEN, 1) \
+	X(PROBE_DEV, _deal_probe_dev, HSB_MSG_PROBE_LEN, 1) \
+	X(ADD_DEV, _deal_add_dev, HSB_MSG_ADD_DEV_LEN, 0) \
+	X(DEL_DEV, _deal_del_dev, HSB_MSG_DEV_LEN, 0) \
+	X(SET_SCENE, _deal_set_scene, HSB_MSG_SCENE_NAME_LEN, 0) \
+	X(DEL_SCENE, _deal_del_scene, HSB_MSG_SCENE_NAME_LEN, 0) \
+	X(ENTER_SCENE, _deal_enter_scene, HSB_MSG_SCENE_NAME_LEN, 0) \
+	X(GET_SCENE, _deal_get_scene, 4, 0)
+
+#define CMD_INDEX(_cmd)	((_cmd) - HSB_CMD_BOX_DISCOVER)
+
+#define _TCP_CMD_ENTRY(_cmd, _handler, _min, _async) \
+	[CMD_INDEX(HSB_CMD_##_cmd)] = { _handler, _min, _async },
+
+/* indexed by cmd - HSB_CMD_BOX_DISCOVER, holes have no handler */
+static const tcp_cmd_entry tcp_cmds[CMD_INDEX(HSB_CMD_LAST)] = {
+	TCP_CMD_TABLE(_TCP_CMD_ENTRY)
+};
+
+static const tcp_cmd_entry *_cmd_entry(uint16_t cmd)
+{
+	const tcp_cmd_entry *entry;
+
+	if (!HSB_CMD_VALID(cmd))
+		return NULL;
+
+	entry = &tcp_cmds[CMD_INDEX(cmd)];
+
+	return entry->handler ? entry : NULL;
+}
+
+static bool _cmd_is_async(uint16_t cmd)
+{
+	const tcp_cmd_entry *entry = _cmd_entry(cmd);
+
+	return entry && entry->async;
+}
+
+int deal_tcp_packet(int fd, uint8_t *buf, int len, void *reply, int *used)
+{
+	const tcp_cmd_entry *entry;
+	uint8_t *reply_buf;
+	uint16_t cmd, cmdlen;
+	int rlen;
+
+	if (check_tcp_pkt_valid(buf, len)) {
+		hsb_debug("tcp pkt invalid, len=%d\n", len);
+		*used = len;
+		return -1;
+	}
+
+	cmd = GET_CMD_FIELD(buf, 0, uint16_t);
+	cmdlen = GET_CMD_FIELD(buf, 2, uint16_t);
+
+	*used = cmdlen;
+
+	/* the reply is built right where it will be sent from */
+	reply_buf = _reply_room(reply);
+	if (!reply_buf)
+		return -2;
+
+	entry = _cmd_entry(cmd);
+	if (!entry)
+		rlen = _reply_result(reply_buf, REPLY_FAIL, 0, cmd);
+	else if (cmdlen < entry->min_len)
+		rlen = _reply_result(reply_buf, HSB_E_BAD_PARAM, 0, cmd);
+	else
+		rlen = entry->handler(cmd, buf, cmdlen, reply, reply_buf);
+
+	if (rlen < 0) {
+		hsb_debug("rlen %d<0\n", rlen);
+		return -2;
+	}
+
+	if (rlen > 0)
+		_reply_commit(reply, rlen);
+
+	/* the reply comes later through notify_resp */
+	if (0 == rlen && entry && entry->async)
+		return 1;
+
+	return 0;
+}
+
+#define UDP_CMD_VALID(x)	(x == HSB_CMD_BOX_DISCOVER || x == HSB_CMD_BOX_DISCOVER_RESP)
+
+/* datagrams taken per recvmmsg, replies sent per sendmmsg */
+#define UDP_BATCH		(32)
+#define UDP_RECV_SIZE		(256)
+#define UDP_REPLY_SIZE		(32)
+#define UDP_RCVBUF		(512 * 1024)
+#define UDP_RETRY_USEC		(10 * 1000)	/* after a recv error, doubled */
+#define UDP_RETRY_MAX_USEC	(1000 * 1000)	/* while it keeps failing */
+
+/* a source is answered once per window, retries inside it are dropped */
+#define UDP_DEDUP_USEC		(200 * 1000)
+#define UDP_SEEN_SIZE		(256)
+
+typedef struct {
+	uint64_t	key;		/* ip << 16 | port */
+	gint64		time;
+} UDP_SEEN_T;
+
+static UDP_SEEN_T udp_seen[UDP_SEEN_SIZE];
+
+/* only touched by the udp thread */
+static struct {
+	unsigned long	rx;
+	unsigned long	batches;
+	unsigned long	invalid;
+	unsigned long	deduped;
+	unsigned long	replies;
+	unsigned long	send_calls;
+	unsigned long	send_errors;
+} udp_stats;
+
+static int check_udp_pkt_valid(uint8_t *buf, int len)
 {
 	if (!buf || len <= 0)
 		return -1;
@@ -975,113 +1272,457 @@ static int _reply_box_discover(uint8_t *buf, uint16_t bid)
 	return len;
 }
 
-static int deal_udp_packet(int fd, uint8_t *buf, int len, struct sockaddr *cliaddr, socklen_t slen)
+/* fill reply_buf for one datagram, return its length or 0 for no reply */
+static int deal_udp_packet(uint8_t *buf, int len, uint8_t *reply_buf)
 {
 	int rlen = 0;
-	uint8_t reply_buf[32];
 	uint32_t bid = 1;
 
 	if (check_udp_pkt_valid(buf, len)) {
-		hsb_critical("get invalid udp pkt\n");
-		return -1;
+		udp_stats.invalid++;
+		return 0;
 	}
 
 	uint16_t cmd = GET_CMD_FIELD(buf, 0, uint16_t);
-	memset(reply_buf, 0, sizeof(reply_buf));
+	memset(reply_buf, 0, UDP_REPLY_SIZE);
 
 	switch (cmd) {
 		case HSB_CMD_BOX_DISCOVER:
 		{
-			uint16_t uid = GET_CMD_FIELD(buf, 6, uint16_t);
 			rlen = _reply_box_discover(reply_buf, bid);
+			break;
 		}
 		default:
 			break;
 	}
 
-	if (rlen > 0) {
-		sendto(fd, reply_buf, rlen, 0, (const struct sockaddr *)cliaddr, slen);
-	}
+	return rlen;
+}
 
-	return 0;
+/* true if this source got a reply within the dedup window */
+static bool _udp_seen(struct sockaddr_in *addr, gint64 now)
+{
+	uint64_t key = ((uint64_t)addr->sin_addr.s_addr << 16) | addr->sin_port;
+	UDP_SEEN_T *seen = &udp_seen[key % UDP_SEEN_SIZE];
+
+	if (seen->key == key && now - seen->time < UDP_DEDUP_USEC)
+		return true;
+
+	seen->key = key;
+	seen->time = now;
+
+	return false;
 }
 
+/*
+ * Drain a burst of datagrams with one recvmmsg, answer each source once
+ * per dedup window and send all replies with one sendmmsg.
+ */
 static void *udp_listen_thread(void *arg)
 {
-	struct sockaddr_in cliaddr;
+	static uint8_t rbuf[UDP_BATCH][UDP_RECV_SIZE];
+	static uint8_t sbuf[UDP_BATCH][UDP_REPLY_SIZE];
+	static struct sockaddr_in addr[UDP_BATCH];
+	struct mmsghdr rmsg[UDP_BATCH], smsg[UDP_BATCH];
+	struct iovec riov[UDP_BATCH], siov[UDP_BATCH];
 	int sockfd = open_udp_listenfd(CORE_UDP_LISTEN_PORT);
+	int cnt, nread, nreply, nsent, ret, rlen;
+	gulong retry = UDP_RETRY_USEC;
+	gint64 now;
+
 	if (sockfd < 0)
 		return NULL;
 
-	int nread;
-	socklen_t len;
-	uint8_t buf[1024];
+	/* room for a whole LAN asking at once */
+	rlen = UDP_RCVBUF;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rlen, sizeof(rlen));
+
+	for (cnt = 0; cnt < UDP_BATCH; cnt++) {
+		riov[cnt].iov_base = rbuf[cnt];
+		riov[cnt].iov_len = UDP_RECV_SIZE;
+	}
 
 	while (1) {
-		len = sizeof(cliaddr);
-		nread = recvfrom(sockfd,
-				buf,
-				sizeof(buf),
-				0,
-				(struct sockaddr *)&cliaddr,
-				&len);
+		memset(rmsg, 0, sizeof(rmsg));
+		for (cnt = 0; cnt < UDP_BATCH; cnt++) {
+			rmsg[cnt].msg_hdr.msg_iov = &riov[cnt];
+			rmsg[cnt].msg_hdr.msg_iovlen = 1;
+			rmsg[cnt].msg_hdr.msg_name = &addr[cnt];
+			rmsg[cnt].msg_hdr.msg_namelen = sizeof(addr[cnt]);
+		}
+
+		/* block for the first one, then take whatever is queued */
+		nread = recvmmsg(sockfd, rmsg, UDP_BATCH, MSG_WAITFORONE, NULL);
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+
+			hsb_critical("udp recv error: %s\n", strerror(errno));
+
+			/* a broken socket never recovers */
+			if (errno == EBADF || errno == ENOTSOCK ||
+			    errno == EFAULT || errno == EINVAL)
+				break;
+
+			g_usleep(retry);
+			retry = MIN(retry * 2, UDP_RETRY_MAX_USEC);
+			continue;
+		}
+
+		retry = UDP_RETRY_USEC;
+
+		udp_stats.batches++;
+		udp_stats.rx += nread;
+		now = g_get_monotonic_time();
+		nreply = 0;
 
-		deal_udp_packet(sockfd, buf, nread, (struct sockaddr *)&cliaddr, len);
+		for (cnt = 0; cnt < nread; cnt++) {
+			rlen = deal_udp_packet(rbuf[cnt], rmsg[cnt].msg_len, sbuf[nreply]);
+			if (rlen <= 0)
+				continue;
+
+			if (_udp_seen(&addr[cnt], now)) {
+				udp_stats.deduped++;
+				continue;
+			}
+
+			siov[nreply].iov_base = sbuf[nreply];
+			siov[nreply].iov_len = rlen;
+
+			memset(&smsg[nreply], 0, sizeof(smsg[nreply]));
+			smsg[nreply].msg_hdr.msg_iov = &siov[nreply];
+			smsg[nreply].msg_hdr.msg_iovlen = 1;
+			smsg[nreply].msg_hdr.msg_name = &addr[cnt];
+			smsg[nreply].msg_hdr.msg_namelen = rmsg[cnt].msg_hdr.msg_namelen;
+			nreply++;
+		}
+
+		for (nsent = 0; nsent < nreply; nsent += ret) {
+			ret = sendmmsg(sockfd, smsg + nsent, nreply - nsent, 0);
+			udp_stats.send_calls++;
+			if (ret <= 0) {
+				if (ret < 0 && errno == EINTR) {
+					ret = 0;
+					continue;
+				}
+				/* skip the one the kernel refused */
+				udp_stats.send_errors++;
+				ret = 1;
+				continue;
+			}
+			udp_stats.replies += ret;
+		}
 	}
 
+	close(sockfd);
+
 	return NULL;
 }
 
 /* tcp client pool */
 
+/* what a client subscribed to, compiled from SUBSCRIBE */
+typedef struct {
+	uint32_t evt_mask;		/* 1 << HSB_EVT_TYPE_* */
+	uint32_t status_mask;		/* 1 << status id */
+	int dev_words;			/* 0 takes every device */
+	uint32_t dev_bits[];
+} client_filter;
+
 typedef struct {
 	int tcp_sockfd;
-	int un_sockfd;
-	char listen_path[64];
-	GMutex mutex;
-	GQueue queue;
+
+	/* receive buffer, holds at most one partial frame between reads */
+	uint8_t *ibuf;
+	int ilen;
+
+	/* output buffer, data between ohead and otail is not sent yet */
+	uint8_t *obuf;
+	int ohead;
+	int otail;
+	int osize;
+	int want_out;			/* EPOLLOUT armed */
+	int overflow;			/* output dropped, close the client */
+
+	int efd;			/* notify doorbell */
+	gint signaled;			/* efd written, reactor not yet run */
+	HSB_RESP_T *notifyq;		/* lock-free stack, newest first */
 	int using;
+	uint32_t gen;			/* bumped per connection, tags its replies */
+
+	/* notifications held while the socket is backed up, reactor only */
+	GQueue backlog;
+	int backlog_alarms;		/* alarms at the head of backlog */
+	GHashTable *coalesce;		/* devid -> status update in backlog */
+	int drop_run;			/* drops since the backlog was last empty */
+	unsigned long coalesced;
+	unsigned long dropped;
+
+	uint32_t features;		/* HSB_FEATURE_*, from HELLO */
+	uint32_t attach_seq;		/* broadcasts after it reach the client directly */
+	uint32_t seen_seq;		/* resumed up to here, later copies are dropped */
+	client_filter *filter;		/* NULL takes everything, set under the ring lock */
+	int inflight;			/* async commands without a reply yet */
+	int greeted;			/* HELLO or any other frame seen */
+	gint64 accept_time;
+	gint64 snapshot_due;		/* connect snapshot held for HELLO, 0 none */
+
+	gint64 last_rx;			/* monotonic usec of the last read */
+	gint64 last_tx;			/* last write that made progress */
+	gint64 last_ping;
 } tcp_client_context;
 
 typedef struct {
-	tcp_client_context	context[MAX_TCP_CLIENT_NUM];
+	tcp_client_context	*context;
+	int			num;
 	GMutex			mutex;
 
-	GThreadPool		*pool;
+	int			epfd;
+	int			deferred;	/* clients with snapshot_due set */
 } tcp_client_pool;
 
 static tcp_client_pool	client_pool;
 
-static void tcp_client_handler(gpointer data, gpointer user_data);
+/* longest command frame a client may send */
+#define CLIENT_IBUF_SIZE	(2048)
+
+/* output buffer grows up to the max, a client behind that is dropped */
+#define CLIENT_OBUF_INIT	(4096)
+#define CLIENT_OBUF_MAX		(64 * 1024)
+
+/*
+ * A client that doesn't read gets its notifications held in a backlog:
+ * status updates of one device are coalesced, broadcasts past the max
+ * are dropped, and past the drop limit or the hard cap it is closed.
+ */
+#define CLIENT_BACKLOG_MAX	(128)
+#define CLIENT_BACKLOG_HARD	(256)	/* room for replies and alarms */
+#define CLIENT_DROP_MAX		(512)
+#define CLIENT_DRAIN_HIGH	(16 * 1024)	/* serialized before each flush */
+#define SNAPSHOT_MAX_LEN	(32 * 1024)
+#define SNAPSHOT_SCENE_MAX	(64)
+#define SNAPSHOT_TRUNCATED	(1 << 0)
+#define SNAPSHOT_UNSTABLE	(1 << 1)
+
+/*
+ * Dead peers: the kernel probes an idle socket after 5s and gives up
+ * after 3 more tries 2s apart, unacked data times out after 10s. A client
+ * with HSB_FEATURE_HEARTBEAT is pinged after 5s of silence and closed
+ * after 15s, any client whose output is stuck for 30s is closed too.
+ */
+#define CLIENT_KEEPIDLE		(5)
+#define CLIENT_KEEPINTVL	(2)
+#define CLIENT_KEEPCNT		(3)
+#define CLIENT_USER_TIMEOUT	(10000)		/* ms */
+#define CLIENT_PING_USEC	(5 * G_USEC_PER_SEC)
+#define CLIENT_REAP_USEC	(15 * G_USEC_PER_SEC)
+#define CLIENT_STALL_USEC	(30 * G_USEC_PER_SEC)
+#define CLIENT_SWEEP_USEC	(1 * G_USEC_PER_SEC)
+
+/*
+ * How long a new client may take to send HELLO before it gets a snapshot.
+ * Broadcasts are held in the backlog meanwhile, so a resuming client gets
+ * them once, in seq order, behind what HELLO replays. A later HELLO
+ * cannot resume.
+ */
+#define HELLO_GRACE_USEC	(200 * 1000)
+
+/* async commands a client may have outstanding, more get HSB_E_BUSY */
+#define CLIENT_MAX_INFLIGHT	(32)
+
+/* limits of one SUBSCRIBE, the device bitmap stays under 8K */
+#define SUB_MAX_DEVS		(256)
+#define SUB_MAX_DEVID		(65535)
+
+/* broadcast notifications kept for clients that reconnect */
+#define EVENT_RING_SIZE		(512)
+
+static struct {
+	GMutex		mutex;
+	uint32_t	epoch;		/* tells a restarted daemon apart */
+	uint32_t	seq;		/* last one handed out */
+	HSB_RESP_T	ring[EVENT_RING_SIZE];
+
+	unsigned long	delivered;	/* broadcast copies queued to clients */
+	unsigned long	filtered;	/* skipped by a subscription */
+} event_ring;
+
+static uint32_t _event_seq(void)
+{
+	uint32_t seq;
+
+	g_mutex_lock(&event_ring.mutex);
+	seq = event_ring.seq;
+	g_mutex_unlock(&event_ring.mutex);
+
+	return seq;
+}
+
+/* caller holds the ring lock, alarms go through any filter */
+static bool _filter_match(const client_filter *filter, const HSB_RESP_T *resp)
+{
+	uint32_t devid, status = 0;
+	int id;
+
+	if (!filter || resp->rx_time)
+		return true;
+
+	switch (resp->type) {
+		case HSB_RESP_TYPE_EVENT:
+			if (resp->u.event.id >= 32 ||
+			    !(filter->evt_mask & (1u << resp->u.event.id)))
+				return false;
+			devid = resp->u.event.devid;
+			break;
+		case HSB_RESP_TYPE_STATUS:
+		case HSB_RESP_TYPE_STATUS_UPDATE:
+			for (id = 0; id < resp->u.status.num; id++)
+				if (resp->u.status.id[id] < 32)
+					status |= 1u << resp->u.status.id[id];
+			if (!(filter->status_mask & status))
+				return false;
+			devid = resp->u.status.devid;
+			break;
+		case HSB_RESP_TYPE_RESULT:
+			devid = resp->u.result.devid;
+			break;
+		default:
+			return true;
+	}
+
+	if (!filter->dev_words)
+		return true;
+
+	if (devid >= filter->dev_words * 32)
+		return false;
+
+	return (filter->dev_bits[devid / 32] & (1u << (devid % 32))) != 0;
+}
+
+/* swap in a new filter, the broadcast path reads it under the same lock */
+static void _set_filter(tcp_client_context *pctx, client_filter *filter)
+{
+	client_filter *old;
+
+	g_mutex_lock(&event_ring.mutex);
+	old = pctx->filter;
+	pctx->filter = filter;
+	g_mutex_unlock(&event_ring.mutex);
+
+	g_free(old);
+}
+
+/* output statistics, only touched by the reactor thread */
+static struct {
+	unsigned long	msgs;
+	unsigned long	writes;
+	unsigned long	partial;
+	unsigned long	wait_out;
+	unsigned long	overflow;
+
+	unsigned long	frames;
+	unsigned long	split_frames;
+	unsigned long	bad_frames;
+
+	unsigned long	resumed;
+	unsigned long	resynced;
+	unsigned long	replayed;
+
+	unsigned long	busy;
+
+	unsigned long	coalesced;
+	unsigned long	dropped;
+	unsigned long	slow_closed;
+
+	unsigned long	pings;
+	unsigned long	reaped;
+} net_stats;
+
+/* notifications queued to clients, sized for a burst per client */
+#define NOTIFY_POOL_PER_CLIENT	(32)
+
+static obj_pool *resp_pool = NULL;
+
+/*
+ * One reactor thread owns every client socket through epoll. The epoll
+ * data of a client carries its context index, the low bit marks its
+ * notify eventfd.
+ *
+ * Notifications are pushed on a per-client lock-free stack, the reactor
+ * takes the whole stack at once. Only the push that finds the client
+ * unsignaled writes the eventfd, so a burst costs one wakeup.
+ */
+#define EP_DATA(idx, notify)	(((uint64_t)(idx) << 1) | (notify))
+#define EP_IDX(data)		((int)((data) >> 1))
+#define EP_IS_NOTIFY(data)	((int)((data) & 1))
+
+#define EP_MAX_EVENTS		(32)
+
+static int set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0)
+		return -1;
+
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void set_keepalive(int fd)
+{
+	int on = 1;
+	int idle = CLIENT_KEEPIDLE, intvl = CLIENT_KEEPINTVL, cnt = CLIENT_KEEPCNT;
+
+	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &intvl, sizeof(intvl));
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &cnt, sizeof(cnt));
+#ifdef TCP_USER_TIMEOUT
+	{
+		unsigned int timeout = CLIENT_USER_TIMEOUT;
+
+		setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &timeout, sizeof(timeout));
+	}
+#endif
+}
 
-static int init_client_pool(void)
+static int init_client_pool(int max_client)
 {
 	int cnt;
 	tcp_client_context *pctx = NULL;
-	const char *work_dir = get_work_dir();
 
 	memset(&client_pool, 0, sizeof(client_pool));
 
-	for (cnt = 0; cnt < MAX_TCP_CLIENT_NUM; cnt++) {
+	if (max_client <= 0)
+		max_client = MAX_TCP_CLIENT_NUM;
+
+	client_pool.num = max_client;
+	client_pool.context = g_new0(tcp_client_context, max_client);
+
+	for (cnt = 0; cnt < client_pool.num; cnt++) {
 		pctx = &client_pool.context[cnt];
 
-		g_mutex_init(&pctx->mutex);
-		g_queue_init(&pctx->queue);
+		pctx->ibuf = g_malloc(CLIENT_IBUF_SIZE);
 
-		snprintf(pctx->listen_path,
-			sizeof(pctx->listen_path),
-			"%score_client_%d.listen",
-			work_dir,
-			cnt);
+		pctx->osize = CLIENT_OBUF_INIT;
+		pctx->obuf = g_malloc(pctx->osize);
 
-		//pctx->un_sockfd = unix_socket_new_listen((const char *)pctx->listen_path);
+		g_queue_init(&pctx->backlog);
+		pctx->coalesce = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+		pctx->efd = eventfd(0, EFD_NONBLOCK);
+		if (pctx->efd < 0) {
+			hsb_critical("client eventfd error\n");
+			return -1;
+		}
 	}
 
 	g_mutex_init(&client_pool.mutex);
-	
-	GError *error = NULL;
 
-	client_pool.pool = g_thread_pool_new(tcp_client_handler, NULL, 5, TRUE, &error);
+	client_pool.epfd = epoll_create(client_pool.num * 2);
+	if (client_pool.epfd < 0) {
+		hsb_critical("epoll create error\n");
+		return -1;
+	}
 
 	return 0;
 }
@@ -1092,6 +1733,80 @@ static int release_client_pool(void)
 	return 0;
 }
 
+static int _epoll_add(int fd, uint64_t data)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = data;
+
+	return epoll_ctl(client_pool.epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void _push_notify(tcp_client_context *pctx, HSB_RESP_T *notify)
+{
+	HSB_RESP_T *head;
+	uint64_t one = 1;
+
+	do {
+		head = g_atomic_pointer_get(&pctx->notifyq);
+		notify->next = head;
+	} while (!g_atomic_pointer_compare_and_exchange(&pctx->notifyq, head, notify));
+
+	if (g_atomic_int_compare_and_exchange(&pctx->signaled, 0, 1))
+		write(pctx->efd, &one, sizeof(one));
+}
+
+/* take everything queued so far, oldest first */
+static HSB_RESP_T *_take_notify(tcp_client_context *pctx)
+{
+	HSB_RESP_T *head, *prev = NULL, *next;
+
+	do {
+		head = g_atomic_pointer_get(&pctx->notifyq);
+	} while (head && !g_atomic_pointer_compare_and_exchange(&pctx->notifyq, head, NULL));
+
+	while (head) {
+		next = head->next;
+		head->next = prev;
+		prev = head;
+		head = next;
+	}
+
+	return prev;
+}
+
+static void _free_notify(HSB_RESP_T *resp)
+{
+	if (HSB_RESP_TYPE_STATUS_BATCH == resp->type)
+		free_status_batch(resp->u.batch);
+
+	obj_pool_free(resp_pool, resp);
+}
+
+static void _drop_notify(tcp_client_context *pctx)
+{
+	HSB_RESP_T *resp, *next;
+
+	for (resp = _take_notify(pctx); resp; resp = next) {
+		next = resp->next;
+		_free_notify(resp);
+	}
+}
+
+static void _drop_backlog(tcp_client_context *pctx)
+{
+	HSB_RESP_T *resp;
+
+	while ((resp = g_queue_pop_head(&pctx->backlog)))
+		_free_notify(resp);
+
+	g_hash_table_remove_all(pctx->coalesce);
+	pctx->backlog_alarms = 0;
+	pctx->drop_run = 0;
+}
+
 static tcp_client_context *get_client_context(int sockfd)
 {
 	int cnt;
@@ -1099,20 +1814,54 @@ static tcp_client_context *get_client_context(int sockfd)
 
 	g_mutex_lock(&client_pool.mutex);
 
-	for (cnt = 0; cnt < MAX_TCP_CLIENT_NUM; cnt++) {
+	for (cnt = 0; cnt < client_pool.num; cnt++) {
 		pctx = &client_pool.context[cnt];
 		if (!pctx->using)
 			break;
 	}
 
-	if (cnt == MAX_TCP_CLIENT_NUM) {
+	if (cnt == client_pool.num) {
 		g_mutex_unlock(&client_pool.mutex);
 		return NULL;
 	}
 
-	pctx->using = 1;
 	pctx->tcp_sockfd = sockfd;
-	pctx->un_sockfd = unix_socket_new_listen((const char *)pctx->listen_path);
+	pctx->ilen = 0;
+	pctx->ohead = pctx->otail = 0;
+	pctx->want_out = 0;
+	pctx->overflow = 0;
+	pctx->coalesced = 0;
+	pctx->dropped = 0;
+	pctx->features = 0;
+	pctx->inflight = 0;
+	pctx->greeted = 0;
+	pctx->accept_time = g_get_monotonic_time();
+	pctx->last_rx = pctx->last_tx = pctx->last_ping = pctx->accept_time;
+	set_nonblock(sockfd);
+	set_keepalive(sockfd);
+
+	/* a notify racing with the last close may still sit here */
+	_drop_notify(pctx);
+
+	pctx->seen_seq = 0;
+
+	/* replies still owed to the last user of this slot are dropped */
+	pctx->gen++;
+
+	/* broadcasts check using under the ring lock, none is missed or doubled */
+	g_mutex_lock(&event_ring.mutex);
+	pctx->attach_seq = event_ring.seq;
+	pctx->using = 1;
+	g_mutex_unlock(&event_ring.mutex);
+
+	if (_epoll_add(sockfd, EP_DATA(cnt, 0)) ||
+	    _epoll_add(pctx->efd, EP_DATA(cnt, 1))) {
+		hsb_critical("epoll add client error\n");
+		epoll_ctl(client_pool.epfd, EPOLL_CTL_DEL, sockfd, NULL);
+		pctx->using = 0;
+		g_mutex_unlock(&client_pool.mutex);
+		return NULL;
+	}
 
 	g_mutex_unlock(&client_pool.mutex);
 
@@ -1121,23 +1870,57 @@ static tcp_client_context *get_client_context(int sockfd)
 
 static int put_client_context(tcp_client_context *pctx)
 {
-	
 	g_mutex_lock(&client_pool.mutex);
 
+	uint64_t val;
+
 	pctx->using = 0;
 
-	// TODO: clean queue
-	unix_socket_free(pctx->un_sockfd);
+	_drop_notify(pctx);
+	_drop_backlog(pctx);
+
+	if (pctx->snapshot_due) {
+		pctx->snapshot_due = 0;
+		client_pool.deferred--;
+	}
+
+	_set_filter(pctx, NULL);
+
+	/* unregister before close, the fd number may be reused by accept */
+	epoll_ctl(client_pool.epfd, EPOLL_CTL_DEL, pctx->tcp_sockfd, NULL);
+	epoll_ctl(client_pool.epfd, EPOLL_CTL_DEL, pctx->efd, NULL);
+
+	close(pctx->tcp_sockfd);
+
+	read(pctx->efd, &val, sizeof(val));
+	g_atomic_int_set(&pctx->signaled, 0);
 
 	g_mutex_unlock(&client_pool.mutex);
 
 	return 0;
 }
 
+/* the reactor builds the snapshot, accept only queues the request */
+static void _request_snapshot(tcp_client_context *pctx)
+{
+	HSB_RESP_T *resp = obj_pool_alloc0(resp_pool);
+
+	if (!resp) {
+		hsb_debug("no memory\n");
+		return;
+	}
+
+	resp->type = HSB_RESP_TYPE_SNAPSHOT;
+
+	_push_notify(pctx, resp);
+}
+
+/* out of fds, the pending connection stays queued until some close */
+#define ACCEPT_RETRY_USEC	(100 * 1000)
+
 static void *tcp_listen_thread(void *arg)
 {
-	fd_set readset;
-        int ret, sockfd = 0;
+        int sockfd = 0;
         int listenfd = open_tcp_listenfd(CORE_TCP_LISTEN_PORT);
         if (listenfd <= 0) {
                 hsb_critical("open listen fd error\n");
@@ -1154,6 +1937,16 @@ static void *tcp_listen_thread(void *arg)
 		bzero(&addr, addrlen);
 		sockfd = accept(listenfd, &addr, &addrlen);
 		if (sockfd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			if (errno == EMFILE || errno == ENFILE ||
+			    errno == ENOBUFS || errno == ENOMEM) {
+				hsb_critical("accept error: %s\n", strerror(errno));
+				g_usleep(ACCEPT_RETRY_USEC);
+				continue;
+			}
+
 			hsb_critical("accept error\n");
 			close(listenfd);
 			return NULL;
@@ -1167,10 +1960,7 @@ static void *tcp_listen_thread(void *arg)
 			continue;
 		}
 
-		g_thread_pool_push(client_pool.pool, (gpointer)pctx, NULL);
-
-		usleep(1000000);
-		report_all_device(pctx);
+		_request_snapshot(pctx);
 	}
 
 	hsb_critical("tcp listen thread closed\n");
@@ -1178,86 +1968,772 @@ static void *tcp_listen_thread(void *arg)
 	return NULL;
 }
 
-static int _process_notify(int fd, tcp_client_context *pctx)
+static void _set_want_out(tcp_client_context *pctx, int want)
 {
-	HSB_RESP_T *resp = NULL;
-	uint8_t buf[128];
-	int ret, len;
+	struct epoll_event ev;
 
-	while (!g_queue_is_empty(&pctx->queue)) {
-		resp = g_queue_pop_head(&pctx->queue);
+	if (pctx->want_out == want)
+		return;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = want ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+	ev.data.u64 = EP_DATA(pctx - client_pool.context, 0);
+
+	epoll_ctl(client_pool.epfd, EPOLL_CTL_MOD, pctx->tcp_sockfd, &ev);
+	pctx->want_out = want;
+}
 
-		memset(buf, 0, sizeof(buf));
+/* room for @len bytes at the tail, NULL once the client is too far behind */
+static uint8_t *_obuf_reserve(tcp_client_context *pctx, int len)
+{
+	int used = pctx->otail - pctx->ohead;
 
-		len = _make_notify_resp(buf, resp);
-		g_slice_free(HSB_RESP_T, resp);
+	if (pctx->otail + len <= pctx->osize)
+		return pctx->obuf + pctx->otail;
 
-		ret = write(fd, buf, len);
-		if (ret <= 0)
-			return ret;
+	if (pctx->ohead) {
+		memmove(pctx->obuf, pctx->obuf + pctx->ohead, used);
+		pctx->ohead = 0;
+		pctx->otail = used;
 	}
 
-	return 0;
+	if (used + len > pctx->osize) {
+		int size = pctx->osize;
+
+		while (size < used + len)
+			size *= 2;
+
+		if (size > CLIENT_OBUF_MAX) {
+			net_stats.overflow++;
+			pctx->overflow = 1;
+			return NULL;
+		}
+
+		pctx->obuf = g_realloc(pctx->obuf, size);
+		pctx->osize = size;
+	}
+
+	return pctx->obuf + pctx->otail;
 }
 
-static void tcp_client_handler(gpointer data, gpointer user_data)
+static int _trailer_len(tcp_client_context *pctx)
 {
-	tcp_client_context *pctx = (tcp_client_context *)data;
-	fd_set readset;
-	int ret, nread;
-	int sockfd = pctx->tcp_sockfd;
-	int unfd = pctx->un_sockfd;
-	int maxfd = (sockfd > unfd) ? sockfd : unfd;
-	uint8_t msg[1024];
+	return ((pctx->features & HSB_FEATURE_SEQ) ? 4 : 0) +
+		((pctx->features & HSB_FEATURE_REQ_ID) ? 4 : 0);
+}
 
-        signal(SIGPIPE, SIG_IGN);
+/* append the trailers the client asked for, return the new frame length */
+static int _put_trailer(tcp_client_context *pctx, uint8_t *buf, int len,
+			uint32_t seq, uint32_t req_id)
+{
+	if (!(pctx->features & HSB_FEATURE_ALL))
+		return len;
 
-	while (1) {
-		FD_ZERO(&readset);
-		FD_SET(sockfd, &readset);
-		FD_SET(unfd, &readset);
+	if (pctx->features & HSB_FEATURE_SEQ) {
+		SET_CMD_FIELD(buf, len, uint32_t, seq);
+		len += 4;
+	}
+
+	if (pctx->features & HSB_FEATURE_REQ_ID) {
+		SET_CMD_FIELD(buf, len, uint32_t, req_id);
+		len += 4;
+	}
+
+	SET_CMD_FIELD(buf, 2, uint16_t, len);
 
-		ret = select(maxfd+1, &readset, NULL, NULL, NULL);
+	return len;
+}
+
+/*
+ * Replies are built in place at the tail of the output buffer: take room
+ * for the largest one, build it there, then commit what was used.
+ */
+static uint8_t *_reply_room(void *reply)
+{
+	tcp_client_context *pctx = (tcp_client_context *)reply;
+
+	if (!pctx)
+		return NULL;
+
+	return _obuf_reserve(pctx, REPLY_BUF_SIZE + 8);
+}
+
+static void _reply_commit(void *reply, int len)
+{
+	tcp_client_context *pctx = (tcp_client_context *)reply;
+
+	if (!pctx || len <= 0)
+		return;
 
-		if (ret <= 0) {
-			hsb_critical("select error\n");
+	len = _put_trailer(pctx, pctx->obuf + pctx->otail, len, 0,
+			get_act_req_id());
+	pctx->otail += len;
+	net_stats.msgs++;
+}
+
+/* commit one reply of a stream, the next goes at the returned pointer */
+static uint8_t *_reply_next(void *reply, int len)
+{
+	_reply_commit(reply, len);
+
+	return _reply_room(reply);
+}
+
+/* send what the socket takes now, the rest waits for EPOLLOUT */
+static int _client_flush(tcp_client_context *pctx)
+{
+	int nwrite;
+
+	if (pctx->overflow)
+		return -1;
+
+	while (pctx->ohead < pctx->otail) {
+		nwrite = write(pctx->tcp_sockfd, pctx->obuf + pctx->ohead,
+				pctx->otail - pctx->ohead);
+		net_stats.writes++;
+
+		if (nwrite < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				net_stats.wait_out++;
+				_set_want_out(pctx, 1);
+				return 0;
+			}
+			return -1;
+		}
+
+		pctx->ohead += nwrite;
+		pctx->last_tx = g_get_monotonic_time();
+		if (pctx->ohead < pctx->otail)
+			net_stats.partial++;
+	}
+
+	pctx->ohead = pctx->otail = 0;
+	_set_want_out(pctx, 0);
+
+	return 0;
+}
+
+/*
+ * [hdr][version][work mode][flags][dev num][scene num]
+ * [scene num * name 16][dev num * device record]
+ * Devices that don't fit set SNAPSHOT_TRUNCATED, the client pages the
+ * rest with GET_DEVS_PAGE from the last id it got. SNAPSHOT_UNSTABLE
+ * means status kept changing while it was copied, the records may mix
+ * two versions and the client pages every device again.
+ */
+static int _queue_snapshot(tcp_client_context *pctx)
+{
+	HSB_DEV_SNAP_T *snap;
+	HSB_SCENE_T *scene;
+	HSB_WORK_MODE_T mode;
+	uint32_t version, scene_num = 0;
+	uint32_t seq;
+	uint16_t flags = 0;
+	int num, dev_num, id, len, off;
+	uint8_t *ptr;
+
+	/* events up to seq are in the copy, later ones may be too */
+	seq = _event_seq();
+
+	if (HSB_E_OK != get_dev_snapshot(&snap, &num, &version, &mode))
+		flags |= SNAPSHOT_UNSTABLE;
+	get_scene_num(&scene_num);
+	if (scene_num > SNAPSHOT_SCENE_MAX)
+		scene_num = SNAPSHOT_SCENE_MAX;
+
+	len = 16 + scene_num * HSB_SCENE_MAX_NAME_LEN + _trailer_len(pctx);
+
+	for (dev_num = 0; dev_num < num; dev_num++) {
+		if (len + DEV_RECORD_LEN(&snap[dev_num]) > SNAPSHOT_MAX_LEN) {
+			flags |= SNAPSHOT_TRUNCATED;
 			break;
 		}
+		len += DEV_RECORD_LEN(&snap[dev_num]);
+	}
 
-		if (FD_ISSET(sockfd, &readset)) {
-			nread = read(sockfd, msg, sizeof(msg));	
-			if (nread <= 0) {
+	ptr = _obuf_reserve(pctx, len);
+	if (!ptr) {
+		g_free(snap);
+		return -1;
+	}
+
+	memset(ptr, 0, len);
+
+	MAKE_CMD_HDR(ptr, HSB_CMD_SNAPSHOT, len);
+	SET_CMD_FIELD(ptr, 4, uint32_t, version);
+	SET_CMD_FIELD(ptr, 8, uint16_t, mode);
+	SET_CMD_FIELD(ptr, 10, uint16_t, flags);
+	SET_CMD_FIELD(ptr, 12, uint16_t, dev_num);
+	SET_CMD_FIELD(ptr, 14, uint16_t, scene_num);
+
+	off = 16;
+	for (id = 0; id < scene_num; id++, off += HSB_SCENE_MAX_NAME_LEN) {
+		if (HSB_E_OK == get_scene(id, &scene))
+			memcpy(ptr + off, scene->name, HSB_SCENE_MAX_NAME_LEN);
+	}
+
+	for (id = 0; id < dev_num; id++)
+		off += _put_dev_record(ptr + off, &snap[id]);
+
+	_put_trailer(pctx, ptr, off, seq, 0);
+
+	g_free(snap);
+
+	pctx->otail += len;
+	net_stats.msgs++;
+
+	return len;
+}
+
+static int _queue_notify(tcp_client_context *pctx, HSB_RESP_T *resp)
+{
+	uint8_t *ptr;
+	int len = 128;
+
+	if (HSB_RESP_TYPE_SNAPSHOT == resp->type) {
+		/* give a new client the chance to resume with HELLO first */
+		if (!pctx->greeted && !pctx->snapshot_due) {
+			pctx->snapshot_due = pctx->accept_time + HELLO_GRACE_USEC;
+			client_pool.deferred++;
+			return 0;
+		}
+
+		return _queue_snapshot(pctx);
+	}
+
+	if (HSB_RESP_TYPE_STATUS_BATCH == resp->type)
+		len = _batch_resp_len(resp->u.batch);
+
+	ptr = _obuf_reserve(pctx, len + 8);
+	if (!ptr)
+		return -1;
+
+	/* every byte is set, nothing to clear */
+	len = _make_notify_resp(ptr, resp);
+	if (len > 0)
+		len = _put_trailer(pctx, ptr, len, resp->seq, resp->req_id);
+
+	pctx->otail += len;
+	net_stats.msgs++;
+
+	return len;
+}
+
+/* replies, alarms and snapshots are never coalesced or dropped */
+static bool _must_deliver(HSB_RESP_T *resp)
+{
+	return resp->reply || resp->rx_time ||
+		HSB_RESP_TYPE_SNAPSHOT == resp->type;
+}
+
+static bool _can_coalesce(HSB_RESP_T *resp)
+{
+	return HSB_RESP_TYPE_STATUS_UPDATE == resp->type && !_must_deliver(resp);
+}
+
+/* fold the newer values into the update already waiting */
+static void _coalesce_status(HSB_RESP_T *old, HSB_RESP_T *resp)
+{
+	HSB_STATUS_T *ostat = &old->u.status;
+	HSB_STATUS_T *nstat = &resp->u.status;
+	int id, cnt;
+
+	for (cnt = 0; cnt < nstat->num; cnt++) {
+		for (id = 0; id < ostat->num; id++) {
+			if (ostat->id[id] == nstat->id[cnt])
 				break;
-			}
+		}
+
+		if (id == ostat->num) {
+			if (ostat->num >= 8)
+				continue;
+			ostat->id[id] = nstat->id[cnt];
+			ostat->num++;
+		}
+
+		ostat->val[id] = nstat->val[cnt];
+	}
+
+	old->seq = resp->seq;
+}
+
+/* a new client waiting for its HELLO grace, see HELLO_GRACE_USEC */
+static bool _client_held(tcp_client_context *pctx)
+{
+	return !pctx->greeted &&
+		g_get_monotonic_time() < pctx->accept_time + HELLO_GRACE_USEC;
+}
+
+/* take over resp, return -1 when the client has to go */
+static int _backlog_add(tcp_client_context *pctx, HSB_RESP_T *resp)
+{
+	HSB_RESP_T *old;
+
+	/* the connect snapshot waits for HELLO outside the backlog */
+	if (HSB_RESP_TYPE_SNAPSHOT == resp->type && _client_held(pctx)) {
+		if (!pctx->snapshot_due) {
+			pctx->snapshot_due = pctx->accept_time + HELLO_GRACE_USEC;
+			client_pool.deferred++;
+		}
+		_free_notify(resp);
+		return 0;
+	}
+
+	/* broadcasts come in seq order, past the resume point stop checking */
+	if (pctx->seen_seq && resp->seq) {
+		if (resp->seq <= pctx->seen_seq) {
+			_free_notify(resp);
+			return 0;
+		}
+
+		pctx->seen_seq = 0;
+	}
+
+	if (_can_coalesce(resp)) {
+		old = g_hash_table_lookup(pctx->coalesce,
+				GUINT_TO_POINTER(resp->u.status.devid));
+		if (old) {
+			_coalesce_status(old, resp);
+			_free_notify(resp);
+
+			/* it took the newer seq, move it back to stay in seq order */
+			g_queue_remove(&pctx->backlog, old);
+			g_queue_push_tail(&pctx->backlog, old);
+
+			pctx->coalesced++;
+			net_stats.coalesced++;
+			return 0;
+		}
+	}
+
+	if (_must_deliver(resp)) {
+		if (pctx->backlog.length >= CLIENT_BACKLOG_HARD) {
+			_free_notify(resp);
+			return -1;
+		}
+	} else if (pctx->backlog.length >= CLIENT_BACKLOG_MAX) {
+		_free_notify(resp);
+		pctx->dropped++;
+		net_stats.dropped++;
+
+		return (++pctx->drop_run > CLIENT_DROP_MAX) ? -1 : 0;
+	}
+
+	/* alarms go out before anything queued with them */
+	if (resp->rx_time)
+		g_queue_push_nth(&pctx->backlog, resp, pctx->backlog_alarms++);
+	else
+		g_queue_push_tail(&pctx->backlog, resp);
+
+	if (_can_coalesce(resp))
+		g_hash_table_insert(pctx->coalesce,
+				GUINT_TO_POINTER(resp->u.status.devid), resp);
+
+	return 0;
+}
+
+static HSB_RESP_T *_backlog_pop(tcp_client_context *pctx)
+{
+	HSB_RESP_T *resp = g_queue_pop_head(&pctx->backlog);
+	gpointer key;
+
+	if (!resp)
+		return NULL;
+
+	if (pctx->backlog_alarms)
+		pctx->backlog_alarms--;
+
+	if (_can_coalesce(resp)) {
+		key = GUINT_TO_POINTER(resp->u.status.devid);
+		if (g_hash_table_lookup(pctx->coalesce, key) == resp)
+			g_hash_table_remove(pctx->coalesce, key);
+	}
+
+	return resp;
+}
+
+/* drop held broadcasts up to seq, the client already has them */
+static void _backlog_drop_seen(tcp_client_context *pctx, uint32_t seq)
+{
+	HSB_RESP_T *resp;
+	GList *node, *next;
+	gpointer key;
+	int pos = 0;
+
+	for (node = pctx->backlog.head; node; node = next, pos++) {
+		next = node->next;
+		resp = (HSB_RESP_T *)node->data;
+
+		if (!resp->seq || resp->seq > seq)
+			continue;
+
+		if (pos < pctx->backlog_alarms) {
+			pctx->backlog_alarms--;
+			pos--;
+		}
 
-			int tmp, nwrite = 0;
-			while (nwrite < nread) {
-				deal_tcp_packet(sockfd, msg + nwrite, nread - nwrite, pctx, &tmp);
+		if (_can_coalesce(resp)) {
+			key = GUINT_TO_POINTER(resp->u.status.devid);
+			if (g_hash_table_lookup(pctx->coalesce, key) == resp)
+				g_hash_table_remove(pctx->coalesce, key);
+		}
+
+		g_queue_delete_link(&pctx->backlog, node);
+		_free_notify(resp);
+	}
+}
 
-				nwrite += tmp;
+/* serialize the backlog in chunks until it is empty or the socket is full */
+static int _drain_backlog(tcp_client_context *pctx)
+{
+	HSB_RESP_T *sent, *resp, *next;
+	int ret = 0;
+
+	if (_client_held(pctx))
+		return 0;
+
+	while (ret >= 0 && !pctx->want_out && pctx->backlog.length) {
+		sent = NULL;
+
+		while (ret >= 0 && pctx->backlog.length &&
+		       pctx->otail - pctx->ohead < CLIENT_DRAIN_HIGH) {
+			resp = _backlog_pop(pctx);
+			ret = _queue_notify(pctx, resp);
+			resp->next = sent;
+			sent = resp;
+		}
+
+		if (ret >= 0)
+			ret = _client_flush(pctx);
+
+		for (resp = sent; resp; resp = next) {
+			next = resp->next;
+			if (ret >= 0 && resp->rx_time)
+				alarm_sent(resp);
+			_free_notify(resp);
+		}
+	}
+
+	if (!pctx->backlog.length)
+		pctx->drop_run = 0;
+
+	return ret;
+}
+
+/* move every pending notification to the backlog, then send what fits */
+static int _process_notify(tcp_client_context *pctx)
+{
+	HSB_RESP_T *resp, *next;
+	int ret = 0;
+
+	/* clear first, a push from now on rings again */
+	g_atomic_int_set(&pctx->signaled, 0);
+
+	for (resp = _take_notify(pctx); resp; resp = next) {
+		next = resp->next;
+
+		if (resp->reply) {
+			/* pushed for the last connection on this slot */
+			if (resp->reply_gen != pctx->gen) {
+				_free_notify(resp);
+				continue;
 			}
+
+			/* a directed response ends one async command */
+			if (pctx->inflight > 0)
+				pctx->inflight--;
+		}
+
+		if (ret >= 0)
+			ret = _backlog_add(pctx, resp);
+		else
+			_free_notify(resp);
+	}
+
+	if (ret < 0) {
+		hsb_debug("client too slow, closing\n");
+		net_stats.slow_closed++;
+		return ret;
+	}
+
+	return _drain_backlog(pctx);
+}
+
+/*
+ * Frames are parsed in place from the receive buffer, only a trailing
+ * partial frame is moved to the front before the next read.
+ */
+static void _deal_client_frame(tcp_client_context *pctx, uint8_t *buf, int len)
+{
+	uint8_t *reply_buf;
+	uint32_t req_id = 0;
+	uint16_t cmd = GET_CMD_FIELD(buf, 0, uint16_t);
+	int used = 0;
+
+	/* take the request id off so the handlers see the plain frame */
+	if ((pctx->features & HSB_FEATURE_REQ_ID) && len >= 8) {
+		len -= 4;
+		req_id = GET_CMD_FIELD(buf, len, uint32_t);
+		SET_CMD_FIELD(buf, 2, uint16_t, len);
+	}
+
+	set_act_req(req_id, pctx->gen);
+
+	if (_cmd_is_async(cmd) && pctx->inflight >= CLIENT_MAX_INFLIGHT) {
+		net_stats.busy++;
+		reply_buf = _reply_room(pctx);
+		if (reply_buf)
+			_reply_commit(pctx, _reply_result(reply_buf, HSB_E_BUSY, 0, cmd));
+	} else if (deal_tcp_packet(pctx->tcp_sockfd, buf, len, pctx, &used) > 0) {
+		pctx->inflight++;
+	}
+
+	set_act_req(0, 0);
+}
+
+static int _process_client_frames(tcp_client_context *pctx)
+{
+	int off = 0;
+	uint16_t cmdlen;
+
+	while (pctx->ilen - off >= 4) {
+		cmdlen = GET_CMD_FIELD(pctx->ibuf, off + 2, uint16_t);
+
+		/* no way to find the next frame once the length is bad */
+		if (cmdlen < 4 || cmdlen > CLIENT_IBUF_SIZE) {
+			hsb_debug("bad frame length %d\n", cmdlen);
+			net_stats.bad_frames++;
+			return -1;
+		}
+
+		if (pctx->ilen - off < cmdlen)
+			break;
+
+		_deal_client_frame(pctx, pctx->ibuf + off, cmdlen);
+		net_stats.frames++;
+		pctx->greeted = 1;
+
+		off += cmdlen;
+	}
+
+	if (off < pctx->ilen) {
+		if (off)
+			memmove(pctx->ibuf, pctx->ibuf + off, pctx->ilen - off);
+		net_stats.split_frames++;
+	}
+
+	pctx->ilen -= off;
+
+	return 0;
+}
+
+/* drain the socket, a negative return closes the client */
+static int _process_client_read(tcp_client_context *pctx)
+{
+	int nread;
+
+	while (1) {
+		nread = read(pctx->tcp_sockfd, pctx->ibuf + pctx->ilen,
+				CLIENT_IBUF_SIZE - pctx->ilen);
+		if (nread == 0)
+			return -1;
+
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
 		}
 
-		if (FD_ISSET(unfd, &readset)) {
-			nread = recvfrom(unfd, msg, sizeof(msg), 0, NULL, NULL);
-			//hsb_debug("get notify\n");
+		pctx->ilen += nread;
+		pctx->last_rx = g_get_monotonic_time();
+
+		if (_process_client_frames(pctx))
+			return -1;
+	}
+}
+
+static int _process_client_notify(tcp_client_context *pctx)
+{
+	uint64_t val;
+
+	read(pctx->efd, &val, sizeof(val));
+
+	return _process_notify(pctx);
+}
+
+/* send held connect snapshots, return ms until the next one is due */
+static int _send_deferred_snapshots(void)
+{
+	tcp_client_context *pctx;
+	gint64 now = g_get_monotonic_time();
+	gint64 next = G_MAXINT64;
+	int cnt, ret;
 
-			_process_notify(sockfd, pctx);
+	for (cnt = 0; cnt < client_pool.num && client_pool.deferred; cnt++) {
+		pctx = &client_pool.context[cnt];
+		if (!pctx->using || !pctx->snapshot_due)
+			continue;
+
+		if (!pctx->greeted && now < pctx->snapshot_due) {
+			if (pctx->snapshot_due < next)
+				next = pctx->snapshot_due;
+			continue;
+		}
+
+		pctx->snapshot_due = 0;
+		client_pool.deferred--;
+
+		/* broadcasts held for HELLO are older than the snapshot */
+		ret = _drain_backlog(pctx);
+		if (ret >= 0)
+			ret = _queue_snapshot(pctx);
+		if (ret >= 0)
+			ret = _client_flush(pctx);
+
+		if (ret < 0) {
+			put_client_context(pctx);
+			hsb_debug("put a client\n");
 		}
 	}
 
-	close(sockfd);
+	if (next == G_MAXINT64)
+		return -1;
 
+	return (int)((next - now + 999) / 1000);
+}
+
+static void _reap_client(tcp_client_context *pctx, const char *why)
+{
+	hsb_debug("reap client %d: %s\n", pctx->tcp_sockfd, why);
+	net_stats.reaped++;
 	put_client_context(pctx);
-	hsb_debug("put a client\n");
 }
 
-#define NOTIFY_MESSAGE	"notify"
+/* close dead clients, ping the quiet ones that asked for heartbeats */
+static void _sweep_clients(gint64 now)
+{
+	HSB_MSG_HEARTBEAT_T ping = { .type = HSB_HEARTBEAT_PING };
+	tcp_client_context *pctx;
+	uint8_t *ptr;
+	int cnt, ret;
+
+	for (cnt = 0; cnt < client_pool.num; cnt++) {
+		pctx = &client_pool.context[cnt];
+		if (!pctx->using)
+			continue;
+
+		if (pctx->want_out && now - pctx->last_tx > CLIENT_STALL_USEC) {
+			_reap_client(pctx, "output stalled");
+			continue;
+		}
+
+		if (!(pctx->features & HSB_FEATURE_HEARTBEAT))
+			continue;
+
+		if (now - pctx->last_rx > CLIENT_REAP_USEC) {
+			_reap_client(pctx, "heartbeat lost");
+			continue;
+		}
+
+		if (now - pctx->last_rx < CLIENT_PING_USEC ||
+		    now - pctx->last_ping < CLIENT_PING_USEC)
+			continue;
+
+		ping.stamp = (uint32_t)(now / 1000);
+
+		pctx->last_ping = now;
+		net_stats.pings++;
+
+		ret = -1;
+		ptr = _reply_room(pctx);
+		if (ptr) {
+			_reply_commit(pctx,
+				hsb_msg_heartbeat_encode(ptr, HSB_CMD_HEARTBEAT, &ping));
+			ret = _client_flush(pctx);
+		}
+		if (ret < 0)
+			_reap_client(pctx, "ping failed");
+	}
+}
+
+static void *tcp_reactor_thread(void *arg)
+{
+	struct epoll_event events[EP_MAX_EVENTS];
+	tcp_client_context *pctx;
+	int cnt, nfds, idx, ret;
+	int timeout = -1;
+	gint64 now, next_sweep = 0;
+
+	signal(SIGPIPE, SIG_IGN);
+
+	while (1) {
+		nfds = epoll_wait(client_pool.epfd, events, EP_MAX_EVENTS, timeout);
+		if (nfds < 0) {
+			if (errno == EINTR)
+				continue;
+
+			hsb_critical("epoll wait error\n");
+			break;
+		}
+
+		for (cnt = 0; cnt < nfds; cnt++) {
+			idx = EP_IDX(events[cnt].data.u64);
+			if (idx >= client_pool.num)
+				continue;
+
+			pctx = &client_pool.context[idx];
+			if (!pctx->using)
+				continue;
+
+			if (EP_IS_NOTIFY(events[cnt].data.u64))
+				ret = _process_client_notify(pctx);
+			else if (events[cnt].events & (EPOLLERR | EPOLLHUP))
+				ret = -1;
+			else if (events[cnt].events & EPOLLIN)
+				ret = _process_client_read(pctx);
+			else
+				ret = 0;
+
+			/* replies of the read and a writable socket both flush */
+			if (ret >= 0)
+				ret = _client_flush(pctx);
+
+			/* the socket took everything, feed it what was held back */
+			if (ret >= 0 && pctx->backlog.length)
+				ret = _drain_backlog(pctx);
+
+			if (ret < 0) {
+				put_client_context(pctx);
+				hsb_debug("put a client\n");
+			}
+		}
+
+		now = g_get_monotonic_time();
+		if (now >= next_sweep) {
+			_sweep_clients(now);
+			next_sweep = now + CLIENT_SWEEP_USEC;
+		}
+
+		timeout = (int)((next_sweep - now + 999) / 1000);
+
+		if (client_pool.deferred) {
+			ret = _send_deferred_snapshots();
+			if (ret >= 0 && ret < timeout)
+				timeout = ret;
+		}
+	}
+
+	return NULL;
+}
 
 int notify_resp(HSB_RESP_T *msg, void *data)
 {
-	int cnt, fd;
-	HSB_RESP_T *notify = NULL;
+	int cnt;
+	HSB_RESP_T *notify = NULL, *slot;
 	tcp_client_context *pctx = NULL;
 
 	if (msg->reply)
@@ -1266,67 +2742,316 @@ int notify_resp(HSB_RESP_T *msg, void *data)
 		pctx = (tcp_client_context *)data;
 
 	if (pctx) {
-		if (!pctx->using)
+		/* the client went away, maybe the slot serves another one now */
+		if (!pctx->using || (msg->reply && msg->reply_gen != pctx->gen)) {
+			if (HSB_RESP_TYPE_STATUS_BATCH == msg->type)
+				free_status_batch(msg->u.batch);
 			return HSB_E_OK;
+		}
 
-		notify = g_slice_dup(HSB_RESP_T, msg);
+		notify = obj_pool_dup(resp_pool, msg);
 		if (!notify) {
 			hsb_debug("no memory\n");
+			if (HSB_RESP_TYPE_STATUS_BATCH == msg->type)
+				free_status_batch(msg->u.batch);
 			return HSB_E_NO_MEMORY;
 		}
 
-		g_mutex_lock(&pctx->mutex);
+		_push_notify(pctx, notify);
 
-		g_queue_push_tail(&pctx->queue, notify);
+		return HSB_E_OK;
+	}
 
-		g_mutex_unlock(&pctx->mutex);
+	/* a batch has exactly one owner, never broadcast it */
+	if (HSB_RESP_TYPE_STATUS_BATCH == msg->type) {
+		free_status_batch(msg->u.batch);
+		return HSB_E_BAD_PARAM;
+	}
 
-		fd = unix_socket_new();
-		unix_socket_send_to(fd, pctx->listen_path, NOTIFY_MESSAGE, strlen(NOTIFY_MESSAGE));
-		unix_socket_free(fd);
+	/* seq order and queue order must agree, so push under the ring lock */
+	g_mutex_lock(&event_ring.mutex);
 
-		return HSB_E_OK;
-	}
+	if (0 == ++event_ring.seq)
+		event_ring.seq = 1;
 
+	slot = &event_ring.ring[event_ring.seq % EVENT_RING_SIZE];
+	memcpy(slot, msg, sizeof(*slot));
+	slot->seq = event_ring.seq;
+	slot->next = NULL;
 
-	for (cnt = 0; cnt < MAX_TCP_CLIENT_NUM; cnt++) {
+	for (cnt = 0; cnt < client_pool.num; cnt++) {
 		pctx = &client_pool.context[cnt];
 		if (!pctx->using)
 			continue;
 
-		if (msg->reply && msg->reply != (void *)pctx)
+		if (!_filter_match(pctx->filter, slot)) {
+			event_ring.filtered++;
 			continue;
+		}
 
-		notify = g_slice_dup(HSB_RESP_T, msg);
+		notify = obj_pool_dup(resp_pool, slot);
 		if (!notify) {
 			hsb_debug("no memory\n");
 			continue;
 		}
 
-		g_mutex_lock(&pctx->mutex);
+		_push_notify(pctx, notify);
+		event_ring.delivered++;
+	}
+
+	/* a replayed alarm is not a new alarm */
+	slot->rx_time = 0;
 
-		g_queue_push_tail(&pctx->queue, notify);
+	g_mutex_unlock(&event_ring.mutex);
 
-		g_mutex_unlock(&pctx->mutex);
+	return HSB_E_OK;
+}
 
-		fd = unix_socket_new();
-		unix_socket_send_to(fd, pctx->listen_path, NOTIFY_MESSAGE, strlen(NOTIFY_MESSAGE));
-		unix_socket_free(fd);
+/*
+ * Queue every broadcast after last that came before the client attached,
+ * or return -1 when the ring no longer holds all of them. The later ones
+ * are already held in its backlog, the replay goes in front of them.
+ * Reactor only, the backlog is its own.
+ */
+static int _replay_events(tcp_client_context *pctx, uint32_t last)
+{
+	HSB_RESP_T *notify;
+	uint32_t seq;
+	int cnt = 0;
+
+	g_mutex_lock(&event_ring.mutex);
+
+	if (last > event_ring.seq || event_ring.seq - last > EVENT_RING_SIZE) {
+		g_mutex_unlock(&event_ring.mutex);
+		return -1;
 	}
 
-	return HSB_E_OK;
+	/* held copies the client saw on its old connection */
+	_backlog_drop_seen(pctx, last);
+	pctx->seen_seq = last;
+
+	for (seq = last + 1; seq <= pctx->attach_seq && seq; seq++) {
+		if (!_filter_match(pctx->filter, &event_ring.ring[seq % EVENT_RING_SIZE]))
+			continue;
+
+		notify = obj_pool_dup(resp_pool, &event_ring.ring[seq % EVENT_RING_SIZE]);
+		if (!notify) {
+			hsb_debug("no memory\n");
+			break;
+		}
+
+		/* behind the held alarms, ahead of every held broadcast */
+		g_queue_push_nth(&pctx->backlog, notify, pctx->backlog_alarms + cnt);
+		cnt++;
+	}
+
+	net_stats.replayed += cnt;
+
+	g_mutex_unlock(&event_ring.mutex);
+
+	return cnt;
+}
+
+/*
+ * SUBSCRIBE: [hdr][evt mask][status mask][dev num][rsv][dev num * devid]
+ * No devices means every device, all masks set means no filter at all.
+ */
+static int _client_subscribe(void *reply, uint8_t *buf, int len, uint8_t *rbuf)
+{
+	tcp_client_context *pctx = (tcp_client_context *)reply;
+	HSB_MSG_SUBSCRIBE_T msg;
+	client_filter *filter;
+	uint32_t evt_mask, status_mask, devid, max_id = 0;
+	int num, id, words = 0;
+
+	if (hsb_msg_subscribe_decode(buf, len, &msg))
+		return _reply_result(rbuf, HSB_E_BAD_PARAM, 0, HSB_CMD_SUBSCRIBE);
+
+	evt_mask = msg.evt_mask;
+	status_mask = msg.status_mask;
+	num = msg.num;
+
+	if (num > SUB_MAX_DEVS || len < HSB_MSG_SUBSCRIBE_LEN + 4 * num)
+		return _reply_result(rbuf, HSB_E_BAD_PARAM, 0, HSB_CMD_SUBSCRIBE);
+
+	for (id = 0; id < num; id++) {
+		devid = GET_CMD_FIELD(buf, HSB_MSG_SUBSCRIBE_LEN + 4 * id, uint32_t);
+		if (devid > SUB_MAX_DEVID)
+			return _reply_result(rbuf, HSB_E_BAD_PARAM, devid, HSB_CMD_SUBSCRIBE);
+		if (devid > max_id)
+			max_id = devid;
+	}
+
+	if (!num && 0xFFFFFFFF == evt_mask && 0xFFFFFFFF == status_mask) {
+		_set_filter(pctx, NULL);
+		return _reply_result(rbuf, HSB_E_OK, 0, HSB_CMD_SUBSCRIBE);
+	}
+
+	if (num)
+		words = max_id / 32 + 1;
+
+	filter = g_malloc0(sizeof(*filter) + words * sizeof(uint32_t));
+	filter->evt_mask = evt_mask;
+	filter->status_mask = status_mask;
+	filter->dev_words = words;
+
+	for (id = 0; id < num; id++) {
+		devid = GET_CMD_FIELD(buf, HSB_MSG_SUBSCRIBE_LEN + 4 * id, uint32_t);
+		filter->dev_bits[devid / 32] |= 1u << (devid % 32);
+	}
+
+	_set_filter(pctx, filter);
+
+	return _reply_result(rbuf, HSB_E_OK, 0, HSB_CMD_SUBSCRIBE);
 }
 
-int init_network_module(void)
+/*
+ * HELLO: [hdr][features][epoch][last seq]
+ * HELLO_RESP: [hdr][features][epoch][seq][mode][rsv]
+ * A client that still has state from the same epoch gets the events it
+ * missed, anyone else a fresh snapshot. Resuming only works within
+ * HELLO_GRACE_USEC of the connect and before any other frame: after that
+ * broadcasts newer than the missed ones have gone out already, so a late
+ * HELLO always gets HSB_HELLO_SNAPSHOT.
+ */
+static int _client_hello(void *reply, uint8_t *buf, int len, uint8_t *rbuf)
+{
+	tcp_client_context *pctx = (tcp_client_context *)reply;
+	HSB_MSG_HELLO_RESP_T msg = { 0 };
+	HSB_RESP_T *resp;
+	uint32_t epoch = 0, last = 0;
+	int mode = HSB_HELLO_SNAPSHOT;
+	bool held;
+
+	if (len < 8)
+		return _reply_result(rbuf, HSB_E_BAD_PARAM, 0, HSB_CMD_HELLO);
+
+	held = _client_held(pctx);
+
+	pctx->features = GET_CMD_FIELD(buf, 4, uint32_t) & HSB_FEATURE_ALL;
+	pctx->greeted = 1;
+
+	if (len >= 16) {
+		epoch = GET_CMD_FIELD(buf, 8, uint32_t);
+		last = GET_CMD_FIELD(buf, 12, uint32_t);
+	}
+
+	if (held && (pctx->features & HSB_FEATURE_SEQ) && last &&
+	    epoch == event_ring.epoch && _replay_events(pctx, last) >= 0)
+		mode = HSB_HELLO_DELTA;
+
+	if (HSB_HELLO_DELTA == mode) {
+		net_stats.resumed++;
+		if (pctx->snapshot_due) {
+			pctx->snapshot_due = 0;
+			client_pool.deferred--;
+		}
+	} else {
+		net_stats.resynced++;
+		/* a held connect snapshot goes out anyway, else ask for one */
+		if (!pctx->snapshot_due) {
+			resp = obj_pool_alloc0(resp_pool);
+			if (resp) {
+				resp->type = HSB_RESP_TYPE_SNAPSHOT;
+				_push_notify(pctx, resp);
+			}
+		}
+	}
+
+	/* where the stream stands, anything later follows with its seq */
+	msg.features = pctx->features;
+	msg.epoch = event_ring.epoch;
+	msg.seq = _event_seq();
+	msg.mode = mode;
+
+	return hsb_msg_hello_resp_encode(rbuf, HSB_CMD_HELLO_RESP, &msg);
+}
+
+int get_network_stats(char *buf, int len)
+{
+	tcp_client_context *pctx;
+	int off, cnt;
+
+	off = snprintf(buf, len, "net out: msgs %lu writes %lu partial %lu wait_out %lu overflow %lu\n",
+			net_stats.msgs, net_stats.writes, net_stats.partial,
+			net_stats.wait_out, net_stats.overflow);
+
+	if (off < len)
+		off += snprintf(buf + off, len - off, "net in: frames %lu split %lu bad %lu\n",
+			net_stats.frames, net_stats.split_frames, net_stats.bad_frames);
+
+	if (off < len)
+		off += snprintf(buf + off, len - off, "net hello: resumed %lu resynced %lu replayed %lu seq %u\n",
+			net_stats.resumed, net_stats.resynced, net_stats.replayed,
+			_event_seq());
+
+	if (off < len)
+		off += snprintf(buf + off, len - off, "net req: busy %lu\n", net_stats.busy);
+
+	g_mutex_lock(&event_ring.mutex);
+	if (off < len)
+		off += snprintf(buf + off, len - off, "net events: delivered %lu filtered %lu\n",
+			event_ring.delivered, event_ring.filtered);
+	g_mutex_unlock(&event_ring.mutex);
+
+	if (off < len)
+		off += snprintf(buf + off, len - off, "net slow: coalesced %lu dropped %lu closed %lu\n",
+			net_stats.coalesced, net_stats.dropped, net_stats.slow_closed);
+
+	if (off < len)
+		off += snprintf(buf + off, len - off, "net idle: pings %lu reaped %lu\n",
+			net_stats.pings, net_stats.reaped);
+
+	if (off < len)
+		off += snprintf(buf + off, len - off,
+			"net udp: rx %lu batches %lu invalid %lu deduped %lu replies %lu sends %lu errors %lu\n",
+			udp_stats.rx, udp_stats.batches, udp_stats.invalid,
+			udp_stats.deduped, udp_stats.replies, udp_stats.send_calls,
+			udp_stats.send_errors);
+
+	/* read without the reactor, good enough for a report */
+	for (cnt = 0; cnt < client_pool.num && off < len; cnt++) {
+		pctx = &client_pool.context[cnt];
+		if (!pctx->using)
+			continue;
+
+		off += snprintf(buf + off, len - off,
+			"client %d: mem %d out %d backlog %d inflight %d coalesced %lu dropped %lu\n",
+			cnt, pctx->osize + CLIENT_IBUF_SIZE +
+			(int)(pctx->backlog.length * sizeof(HSB_RESP_T)),
+			pctx->otail - pctx->ohead, pctx->backlog.length,
+			pctx->inflight, pctx->coalesced, pctx->dropped);
+	}
+
+	return (off < len) ? off : len - 1;
+}
+
+int init_network_module(int max_client)
 {
 	pthread_t thread_id;
+
+	if (max_client <= 0)
+		max_client = MAX_TCP_CLIENT_NUM;
+
+	resp_pool = obj_pool_new("notify", sizeof(HSB_RESP_T),
+				max_client * NOTIFY_POOL_PER_CLIENT);
+
+	event_ring.epoch = (uint32_t)(g_get_real_time() / G_USEC_PER_SEC);
+
 	if (pthread_create(&thread_id, NULL, (thread_entry_func)udp_listen_thread, NULL))
 	{
 		hsb_critical("create udp listen thread failed\n");
 		return -1;
 	}
 
-	init_client_pool();
+	if (init_client_pool(max_client))
+		return -3;
+
+	if (pthread_create(&thread_id, NULL, (thread_entry_func)tcp_reactor_thread, NULL))
+	{
+		hsb_critical("create tcp reactor thread failed\n");
+		return -2;
+	}
 
 	if (pthread_create(&thread_id, NULL, (thread_entry_func)tcp_listen_thread, NULL))
 	{
@@ -11,7 +11,8 @@
 
 int notify_resp(HSB_RESP_T *resp, void *data);
 
-int init_network_module(void);
+int init_network_module(int max_client);
+int get_network_stats(char *buf, int len);
 
 #endif
 
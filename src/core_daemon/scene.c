@@ -116,15 +116,18 @@ int enter_scene(char *name)
 
 static bool check_condition(HSB_SCENE_CONDITION_T *pcond)
 {
-	HSB_DEV_T *pdev = find_dev(pcond->devid);
+	HSB_DEV_T *pdev = get_dev(pcond->devid);
 	if (!pdev) {
 		hsb_debug("check condition: dev not found\n");
 		return false;
 	}
 
 	HSB_STATUS_T status = { 0 };
+	int ret = load_dev_status(pdev, &status);
 
-	if (HSB_E_OK != load_dev_status(pdev, &status))
+	put_dev(pdev);
+
+	if (HSB_E_OK != ret)
 	{
 		hsb_debug("check condition: load status fail\n");
 		return false;
@@ -0,0 +1,263 @@
+
+#include <glib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "timer_sched.h"
+#include "hsb_error.h"
+#include "hsb_config.h"
+#include "unix_socket.h"
+#include "debug.h"
+
+/*
+ * Binary min-heap of device timers and delays keyed on the next fire
+ * time. Entries are found by (devid, type, slot) through the hash table,
+ * so set and delete only touch the moved entry. The core main loop
+ * sleeps until the heap top is due; setting an earlier top wakes it up
+ * through its unix listen socket.
+ */
+
+#define SCHED_KEY(devid, type, id)	\
+	(((guint64)(devid) << 32) | ((guint64)(type) << 16) | (id))
+
+typedef struct {
+	gint64			key;
+	time_t			fire_tm;
+	guint			pos;	/* index in the heap */
+} HSB_SCHED_ENTRY_T;
+
+typedef struct {
+	GMutex			mutex;
+
+	HSB_SCHED_ENTRY_T	**heap;
+	guint			len;
+	guint			size;
+
+	GHashTable		*table;	/* key -> entry */
+
+	int			wake_fd;
+} HSB_SCHED_CB_T;
+
+static HSB_SCHED_CB_T gl_sched_cb = { 0 };
+
+#define HSB_SCHED_CB_LOCK()	do { \
+	g_mutex_lock(&gl_sched_cb.mutex); \
+} while (0)
+
+#define HSB_SCHED_CB_UNLOCK()	do { \
+	g_mutex_unlock(&gl_sched_cb.mutex); \
+} while (0)
+
+static void _heap_place(HSB_SCHED_ENTRY_T *entry, guint pos)
+{
+	gl_sched_cb.heap[pos] = entry;
+	entry->pos = pos;
+}
+
+static void _heap_up(guint pos)
+{
+	HSB_SCHED_ENTRY_T *entry = gl_sched_cb.heap[pos];
+	HSB_SCHED_ENTRY_T *parent;
+
+	while (pos > 0) {
+		parent = gl_sched_cb.heap[(pos - 1) / 2];
+		if (parent->fire_tm <= entry->fire_tm)
+			break;
+
+		_heap_place(parent, pos);
+		pos = (pos - 1) / 2;
+	}
+
+	_heap_place(entry, pos);
+}
+
+static void _heap_down(guint pos)
+{
+	HSB_SCHED_ENTRY_T *entry = gl_sched_cb.heap[pos];
+	HSB_SCHED_ENTRY_T *child;
+	guint next;
+
+	while ((next = pos * 2 + 1) < gl_sched_cb.len) {
+		if (next + 1 < gl_sched_cb.len &&
+		    gl_sched_cb.heap[next + 1]->fire_tm < gl_sched_cb.heap[next]->fire_tm)
+			next++;
+
+		child = gl_sched_cb.heap[next];
+		if (entry->fire_tm <= child->fire_tm)
+			break;
+
+		_heap_place(child, pos);
+		pos = next;
+	}
+
+	_heap_place(entry, pos);
+}
+
+static void _heap_remove(HSB_SCHED_ENTRY_T *entry)
+{
+	guint pos = entry->pos;
+	HSB_SCHED_ENTRY_T *last = gl_sched_cb.heap[--gl_sched_cb.len];
+
+	if (last == entry)
+		return;
+
+	_heap_place(last, pos);
+
+	if (pos > 0 && gl_sched_cb.heap[(pos - 1) / 2]->fire_tm > last->fire_tm)
+		_heap_up(pos);
+	else
+		_heap_down(pos);
+}
+
+static void _wake_main_loop(void)
+{
+	if (gl_sched_cb.wake_fd < 0)
+		return;
+
+	unix_socket_send_to(gl_sched_cb.wake_fd,
+			hsb_core_daemon_config.unix_listen_path, "timer", 5);
+}
+
+int init_timer_sched(void)
+{
+	g_mutex_init(&gl_sched_cb.mutex);
+
+	gl_sched_cb.size = 64;
+	gl_sched_cb.heap = g_new0(HSB_SCHED_ENTRY_T *, gl_sched_cb.size);
+	gl_sched_cb.table = g_hash_table_new(g_int64_hash, g_int64_equal);
+
+	gl_sched_cb.wake_fd = unix_socket_new();
+	if (gl_sched_cb.wake_fd < 0)
+		hsb_critical("timer wake socket fail\n");
+
+	return HSB_E_OK;
+}
+
+int timer_sched_set(uint32_t devid, HSB_SCHED_TYPE_T type, uint16_t id, time_t fire_tm)
+{
+	HSB_SCHED_ENTRY_T *entry;
+	gint64 key = SCHED_KEY(devid, type, id);
+	time_t top;
+	bool wake;
+
+	HSB_SCHED_CB_LOCK();
+
+	top = gl_sched_cb.len ? gl_sched_cb.heap[0]->fire_tm : 0;
+
+	entry = g_hash_table_lookup(gl_sched_cb.table, &key);
+	if (entry) {
+		time_t old = entry->fire_tm;
+
+		entry->fire_tm = fire_tm;
+		if (fire_tm < old)
+			_heap_up(entry->pos);
+		else
+			_heap_down(entry->pos);
+	} else {
+		if (gl_sched_cb.len == gl_sched_cb.size) {
+			gl_sched_cb.size *= 2;
+			gl_sched_cb.heap = g_renew(HSB_SCHED_ENTRY_T *,
+						gl_sched_cb.heap, gl_sched_cb.size);
+		}
+
+		entry = g_slice_new0(HSB_SCHED_ENTRY_T);
+		entry->key = key;
+		entry->fire_tm = fire_tm;
+
+		g_hash_table_insert(gl_sched_cb.table, &entry->key, entry);
+
+		_heap_place(entry, gl_sched_cb.len++);
+		_heap_up(entry->pos);
+	}
+
+	wake = (gl_sched_cb.heap[0] == entry && (0 == top || fire_tm < top));
+
+	HSB_SCHED_CB_UNLOCK();
+
+	if (wake)
+		_wake_main_loop();
+
+	return HSB_E_OK;
+}
+
+int timer_sched_del(uint32_t devid, HSB_SCHED_TYPE_T type, uint16_t id)
+{
+	HSB_SCHED_ENTRY_T *entry;
+	gint64 key = SCHED_KEY(devid, type, id);
+
+	HSB_SCHED_CB_LOCK();
+
+	entry = g_hash_table_lookup(gl_sched_cb.table, &key);
+	if (!entry) {
+		HSB_SCHED_CB_UNLOCK();
+		return HSB_E_ENTRY_NOT_FOUND;
+	}
+
+	g_hash_table_remove(gl_sched_cb.table, &key);
+	_heap_remove(entry);
+
+	HSB_SCHED_CB_UNLOCK();
+
+	g_slice_free(HSB_SCHED_ENTRY_T, entry);
+
+	return HSB_E_OK;
+}
+
+/* take one entry due at @now off the heap, the caller reschedules it */
+int timer_sched_pop(time_t now, uint32_t *devid, HSB_SCHED_TYPE_T *type, uint16_t *id, time_t *fire_tm)
+{
+	HSB_SCHED_ENTRY_T *entry;
+
+	HSB_SCHED_CB_LOCK();
+
+	if (0 == gl_sched_cb.len || gl_sched_cb.heap[0]->fire_tm > now) {
+		HSB_SCHED_CB_UNLOCK();
+		return HSB_E_ENTRY_NOT_FOUND;
+	}
+
+	entry = gl_sched_cb.heap[0];
+
+	g_hash_table_remove(gl_sched_cb.table, &entry->key);
+	_heap_remove(entry);
+
+	HSB_SCHED_CB_UNLOCK();
+
+	*devid = (uint32_t)(entry->key >> 32);
+	*type = (HSB_SCHED_TYPE_T)((entry->key >> 16) & 0xFFFF);
+	*id = (uint16_t)(entry->key & 0xFFFF);
+	*fire_tm = entry->fire_tm;
+
+	g_slice_free(HSB_SCHED_ENTRY_T, entry);
+
+	return HSB_E_OK;
+}
+
+/* how long the main loop may sleep before the next entry is due */
+void timer_sched_timeout(struct timeval *tv)
+{
+	struct timeval now;
+	time_t top = 0;
+
+	HSB_SCHED_CB_LOCK();
+	if (gl_sched_cb.len)
+		top = gl_sched_cb.heap[0]->fire_tm;
+	HSB_SCHED_CB_UNLOCK();
+
+	gettimeofday(&now, NULL);
+
+	if (0 == top || top - now.tv_sec > HSB_TIMER_MAX_IDLE_SEC) {
+		tv->tv_sec = HSB_TIMER_MAX_IDLE_SEC;
+		tv->tv_usec = 0;
+	} else if (top <= now.tv_sec) {
+		tv->tv_sec = 0;
+		tv->tv_usec = 0;
+	} else {
+		tv->tv_sec = top - now.tv_sec;
+		tv->tv_usec = 0;
+
+		if (now.tv_usec) {
+			tv->tv_sec--;
+			tv->tv_usec = 1000000 - now.tv_usec;
+		}
+	}
+}
@@ -0,0 +1,26 @@
+#ifndef _TIMER_SCHED_H_
+#define _TIMER_SCHED_H_
+
+#include <glib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+/* a fire missed by at most this many seconds still runs, once */
+#define HSB_TIMER_CATCHUP_SEC		(60)
+
+/* longest main loop sleep with nothing scheduled */
+#define HSB_TIMER_MAX_IDLE_SEC		(600)
+
+typedef enum {
+	HSB_SCHED_TYPE_TIMER = 0,
+	HSB_SCHED_TYPE_DELAY,
+} HSB_SCHED_TYPE_T;
+
+int init_timer_sched(void);
+int timer_sched_set(uint32_t devid, HSB_SCHED_TYPE_T type, uint16_t id, time_t fire_tm);
+int timer_sched_del(uint32_t devid, HSB_SCHED_TYPE_T type, uint16_t id);
+int timer_sched_pop(time_t now, uint32_t *devid, HSB_SCHED_TYPE_T *type, uint16_t *id, time_t *fire_tm);
+void timer_sched_timeout(struct timeval *tv);
+
+#endif /* _TIMER_SCHED_H_ */
@@ -20,7 +20,8 @@
 
 #define ETH_INTERFACE	"br-lan"
 
-#define MAX_TCP_CLIENT_NUM	(10)
+/* default, the core daemon takes -c <num> */
+#define MAX_TCP_CLIENT_NUM	(64)
 
 #define MAXLINE 1024UL
 #define MAXPATH 256UL
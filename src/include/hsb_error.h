@@ -12,7 +12,7 @@ typedef enum {
 	HSB_E_ENTRY_NOT_FOUND,
 	HSB_E_ACT_FAILED,
 	HSB_E_OTHERS,
-	HSB_E_UNDEFINED_8,
+	HSB_E_BUSY,
 	HSB_E_UNDEFINED_9,
 	HSB_E_UNDEFINED_10,
 	HSB_E_UNDEFINED_11,
@@ -0,0 +1,285 @@
+#ifndef _NET_CODEC_H_
+#define _NET_CODEC_H_
+
+#include <stdint.h>
+#include <string.h>
+#include "network_utils.h"
+#include "net_protocol.h"
+#include "hsb_config.h"
+
+/*
+ * Fixed message layouts, declared once as (field, offset, width). Each
+ * HSB_MSG_DEFINE() below expands a layout into a wire struct and three
+ * inline helpers:
+ *   hsb_msg_<name>_put(buf, m)		fields only, no header
+ *   hsb_msg_<name>_encode(buf, cmd, m)	header and fields, returns the length,
+ *					not for records without a header
+ *   hsb_msg_<name>_decode(buf, len, m)	0, or -1 if the frame is too short
+ *
+ * F(type, field, offset) is a scalar, B(field, offset, size) a byte array.
+ * Offsets count from the start of the frame, after the [cmd][len] header,
+ * except for records that are embedded in a bigger frame.
+ */
+
+#define HSB_MSG_NAME_LEN	(16)
+
+/* RESULT: [hdr][devid][cmd][errcode] */
+#define HSB_MSG_RESULT_LEN	(12)
+#define HSB_MSG_RESULT(F, B) \
+	F(uint32_t, devid, 4) \
+	F(uint16_t, cmd, 8) \
+	F(uint16_t, ret, 10)
+
+/* EVENT: [hdr][devid][id][param1][param2] */
+#define HSB_MSG_EVENT_LEN	(16)
+#define HSB_MSG_EVENT(F, B) \
+	F(uint32_t, devid, 4) \
+	F(uint16_t, id, 8) \
+	F(uint16_t, param1, 10) \
+	F(uint32_t, param2, 12)
+
+/* DO_ACTION: [hdr][devid][id][param1][param2] */
+#define HSB_MSG_ACTION_LEN	(16)
+#define HSB_MSG_ACTION(F, B) \
+	F(uint32_t, devid, 4) \
+	F(uint16_t, id, 8) \
+	F(uint16_t, param1, 10) \
+	F(uint32_t, param2, 12)
+
+/* HEARTBEAT: [hdr][type][rsv][stamp] */
+#define HSB_MSG_HEARTBEAT_LEN	(12)
+#define HSB_MSG_HEARTBEAT(F, B) \
+	F(uint16_t, type, 4) \
+	F(uint16_t, rsv, 6) \
+	F(uint32_t, stamp, 8)
+
+/* HELLO_RESP: [hdr][features][epoch][seq][mode][rsv] */
+#define HSB_MSG_HELLO_RESP_LEN	(20)
+#define HSB_MSG_HELLO_RESP(F, B) \
+	F(uint32_t, features, 4) \
+	F(uint32_t, epoch, 8) \
+	F(uint32_t, seq, 12) \
+	F(uint16_t, mode, 16) \
+	F(uint16_t, rsv, 18)
+
+/* SUBSCRIBE head, the device ids follow */
+#define HSB_MSG_SUBSCRIBE_LEN	(16)
+#define HSB_MSG_SUBSCRIBE(F, B) \
+	F(uint32_t, evt_mask, 4) \
+	F(uint32_t, status_mask, 8) \
+	F(uint16_t, num, 12) \
+	F(uint16_t, rsv, 14)
+
+/* any request that names a device only */
+#define HSB_MSG_DEV_LEN		(8)
+#define HSB_MSG_DEV(F, B) \
+	F(uint32_t, devid, 4)
+
+/* a timer, delay or linkage of a device */
+#define HSB_MSG_DEV_ITEM_LEN	(10)
+#define HSB_MSG_DEV_ITEM(F, B) \
+	F(uint32_t, devid, 4) \
+	F(uint16_t, id, 8)
+
+/*
+ * GET_INFO_RESP. dev_type is put as a u32 at 16 and the mac at 18 then
+ * overwrites bytes 18-19 of it, as the reply has always been built: the
+ * low half of dev_type is sent on little endian boxes, the high half on
+ * big endian ones. The mac must stay after dev_type in the list.
+ */
+#define HSB_MSG_DEV_INFO_LEN	(26)
+#define HSB_MSG_DEV_INFO(F, B) \
+	F(uint32_t, devid, 4) \
+	F(uint32_t, drvid, 8) \
+	F(uint16_t, cls, 12) \
+	F(uint16_t, interface, 14) \
+	F(uint32_t, dev_type, 16) \
+	B(mac, 18, 8)
+
+/* SET_CONFIG and GET_CONFIG_RESP */
+#define HSB_MSG_DEV_CONFIG_LEN	(8 + 2 * HSB_MSG_NAME_LEN)
+#define HSB_MSG_DEV_CONFIG(F, B) \
+	F(uint32_t, devid, 4) \
+	B(name, 8, HSB_MSG_NAME_LEN) \
+	B(location, 8 + HSB_MSG_NAME_LEN, HSB_MSG_NAME_LEN)
+
+/* ADD_DEV: [hdr][drvid][dev_type][name][location] */
+#define HSB_MSG_ADD_DEV_LEN	(8 + 2 * HSB_MSG_NAME_LEN)
+#define HSB_MSG_ADD_DEV(F, B) \
+	F(uint16_t, drvid, 4) \
+	F(uint16_t, dev_type, 6) \
+	B(name, 8, HSB_MSG_NAME_LEN) \
+	B(location, 8 + HSB_MSG_NAME_LEN, HSB_MSG_NAME_LEN)
+
+/* PROBE_DEV: [hdr][drvid] */
+#define HSB_MSG_PROBE_LEN	(6)
+#define HSB_MSG_PROBE(F, B) \
+	F(uint16_t, drvid, 4)
+
+/* SET_CHANNEL and GET_CHANNEL_RESP, DEL/SWITCH_CHANNEL stop at the name */
+#define HSB_MSG_CHANNEL_LEN	(12 + HSB_CHANNEL_MAX_NAME_LEN)
+#define HSB_MSG_CHANNEL(F, B) \
+	F(uint32_t, devid, 4) \
+	B(name, 8, HSB_CHANNEL_MAX_NAME_LEN) \
+	F(uint32_t, cid, 8 + HSB_CHANNEL_MAX_NAME_LEN)
+
+#define HSB_MSG_CHANNEL_NAME_LEN	(8 + HSB_CHANNEL_MAX_NAME_LEN)
+#define HSB_MSG_CHANNEL_NAME(F, B) \
+	F(uint32_t, devid, 4) \
+	B(name, 8, HSB_CHANNEL_MAX_NAME_LEN)
+
+/* DEL_SCENE and ENTER_SCENE */
+#define HSB_MSG_SCENE_NAME_LEN	(4 + HSB_SCENE_MAX_NAME_LEN)
+#define HSB_MSG_SCENE_NAME(F, B) \
+	B(name, 4, HSB_SCENE_MAX_NAME_LEN)
+
+/* SET_TIMER and GET_TIMER_RESP, year is 0 or the full year, mon 1-12 */
+#define HSB_MSG_TIMER_LEN	(28)
+#define HSB_MSG_TIMER(F, B) \
+	F(uint32_t, devid, 4) \
+	F(uint16_t, id, 8) \
+	F(uint8_t, work_mode, 10) \
+	F(uint8_t, flag, 11) \
+	F(uint8_t, hour, 12) \
+	F(uint8_t, min, 13) \
+	F(uint8_t, sec, 14) \
+	F(uint8_t, wday, 15) \
+	F(uint16_t, year, 16) \
+	F(uint8_t, mon, 18) \
+	F(uint8_t, mday, 19) \
+	F(uint16_t, act_id, 20) \
+	F(uint16_t, act_param1, 22) \
+	F(uint32_t, act_param2, 24)
+
+/* SET_DELAY and GET_DELAY_RESP */
+#define HSB_MSG_DELAY_LEN	(32)
+#define HSB_MSG_DELAY(F, B) \
+	F(uint32_t, devid, 4) \
+	F(uint16_t, id, 8) \
+	F(uint8_t, work_mode, 10) \
+	F(uint8_t, flag, 11) \
+	F(uint16_t, evt_id, 12) \
+	F(uint16_t, evt_param1, 14) \
+	F(uint32_t, evt_param2, 16) \
+	F(uint16_t, act_id, 20) \
+	F(uint16_t, act_param1, 22) \
+	F(uint32_t, act_param2, 24) \
+	F(uint32_t, delay_sec, 28)
+
+/* SET_LINKAGE and GET_LINKAGE_RESP */
+#define HSB_MSG_LINKAGE_LEN	(32)
+#define HSB_MSG_LINKAGE(F, B) \
+	F(uint32_t, devid, 4) \
+	F(uint16_t, id, 8) \
+	F(uint8_t, work_mode, 10) \
+	F(uint8_t, flag, 11) \
+	F(uint16_t, evt_id, 12) \
+	F(uint16_t, evt_param1, 14) \
+	F(uint32_t, evt_param2, 16) \
+	F(uint32_t, act_devid, 20) \
+	F(uint16_t, act_id, 24) \
+	F(uint16_t, act_param1, 26) \
+	F(uint32_t, act_param2, 28)
+
+/* DEV_ONLINE head, n * (id, val) follow at 60 */
+#define HSB_MSG_DEV_ONLINE_LEN	(60)
+#define HSB_MSG_DEV_ONLINE(F, B) \
+	F(uint32_t, devid, 4) \
+	F(uint32_t, drvid, 8) \
+	F(uint16_t, cls, 12) \
+	F(uint16_t, interface, 14) \
+	F(uint32_t, dev_type, 16) \
+	B(mac, 20, 8) \
+	B(name, 28, HSB_MSG_NAME_LEN) \
+	B(location, 44, HSB_MSG_NAME_LEN)
+
+/* device record in a page or snapshot, no header, n * (id, val) follow */
+#define HSB_MSG_DEV_RECORD_LEN	(60)
+#define HSB_MSG_DEV_RECORD(F, B) \
+	F(uint32_t, devid, 0) \
+	F(uint32_t, drvid, 4) \
+	F(uint16_t, cls, 8) \
+	F(uint16_t, interface, 10) \
+	F(uint32_t, dev_type, 12) \
+	B(mac, 16, 8) \
+	F(uint8_t, state, 24) \
+	F(uint8_t, num, 25) \
+	F(uint16_t, rsv, 26) \
+	B(name, 28, HSB_MSG_NAME_LEN) \
+	B(location, 44, HSB_MSG_NAME_LEN)
+
+/* generators, a field outside its layout fails to compile */
+#define _HSB_MSG_CHECK(_off, _size) \
+	(void)sizeof(char[((_off) + (_size) <= _msg_len) ? 1 : -1]);
+
+#define _HSB_MSG_FIELD(_type, _field, _off)	_type _field;
+#define _HSB_MSG_BYTES(_field, _off, _size)	uint8_t _field[_size];
+
+#define _HSB_MSG_PUT(_type, _field, _off) \
+	_HSB_MSG_CHECK(_off, sizeof(_type)) \
+	SET_CMD_FIELD(buf, _off, _type, m->_field);
+#define _HSB_MSG_PUT_BYTES(_field, _off, _size) \
+	_HSB_MSG_CHECK(_off, _size) \
+	memcpy(buf + (_off), m->_field, _size);
+
+#define _HSB_MSG_GET(_type, _field, _off) \
+	m->_field = GET_CMD_FIELD(buf, _off, _type);
+#define _HSB_MSG_GET_BYTES(_field, _off, _size) \
+	memcpy(m->_field, buf + (_off), _size);
+
+#define HSB_MSG_DEFINE(_name, _NAME) \
+typedef struct { \
+	HSB_MSG_##_NAME(_HSB_MSG_FIELD, _HSB_MSG_BYTES) \
+} HSB_MSG_##_NAME##_T; \
+\
+static inline void hsb_msg_##_name##_put(uint8_t *buf, \
+					  const HSB_MSG_##_NAME##_T *m) \
+{ \
+	enum { _msg_len = HSB_MSG_##_NAME##_LEN }; \
+	HSB_MSG_##_NAME(_HSB_MSG_PUT, _HSB_MSG_PUT_BYTES) \
+} \
+\
+static inline int hsb_msg_##_name##_encode(uint8_t *buf, uint16_t cmd, \
+					    const HSB_MSG_##_NAME##_T *m) \
+{ \
+	SET_CMD_FIELD(buf, 0, uint16_t, cmd); \
+	SET_CMD_FIELD(buf, 2, uint16_t, HSB_MSG_##_NAME##_LEN); \
+	hsb_msg_##_name##_put(buf, m); \
+	return HSB_MSG_##_NAME##_LEN; \
+} \
+\
+static inline int hsb_msg_##_name##_decode(const uint8_t *buf, int len, \
+					    HSB_MSG_##_NAME##_T *m) \
+{ \
+	if (len < HSB_MSG_##_NAME##_LEN) \
+		return -1; \
+	HSB_MSG_##_NAME(_HSB_MSG_GET, _HSB_MSG_GET_BYTES) \
+	return 0; \
+}
+
+/* every layout above, X(name, NAME) */
+#define HSB_MSG_LIST(X) \
+	X(result, RESULT) \
+	X(event, EVENT) \
+	X(action, ACTION) \
+	X(heartbeat, HEARTBEAT) \
+	X(hello_resp, HELLO_RESP) \
+	X(subscribe, SUBSCRIBE) \
+	X(dev, DEV) \
+	X(dev_item, DEV_ITEM) \
+	X(dev_info, DEV_INFO) \
+	X(dev_config, DEV_CONFIG) \
+	X(add_dev, ADD_DEV) \
+	X(probe, PROBE) \
+	X(channel, CHANNEL) \
+	X(channel_name, CHANNEL_NAME) \
+	X(scene_name, SCENE_NAME) \
+	X(timer, TIMER) \
+	X(delay, DELAY) \
+	X(linkage, LINKAGE) \
+	X(dev_online, DEV_ONLINE) \
+	X(dev_record, DEV_RECORD)
+
+HSB_MSG_LIST(HSB_MSG_DEFINE)
+
+#endif
@@ -5,6 +5,10 @@
 typedef enum {
 	HSB_CMD_BOX_DISCOVER = 0x8801,
 	HSB_CMD_BOX_DISCOVER_RESP = 0x8802,
+	HSB_CMD_HELLO = 0x8803,
+	HSB_CMD_HELLO_RESP = 0x8804,
+	HSB_CMD_SUBSCRIBE = 0x8805,
+	HSB_CMD_HEARTBEAT = 0x8806,
 	HSB_CMD_GET_DEVS = 0x8811,
 	HSB_CMD_GET_DEVS_RESP = 0x8812,
 	HSB_CMD_GET_INFO = 0x8813,
@@ -12,11 +16,17 @@ typedef enum {
 	HSB_CMD_SET_CONFIG = 0x8815,
 	HSB_CMD_GET_CONFIG = 0x8816,
 	HSB_CMD_GET_CONFIG_RESP = 0x8817,
+	HSB_CMD_GET_DEVS_PAGE = 0x8818,
+	HSB_CMD_GET_DEVS_PAGE_RESP = 0x8819,
 	HSB_CMD_DEV_ONLINE = 0x881A,
+	HSB_CMD_SNAPSHOT = 0x881B,
 	HSB_CMD_GET_STATUS = 0x8821,
 	HSB_CMD_GET_STATUS_RESP = 0x8822,
 	HSB_CMD_SET_STATUS = 0x8823,
 	HSB_CMD_STATUS_UPDATE = 0x8829,
+	HSB_CMD_GET_STATUS_BATCH = 0x882A,
+	HSB_CMD_SET_STATUS_BATCH = 0x882B,
+	HSB_CMD_STATUS_BATCH_RESP = 0x882C,
 	HSB_CMD_SET_CHANNEL = 0x8824,
 	HSB_CMD_DEL_CHANNEL = 0x8825,
 	HSB_CMD_SWITCH_CHANNEL = 0x8826,
@@ -50,6 +60,32 @@ typedef enum {
 
 #define HSB_CMD_VALID(x)	(x >= HSB_CMD_BOX_DISCOVER && x < HSB_CMD_LAST)
 
+/*
+ * Features a client asks for in HELLO. SEQ and REQ_ID each add a u32
+ * trailer to every frame the box sends, counted in the frame length, in
+ * this order: [body][seq][req id]. A zero seq means not a broadcast, a
+ * zero req id means not a reply. With HSB_FEATURE_REQ_ID every frame the
+ * client sends ends with its request id too.
+ * With HSB_FEATURE_HEARTBEAT the box pings a quiet client and closes it
+ * when the pings go unanswered.
+ */
+#define HSB_FEATURE_SEQ		(1 << 0)
+#define HSB_FEATURE_REQ_ID	(1 << 1)
+#define HSB_FEATURE_HEARTBEAT	(1 << 2)
+#define HSB_FEATURE_ALL		(HSB_FEATURE_SEQ | HSB_FEATURE_REQ_ID | \
+				 HSB_FEATURE_HEARTBEAT)
+
+/* HEARTBEAT: [hdr][type][rsv][stamp], a ping is answered with a pong */
+typedef enum {
+	HSB_HEARTBEAT_PING = 0,
+	HSB_HEARTBEAT_PONG,
+} HSB_HEARTBEAT_TYPE_T;
+
+typedef enum {
+	HSB_HELLO_DELTA = 0,		/* missed events follow */
+	HSB_HELLO_SNAPSHOT,		/* a full snapshot follows */
+} HSB_HELLO_MODE_T;
+
 typedef enum {
 	HSB_DEV_TYPE_PLUG = 0,
 	HSB_DEV_TYPE_SENSOR,
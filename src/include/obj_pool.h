@@ -0,0 +1,26 @@
+/*
+ * Home Security Box 
+ *
+ * Fixed size object pools with a lock-free free list.
+ */
+#ifndef _OBJ_POOL_H_
+#define _OBJ_POOL_H_
+
+#include <glib.h>
+
+/* index space of the free list, a pool holds fewer objects */
+#define OBJ_POOL_MAX_NUM	(0xFFFF)
+
+typedef struct _obj_pool obj_pool;
+
+obj_pool *obj_pool_new(const char *name, gsize obj_size, guint num);
+
+gpointer obj_pool_alloc0(obj_pool *pool);
+
+gpointer obj_pool_dup(obj_pool *pool, gconstpointer src);
+
+void obj_pool_free(obj_pool *pool, gpointer obj);
+
+int obj_pool_stats(char *buf, int len);
+
+#endif /* _OBJ_POOL_H_ */
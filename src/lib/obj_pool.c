@@ -0,0 +1,163 @@
+/*
+ * Home Security Box 
+ *
+ * Fixed size object pools. Objects are carved from one block at startup
+ * and kept on a Treiber stack, the head packs a 16 bit ABA tag with the
+ * 16 bit index of the top slot. An empty pool falls back to g_slice so a
+ * burst never fails, the fallback count tells the pool is too small.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <glib.h>
+#include "obj_pool.h"
+#include "debug.h"
+
+#define HEAD_EMPTY		(0xFFFF)
+#define HEAD_MAKE(tag, idx)	((gint)(((guint)(tag) << 16) | ((idx) & 0xFFFF)))
+#define HEAD_TAG(head)		(((guint)(head) >> 16) & 0xFFFF)
+#define HEAD_IDX(head)		((guint)(head) & 0xFFFF)
+
+struct _obj_pool {
+	const char	*name;
+	gsize		obj_size;
+	gsize		stride;		/* obj_size rounded up to 8 */
+	guint		num;
+
+	guint8		*mem;
+	guint16		*next;		/* free list link per slot */
+	volatile gint	head;
+
+	/* statistics */
+	volatile gint	in_use;
+	volatile gint	high_water;
+	volatile gint	fallback;
+};
+
+static GSList *pool_list = NULL;
+G_LOCK_DEFINE_STATIC(pool_list);
+
+obj_pool *obj_pool_new(const char *name, gsize obj_size, guint num)
+{
+	obj_pool *pool;
+	guint idx;
+
+	if (num >= OBJ_POOL_MAX_NUM)
+		num = OBJ_POOL_MAX_NUM - 1;
+
+	pool = g_new0(obj_pool, 1);
+	pool->name = name;
+	pool->obj_size = obj_size;
+	pool->stride = (obj_size + 7) & ~(gsize)7;
+	pool->num = num;
+	pool->mem = g_malloc0(pool->stride * num);
+	pool->next = g_new(guint16, num);
+
+	for (idx = 0; idx < num; idx++)
+		pool->next[idx] = (idx + 1 < num) ? idx + 1 : HEAD_EMPTY;
+
+	pool->head = HEAD_MAKE(0, num ? 0 : HEAD_EMPTY);
+
+	G_LOCK(pool_list);
+	pool_list = g_slist_append(pool_list, pool);
+	G_UNLOCK(pool_list);
+
+	return pool;
+}
+
+static void _account_alloc(obj_pool *pool)
+{
+	gint used = g_atomic_int_add(&pool->in_use, 1) + 1;
+	gint high = g_atomic_int_get(&pool->high_water);
+
+	while (used > high) {
+		if (g_atomic_int_compare_and_exchange(&pool->high_water, high, used))
+			break;
+		high = g_atomic_int_get(&pool->high_water);
+	}
+}
+
+gpointer obj_pool_alloc0(obj_pool *pool)
+{
+	gint head, new_head;
+	guint idx;
+	gpointer obj;
+
+	do {
+		head = g_atomic_int_get(&pool->head);
+		idx = HEAD_IDX(head);
+		if (HEAD_EMPTY == idx) {
+			g_atomic_int_inc(&pool->fallback);
+			_account_alloc(pool);
+			return g_slice_alloc0(pool->obj_size);
+		}
+
+		/* a stale link only makes the tagged CAS below fail */
+		new_head = HEAD_MAKE(HEAD_TAG(head) + 1, pool->next[idx]);
+	} while (!g_atomic_int_compare_and_exchange(&pool->head, head, new_head));
+
+	_account_alloc(pool);
+
+	obj = pool->mem + (gsize)idx * pool->stride;
+	memset(obj, 0, pool->obj_size);
+
+	return obj;
+}
+
+gpointer obj_pool_dup(obj_pool *pool, gconstpointer src)
+{
+	gpointer obj = obj_pool_alloc0(pool);
+
+	memcpy(obj, src, pool->obj_size);
+
+	return obj;
+}
+
+void obj_pool_free(obj_pool *pool, gpointer obj)
+{
+	guint8 *ptr = (guint8 *)obj;
+	gint head, new_head;
+	guint idx;
+
+	if (!obj)
+		return;
+
+	g_atomic_int_add(&pool->in_use, -1);
+
+	if (ptr < pool->mem || ptr >= pool->mem + pool->stride * pool->num) {
+		g_slice_free1(pool->obj_size, obj);
+		return;
+	}
+
+	idx = (ptr - pool->mem) / pool->stride;
+
+	do {
+		head = g_atomic_int_get(&pool->head);
+		pool->next[idx] = HEAD_IDX(head);
+		new_head = HEAD_MAKE(HEAD_TAG(head) + 1, idx);
+	} while (!g_atomic_int_compare_and_exchange(&pool->head, head, new_head));
+}
+
+int obj_pool_stats(char *buf, int len)
+{
+	obj_pool *pool;
+	GSList *node;
+	int off = 0;
+
+	G_LOCK(pool_list);
+
+	for (node = pool_list; node && off < len; node = node->next) {
+		pool = (obj_pool *)node->data;
+
+		off += snprintf(buf + off, len - off,
+			"pool %s: size %u num %u in_use %d high %d fallback %d\n",
+			pool->name, (guint)pool->obj_size, pool->num,
+			g_atomic_int_get(&pool->in_use),
+			g_atomic_int_get(&pool->high_water),
+			g_atomic_int_get(&pool->fallback));
+	}
+
+	G_UNLOCK(pool_list);
+
+	return (off < len) ? off : len - 1;
+}
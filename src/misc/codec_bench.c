@@ -0,0 +1,561 @@
+/*
+ * Micro benchmark for the table driven codec in net_codec.h against the
+ * hand placed SET_CMD_FIELD/GET_CMD_FIELD code it replaced in network.c.
+ * Both sides are first checked to produce the same bytes and the same
+ * decoded values for random input, then timed over several rounds, and
+ * the min, median and max of the rounds are reported.
+ *
+ * usage: codec_bench [-n iterations] [-r rounds]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "network_utils.h"
+#include "net_protocol.h"
+#include "net_codec.h"
+
+#define MAKE_CMD_HDR(_buf, _cmd, _len)	do { \
+	SET_CMD_FIELD(_buf, 0, uint16_t, _cmd); \
+	SET_CMD_FIELD(_buf, 2, uint16_t, _len); \
+} while (0)
+
+#define NOINLINE	__attribute__((noinline))
+
+/* the daemon side structs, as in core_daemon/device.h */
+typedef struct {
+	uint16_t	id;
+	uint8_t		work_mode;
+	uint8_t		flag;
+	uint16_t	year;
+	uint8_t		mon;
+	uint8_t		mday;
+	uint8_t		hour;
+	uint8_t		min;
+	uint8_t		sec;
+	uint8_t		wday;
+	uint16_t	act_id;
+	uint16_t	act_param1;
+	uint32_t	act_param2;
+} TIMER_T;
+
+typedef struct {
+	uint16_t	id;
+	uint8_t		work_mode;
+	uint8_t		flag;
+	uint16_t	evt_id;
+	uint16_t	evt_param1;
+	uint32_t	evt_param2;
+	uint32_t	act_devid;
+	uint16_t	act_id;
+	uint16_t	act_param1;
+	uint32_t	act_param2;
+} LINKAGE_T;
+
+typedef struct {
+	uint32_t	id;
+	uint32_t	drvid;
+	uint32_t	state;
+	uint32_t	cls;
+	uint32_t	interface;
+	uint32_t	dev_type;
+	uint8_t		mac[8];
+	char		name[16];
+	char		location[16];
+	uint16_t	num;
+	uint16_t	val[8];
+} SNAP_T;
+
+typedef struct {
+	uint32_t	devid;
+	uint16_t	id;
+	uint16_t	param1;
+	uint32_t	param2;
+} EVENT_T;
+
+/* the old code */
+
+static NOINLINE int old_result(uint8_t *buf, int errcode, uint32_t devid, uint16_t cmd)
+{
+	int len = 12;
+
+	MAKE_CMD_HDR(buf, HSB_CMD_RESULT, len);
+
+	SET_CMD_FIELD(buf, 4, uint32_t, devid);
+	SET_CMD_FIELD(buf, 8, uint16_t, cmd);
+	SET_CMD_FIELD(buf, 10, uint16_t, errcode);
+
+	return len;
+}
+
+static NOINLINE int old_event(uint8_t *buf, EVENT_T *evt)
+{
+	int len = 16;
+
+	MAKE_CMD_HDR(buf, HSB_CMD_EVENT, len);
+	SET_CMD_FIELD(buf, 4, uint32_t, evt->devid);
+	SET_CMD_FIELD(buf, 8, uint16_t, evt->id);
+	SET_CMD_FIELD(buf, 10, uint16_t, evt->param1);
+	SET_CMD_FIELD(buf, 12, uint32_t, evt->param2);
+
+	return len;
+}
+
+static NOINLINE int old_get_timer(uint8_t *buf, uint32_t dev_id, TIMER_T *tm)
+{
+	int len = 28;
+	int year = 0, mon = 0;
+
+	MAKE_CMD_HDR(buf, HSB_CMD_GET_TIMER_RESP, len);
+
+	SET_CMD_FIELD(buf, 4, uint32_t, dev_id);
+	SET_CMD_FIELD(buf, 8, uint16_t, tm->id);
+	SET_CMD_FIELD(buf, 10, uint8_t, tm->work_mode);
+	SET_CMD_FIELD(buf, 11, uint8_t, tm->flag);
+	SET_CMD_FIELD(buf, 12, uint8_t, tm->hour);
+	SET_CMD_FIELD(buf, 13, uint8_t, tm->min);
+	SET_CMD_FIELD(buf, 14, uint8_t, tm->sec);
+	SET_CMD_FIELD(buf, 15, uint8_t, tm->wday);
+	if (tm->year > 0) {
+		year = tm->year + 1900;
+		mon = tm->mon + 1;
+	}
+	SET_CMD_FIELD(buf, 16, uint16_t, year);
+	SET_CMD_FIELD(buf, 18, uint8_t, mon);
+	SET_CMD_FIELD(buf, 19, uint8_t, tm->mday);
+	SET_CMD_FIELD(buf, 20, uint16_t, tm->act_id);
+	SET_CMD_FIELD(buf, 22, uint16_t, tm->act_param1);
+	SET_CMD_FIELD(buf, 24, uint32_t, tm->act_param2);
+
+	return len;
+}
+
+static NOINLINE uint32_t old_set_timer(uint8_t *buf, TIMER_T *tm)
+{
+	uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
+	int year, mon;
+
+	tm->id = GET_CMD_FIELD(buf, 8, uint16_t);
+	tm->work_mode = GET_CMD_FIELD(buf, 10, uint8_t);
+	tm->flag = GET_CMD_FIELD(buf, 11, uint8_t);
+	tm->hour = GET_CMD_FIELD(buf, 12, uint8_t);
+	tm->min = GET_CMD_FIELD(buf, 13, uint8_t);
+	tm->sec = GET_CMD_FIELD(buf, 14, uint8_t);
+	tm->wday = GET_CMD_FIELD(buf, 15, uint8_t);
+	year = GET_CMD_FIELD(buf, 16, uint16_t);
+	mon = GET_CMD_FIELD(buf, 18, uint8_t);
+	if (year > 1900) {
+		year -= 1900;
+		mon -= 1;
+	}
+	tm->year = year;
+	tm->mon = mon;
+	tm->mday = GET_CMD_FIELD(buf, 19, uint8_t);
+	tm->act_id = GET_CMD_FIELD(buf, 20, uint16_t);
+	tm->act_param1 = GET_CMD_FIELD(buf, 22, uint16_t);
+	tm->act_param2 = GET_CMD_FIELD(buf, 24, uint32_t);
+
+	return dev_id;
+}
+
+static NOINLINE uint32_t old_set_linkage(uint8_t *buf, LINKAGE_T *link)
+{
+	uint32_t dev_id = GET_CMD_FIELD(buf, 4, uint32_t);
+
+	link->id = GET_CMD_FIELD(buf, 8, uint16_t);
+	link->work_mode = GET_CMD_FIELD(buf, 10, uint8_t);
+	link->flag = GET_CMD_FIELD(buf, 11, uint8_t);
+	link->evt_id = GET_CMD_FIELD(buf, 12, uint16_t);
+	link->evt_param1 = GET_CMD_FIELD(buf, 14, uint16_t);
+	link->evt_param2 = GET_CMD_FIELD(buf, 16, uint32_t);
+	link->act_devid = GET_CMD_FIELD(buf, 20, uint32_t);
+	link->act_id = GET_CMD_FIELD(buf, 24, uint16_t);
+	link->act_param1 = GET_CMD_FIELD(buf, 26, uint16_t);
+	link->act_param2 = GET_CMD_FIELD(buf, 28, uint32_t);
+
+	return dev_id;
+}
+
+static NOINLINE int old_dev_record(uint8_t *buf, SNAP_T *pdev)
+{
+	int off = 60;
+	int cnt;
+
+	SET_CMD_FIELD(buf, 0, uint32_t, pdev->id);
+	SET_CMD_FIELD(buf, 4, uint32_t, pdev->drvid);
+	SET_CMD_FIELD(buf, 8, uint16_t, pdev->cls);
+	SET_CMD_FIELD(buf, 10, uint16_t, pdev->interface);
+	SET_CMD_FIELD(buf, 12, uint32_t, pdev->dev_type);
+	memcpy(buf + 16, pdev->mac, 8);
+	buf[24] = (uint8_t)pdev->state;
+	buf[25] = (uint8_t)pdev->num;
+	SET_CMD_FIELD(buf, 26, uint16_t, 0);
+	memcpy(buf + 28, pdev->name, 16);
+	memcpy(buf + 44, pdev->location, 16);
+
+	for (cnt = 0; cnt < pdev->num; cnt++, off += 4) {
+		SET_CMD_FIELD(buf, off, uint16_t, cnt);
+		SET_CMD_FIELD(buf, off + 2, uint16_t, pdev->val[cnt]);
+	}
+
+	return off;
+}
+
+static NOINLINE int old_dev_info(uint8_t *buf, SNAP_T *pdev)
+{
+	int len = 26;
+
+	MAKE_CMD_HDR(buf, HSB_CMD_GET_INFO_RESP, len);
+
+	SET_CMD_FIELD(buf, 4, uint32_t, pdev->id);
+	SET_CMD_FIELD(buf, 8, uint32_t, pdev->drvid);
+	SET_CMD_FIELD(buf, 12, uint16_t, pdev->cls);
+	SET_CMD_FIELD(buf, 14, uint16_t, pdev->interface);
+	SET_CMD_FIELD(buf, 16, uint32_t, pdev->dev_type);
+	memcpy(buf + 18, pdev->mac, 8);
+
+	return len;
+}
+
+/* the same through the codec, as network.c does it now */
+
+static NOINLINE int new_result(uint8_t *buf, int errcode, uint32_t devid, uint16_t cmd)
+{
+	HSB_MSG_RESULT_T msg = {
+		.devid = devid,
+		.cmd = cmd,
+		.ret = errcode,
+	};
+
+	return hsb_msg_result_encode(buf, HSB_CMD_RESULT, &msg);
+}
+
+static NOINLINE int new_event(uint8_t *buf, EVENT_T *evt)
+{
+	HSB_MSG_EVENT_T msg = {
+		.devid = evt->devid,
+		.id = evt->id,
+		.param1 = evt->param1,
+		.param2 = evt->param2,
+	};
+
+	return hsb_msg_event_encode(buf, HSB_CMD_EVENT, &msg);
+}
+
+static NOINLINE int new_get_timer(uint8_t *buf, uint32_t dev_id, TIMER_T *tm)
+{
+	HSB_MSG_TIMER_T msg = {
+		.devid = dev_id,
+		.id = tm->id,
+		.work_mode = tm->work_mode,
+		.flag = tm->flag,
+		.hour = tm->hour,
+		.min = tm->min,
+		.sec = tm->sec,
+		.wday = tm->wday,
+		.mday = tm->mday,
+		.act_id = tm->act_id,
+		.act_param1 = tm->act_param1,
+		.act_param2 = tm->act_param2,
+	};
+
+	if (tm->year > 0) {
+		msg.year = tm->year + 1900;
+		msg.mon = tm->mon + 1;
+	}
+
+	return hsb_msg_timer_encode(buf, HSB_CMD_GET_TIMER_RESP, &msg);
+}
+
+static NOINLINE uint32_t new_set_timer(uint8_t *buf, TIMER_T *tm)
+{
+	HSB_MSG_TIMER_T msg;
+	int year, mon;
+
+	hsb_msg_timer_decode(buf, HSB_MSG_TIMER_LEN, &msg);
+
+	tm->id = msg.id;
+	tm->work_mode = msg.work_mode;
+	tm->flag = msg.flag;
+	tm->hour = msg.hour;
+	tm->min = msg.min;
+	tm->sec = msg.sec;
+	tm->wday = msg.wday;
+	tm->mday = msg.mday;
+	tm->act_id = msg.act_id;
+	tm->act_param1 = msg.act_param1;
+	tm->act_param2 = msg.act_param2;
+
+	year = msg.year;
+	mon = msg.mon;
+	if (year > 1900) {
+		year -= 1900;
+		mon -= 1;
+	}
+	tm->year = year;
+	tm->mon = mon;
+
+	return msg.devid;
+}
+
+static NOINLINE uint32_t new_set_linkage(uint8_t *buf, LINKAGE_T *link)
+{
+	HSB_MSG_LINKAGE_T msg;
+
+	hsb_msg_linkage_decode(buf, HSB_MSG_LINKAGE_LEN, &msg);
+
+	link->id = msg.id;
+	link->work_mode = msg.work_mode;
+	link->flag = msg.flag;
+	link->evt_id = msg.evt_id;
+	link->evt_param1 = msg.evt_param1;
+	link->evt_param2 = msg.evt_param2;
+	link->act_devid = msg.act_devid;
+	link->act_id = msg.act_id;
+	link->act_param1 = msg.act_param1;
+	link->act_param2 = msg.act_param2;
+
+	return msg.devid;
+}
+
+static NOINLINE int new_dev_record(uint8_t *buf, SNAP_T *pdev)
+{
+	HSB_MSG_DEV_RECORD_T rec = {
+		.devid = pdev->id,
+		.drvid = pdev->drvid,
+		.cls = pdev->cls,
+		.interface = pdev->interface,
+		.dev_type = pdev->dev_type,
+		.state = pdev->state,
+		.num = pdev->num,
+	};
+	int off = HSB_MSG_DEV_RECORD_LEN;
+	int cnt;
+
+	memcpy(rec.mac, pdev->mac, sizeof(rec.mac));
+	memcpy(rec.name, pdev->name, sizeof(rec.name));
+	memcpy(rec.location, pdev->location, sizeof(rec.location));
+	hsb_msg_dev_record_put(buf, &rec);
+
+	for (cnt = 0; cnt < pdev->num; cnt++, off += 4) {
+		SET_CMD_FIELD(buf, off, uint16_t, cnt);
+		SET_CMD_FIELD(buf, off + 2, uint16_t, pdev->val[cnt]);
+	}
+
+	return off;
+}
+
+static NOINLINE int new_dev_info(uint8_t *buf, SNAP_T *pdev)
+{
+	HSB_MSG_DEV_INFO_T msg = {
+		.devid = pdev->id,
+		.drvid = pdev->drvid,
+		.cls = pdev->cls,
+		.interface = pdev->interface,
+		.dev_type = pdev->dev_type,
+	};
+
+	memcpy(msg.mac, pdev->mac, sizeof(msg.mac));
+
+	return hsb_msg_dev_info_encode(buf, HSB_CMD_GET_INFO_RESP, &msg);
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void fill_random(void *p, int len)
+{
+	uint8_t *b = p;
+
+	while (len--)
+		*b++ = rand();
+}
+
+/* keeps the compiler from dropping the work */
+#define CLOBBER(_p)	__asm__ volatile("" : : "r"(_p) : "memory")
+
+static int check_same(void)
+{
+	uint8_t old_buf[128], new_buf[128], frame[64];
+	TIMER_T old_tm, new_tm, tm;
+	LINKAGE_T old_link, new_link;
+	EVENT_T evt;
+	SNAP_T snap;
+	int cnt, old_len, new_len;
+
+	for (cnt = 0; cnt < 100000; cnt++) {
+		fill_random(&tm, sizeof(tm));
+		fill_random(&evt, sizeof(evt));
+		fill_random(&snap, sizeof(snap));
+		fill_random(frame, sizeof(frame));
+		snap.num %= 9;
+		/* struct tm style years, or 0 for none */
+		tm.year %= 200;
+		tm.mon %= 12;
+
+		memset(old_buf, 0, sizeof(old_buf));
+		memset(new_buf, 0, sizeof(new_buf));
+		old_len = old_result(old_buf, tm.act_id, evt.devid, evt.id);
+		new_len = new_result(new_buf, tm.act_id, evt.devid, evt.id);
+		if (old_len != new_len || memcmp(old_buf, new_buf, old_len))
+			return printf("result differs\n");
+
+		old_len = old_event(old_buf, &evt);
+		new_len = new_event(new_buf, &evt);
+		if (old_len != new_len || memcmp(old_buf, new_buf, old_len))
+			return printf("event differs\n");
+
+		old_len = old_get_timer(old_buf, evt.devid, &tm);
+		new_len = new_get_timer(new_buf, evt.devid, &tm);
+		if (old_len != new_len || memcmp(old_buf, new_buf, old_len))
+			return printf("timer reply differs\n");
+
+		old_len = old_dev_record(old_buf, &snap);
+		new_len = new_dev_record(new_buf, &snap);
+		if (old_len != new_len || memcmp(old_buf, new_buf, old_len))
+			return printf("dev record differs\n");
+
+		old_len = old_dev_info(old_buf, &snap);
+		new_len = new_dev_info(new_buf, &snap);
+		if (old_len != new_len || memcmp(old_buf, new_buf, old_len))
+			return printf("dev info differs\n");
+
+		memset(&old_tm, 0, sizeof(old_tm));
+		memset(&new_tm, 0, sizeof(new_tm));
+		if (old_set_timer(frame, &old_tm) != new_set_timer(frame, &new_tm) ||
+		    memcmp(&old_tm, &new_tm, sizeof(old_tm)))
+			return printf("set timer differs\n");
+
+		memset(&old_link, 0, sizeof(old_link));
+		memset(&new_link, 0, sizeof(new_link));
+		if (old_set_linkage(frame, &old_link) != new_set_linkage(frame, &new_link) ||
+		    memcmp(&old_link, &new_link, sizeof(old_link)))
+			return printf("set linkage differs\n");
+	}
+
+	return 0;
+}
+
+#define CASE_NUM	(14)
+#define ROUND_MAX	(64)
+
+static const char *case_name[CASE_NUM];
+static double samples[CASE_NUM][ROUND_MAX];
+
+#define BENCH(_case, _name, _iter, _expr)	do { \
+	int64_t _start = now_ns(); \
+	long _it; \
+	for (_it = 0; _it < (_iter); _it++) { \
+		_expr; \
+		CLOBBER(buf); \
+	} \
+	case_name[_case] = _name; \
+	samples[_case][round] = (double)(now_ns() - _start) / (_iter); \
+} while (0)
+
+/* old and new swap places every round, so drift hits both alike */
+#define BENCH_PAIR(_case, _name, _iter, _old, _new)	do { \
+	if (round & 1) { \
+		BENCH(_case + 1, "new " _name, _iter, _new); \
+		BENCH(_case, "old " _name, _iter, _old); \
+	} else { \
+		BENCH(_case, "old " _name, _iter, _old); \
+		BENCH(_case + 1, "new " _name, _iter, _new); \
+	} \
+} while (0)
+
+static int _cmp_double(const void *a, const void *b)
+{
+	double da = *(const double *)a, db = *(const double *)b;
+
+	return (da > db) - (da < db);
+}
+
+/* round 0 only warms up caches and clocks, it is left out */
+static void report(int rounds)
+{
+	double sorted[ROUND_MAX];
+	int cnt, num = rounds - 1;
+
+	printf("%-20s %8s %8s %8s  (%d rounds)\n", "", "min", "median", "max", num);
+
+	for (cnt = 0; cnt < CASE_NUM; cnt++) {
+		memcpy(sorted, &samples[cnt][1], num * sizeof(double));
+		qsort(sorted, num, sizeof(double), _cmp_double);
+
+		printf("%-20s %8.2f %8.2f %8.2f ns\n", case_name[cnt],
+			sorted[0], sorted[num / 2], sorted[num - 1]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t buf[128];
+	TIMER_T tm;
+	LINKAGE_T link;
+	EVENT_T evt;
+	SNAP_T snap;
+	long iter = 20000000;
+	int rounds = 10;
+	int opt, round;
+
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+			case 'n':
+				iter = atol(optarg);
+				break;
+			case 'r':
+				rounds = atoi(optarg);
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (rounds < 2)
+		rounds = 2;
+	if (rounds > ROUND_MAX)
+		rounds = ROUND_MAX;
+
+	srand(1);
+
+	if (check_same())
+		return -1;
+
+	printf("old and new produce the same bytes\n");
+
+	fill_random(&tm, sizeof(tm));
+	fill_random(&evt, sizeof(evt));
+	fill_random(&snap, sizeof(snap));
+	fill_random(buf, sizeof(buf));
+	snap.num = 4;
+	tm.year = 125;
+
+	for (round = 0; round < rounds; round++) {
+		BENCH_PAIR(0, "result", iter, old_result(buf, 1, evt.devid, evt.id),
+			   new_result(buf, 1, evt.devid, evt.id));
+		BENCH_PAIR(2, "event", iter, old_event(buf, &evt), new_event(buf, &evt));
+		BENCH_PAIR(4, "timer reply", iter, old_get_timer(buf, evt.devid, &tm),
+			   new_get_timer(buf, evt.devid, &tm));
+		BENCH_PAIR(6, "dev record", iter, old_dev_record(buf, &snap),
+			   new_dev_record(buf, &snap));
+		BENCH_PAIR(8, "dev info", iter, old_dev_info(buf, &snap),
+			   new_dev_info(buf, &snap));
+		BENCH_PAIR(10, "set timer", iter, old_set_timer(buf, &tm); CLOBBER(&tm),
+			   new_set_timer(buf, &tm); CLOBBER(&tm));
+		BENCH_PAIR(12, "set linkage", iter, old_set_linkage(buf, &link); CLOBBER(&link),
+			   new_set_linkage(buf, &link); CLOBBER(&link));
+	}
+
+	report(rounds);
+
+	return 0;
+}
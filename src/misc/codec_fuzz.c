@@ -0,0 +1,142 @@
+/*
+ * Fuzz target for the message layouts in net_codec.h. Every input is
+ * decoded as each message; a decode must fail exactly when the input is
+ * shorter than the layout, and a decoded message put back must give the
+ * input bytes again, with every byte after the header covered by a field.
+ *
+ * Built with -DCODEC_LIBFUZZER it is a plain libFuzzer target, e.g.
+ *   clang -g -O1 -fsanitize=fuzzer,address -DCODEC_LIBFUZZER -I../include codec_fuzz.c
+ * Otherwise it runs the given files, or random inputs:
+ *
+ * usage: codec_fuzz [-n runs] [-s seed] [file ...]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include "network_utils.h"
+#include "net_protocol.h"
+#include "net_codec.h"
+
+#define FUZZ_MAX_LEN	(256)
+
+#define FUZZ_MSG(_name, _NAME)	do { \
+	HSB_MSG_##_NAME##_T m; \
+	uint8_t a[HSB_MSG_##_NAME##_LEN], b[HSB_MSG_##_NAME##_LEN]; \
+	int len = HSB_MSG_##_NAME##_LEN; \
+	int off; \
+	\
+	if (hsb_msg_##_name##_decode(data, size, &m)) { \
+		if ((int)size >= len) \
+			_fail(#_name, "decode failed", data, size); \
+		break; \
+	} \
+	if ((int)size < len) \
+		_fail(#_name, "short frame decoded", data, size); \
+	\
+	/* a byte the put does not write keeps the fill */ \
+	memset(a, 0xA5, len); \
+	memset(b, 0x5A, len); \
+	hsb_msg_##_name##_put(a, &m); \
+	hsb_msg_##_name##_put(b, &m); \
+	\
+	/* records have no header, the rest start after [cmd][len] */ \
+	for (off = (a[0] == b[0]) ? 0 : 4; off < len; off++) { \
+		if (a[off] != b[off]) \
+			_fail(#_name, "hole in layout", data, size); \
+		if (a[off] != data[off]) \
+			_fail(#_name, "round trip differs", data, size); \
+	} \
+} while (0);
+
+static void _fail(const char *name, const char *why, const uint8_t *data, size_t size)
+{
+	size_t cnt;
+
+	printf("%s: %s, input %zu bytes:", name, why, size);
+	for (cnt = 0; cnt < size; cnt++)
+		printf(" %02x", data[cnt]);
+	printf("\n");
+	fflush(stdout);
+
+	abort();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	HSB_MSG_LIST(FUZZ_MSG)
+
+	return 0;
+}
+
+#ifndef CODEC_LIBFUZZER
+
+static int run_file(const char *path)
+{
+	uint8_t data[FUZZ_MAX_LEN];
+	size_t size;
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		printf("open %s fail\n", path);
+		return -1;
+	}
+
+	size = fread(data, 1, sizeof(data), fp);
+	fclose(fp);
+
+	return LLVMFuzzerTestOneInput(data, size);
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t data[FUZZ_MAX_LEN], *copy;
+	long runs = 1000000, cnt;
+	unsigned int seed = time(NULL);
+	size_t size, off;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+		switch (opt) {
+			case 'n':
+				runs = atol(optarg);
+				break;
+			case 's':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (optind < argc) {
+		for (; optind < argc; optind++)
+			run_file(argv[optind]);
+		return 0;
+	}
+
+	printf("seed %u, %ld runs\n", seed, runs);
+	srand(seed);
+
+	for (cnt = 0; cnt < runs; cnt++) {
+		/* mostly around the layout sizes, where the edges are */
+		size = (cnt & 1) ? (size_t)(rand() % 72) : rand() % sizeof(data);
+		for (off = 0; off < size; off++)
+			data[off] = rand();
+
+		/* each run gets its own heap copy so overreads hit a redzone */
+		copy = malloc(size ? size : 1);
+		memcpy(copy, data, size);
+		LLVMFuzzerTestOneInput(copy, size);
+		free(copy);
+	}
+
+	printf("ok\n");
+
+	return 0;
+}
+
+#endif
@@ -0,0 +1,207 @@
+/*
+ * Flood generator for the core daemon discovery responder: many apps
+ * (one UDP socket each) send BOX_DISCOVER at the same moment, the way
+ * phones do after a router reboot, and the time to each app's first
+ * reply is measured.
+ *
+ * -r makes every app send that many requests back to back, like apps
+ * that retry; one reply per app and round is expected, the rest should
+ * be deduplicated by the box.
+ *
+ * usage: discover_flood <box ip> [-n apps] [-c rounds] [-r retries] [-w wait ms]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "network_utils.h"
+#include "net_protocol.h"
+
+#define CORE_UDP_LISTEN_PORT	(18000)
+
+#define MAX_RETRY		(16)
+
+typedef struct {
+	int		fd;
+	int64_t		sent_us;
+	int		replies;	/* in this round */
+} APP_T;
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp_lat(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static int app_send(APP_T *app, struct sockaddr_in *servaddr, int retries)
+{
+	uint8_t buf[8];
+	int cnt;
+
+	memset(buf, 0, sizeof(buf));
+	SET_CMD_FIELD(buf, 0, uint16_t, HSB_CMD_BOX_DISCOVER);
+	SET_CMD_FIELD(buf, 2, uint16_t, sizeof(buf));
+
+	for (cnt = 0; cnt < retries; cnt++) {
+		if (sendto(app->fd, buf, sizeof(buf), 0,
+			   (struct sockaddr *)servaddr, sizeof(*servaddr)) != sizeof(buf))
+			return -1;
+	}
+
+	app->sent_us = now_us();
+	app->replies = 0;
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in servaddr;
+	struct epoll_event ev, events[64];
+	int app_num = 256, rounds = 10, retries = 1, wait_ms = 500;
+	int opt, epfd, cnt, round, nfds, ready = 0, errors = 0;
+	long sent = 0, replies = 0, answered = 0, dup = 0, nlat = 0;
+	int64_t now, end, *lat;
+	APP_T *apps, *app;
+
+	memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_port = htons(CORE_UDP_LISTEN_PORT);
+
+	if (argc < 2 || !inet_aton(argv[1], &servaddr.sin_addr)) {
+		printf("usage: %s <box ip> [-n apps] [-c rounds] [-r retries] [-w wait ms]\n", argv[0]);
+		return -1;
+	}
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "n:c:r:w:")) != -1) {
+		switch (opt) {
+			case 'n':
+				app_num = atoi(optarg);
+				break;
+			case 'c':
+				rounds = atoi(optarg);
+				break;
+			case 'r':
+				retries = atoi(optarg);
+				if (retries < 1)
+					retries = 1;
+				if (retries > MAX_RETRY)
+					retries = MAX_RETRY;
+				break;
+			case 'w':
+				wait_ms = atoi(optarg);
+				break;
+			default:
+				break;
+		}
+	}
+
+	apps = calloc(app_num, sizeof(APP_T));
+	lat = malloc((long)app_num * rounds * sizeof(int64_t));
+	epfd = epoll_create(app_num);
+	if (!apps || !lat || epfd < 0)
+		return -1;
+
+	for (cnt = 0; cnt < app_num; cnt++) {
+		app = &apps[cnt];
+		app->fd = socket(AF_INET, SOCK_DGRAM, 0);
+		if (app->fd < 0) {
+			printf("app %d socket fail\n", cnt);
+			continue;
+		}
+
+		fcntl(app->fd, F_SETFL, fcntl(app->fd, F_GETFL, 0) | O_NONBLOCK);
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = app;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, app->fd, &ev);
+		ready++;
+	}
+
+	printf("%d/%d apps ready, %d rounds of %d requests each\n",
+		ready, app_num, rounds, retries);
+
+	for (round = 0; round < rounds; round++) {
+		/* every app fires as close together as a loop allows */
+		for (cnt = 0; cnt < app_num; cnt++) {
+			app = &apps[cnt];
+			if (app->fd < 0)
+				continue;
+
+			if (app_send(app, &servaddr, retries)) {
+				errors++;
+				continue;
+			}
+			sent += retries;
+		}
+
+		end = now_us() + (int64_t)wait_ms * 1000;
+
+		while ((now = now_us()) < end) {
+			nfds = epoll_wait(epfd, events, 64, (int)((end - now) / 1000) + 1);
+
+			for (cnt = 0; cnt < nfds; cnt++) {
+				uint8_t buf[64];
+				int nread;
+
+				app = (APP_T *)events[cnt].data.ptr;
+
+				while ((nread = recv(app->fd, buf, sizeof(buf), 0)) > 0) {
+					if (nread < 4 ||
+					    GET_CMD_FIELD(buf, 0, uint16_t) != HSB_CMD_BOX_DISCOVER_RESP)
+						continue;
+
+					replies++;
+					if (app->replies++) {
+						dup++;
+						continue;
+					}
+
+					answered++;
+					lat[nlat++] = now_us() - app->sent_us;
+				}
+			}
+		}
+	}
+
+	qsort(lat, nlat, sizeof(int64_t), cmp_lat);
+
+	printf("requests %ld replies %ld duplicate %ld errors %d\n",
+		sent, replies, dup, errors);
+	printf("apps answered %ld/%ld\n", answered, (long)ready * rounds);
+
+	if (nlat) {
+		printf("first reply us: p50 %lld p90 %lld p99 %lld max %lld\n",
+			(long long)lat[nlat / 2],
+			(long long)lat[nlat * 9 / 10],
+			(long long)lat[nlat * 99 / 100],
+			(long long)lat[nlat - 1]);
+	}
+
+	for (cnt = 0; cnt < app_num; cnt++) {
+		if (apps[cnt].fd >= 0)
+			close(apps[cnt].fd);
+	}
+
+	return 0;
+}
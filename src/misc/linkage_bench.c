@@ -0,0 +1,284 @@
+/*
+ * Event flood benchmark for the linkage lookup done by _dev_event() in
+ * core_daemon/device.c. The old check_linkage() scanned the linkage slots
+ * of the source device for every event; the new one in linkage.c looks the
+ * event up in a hash of rule buckets and only walks the rules it triggers.
+ * The new side links linkage.c as is, with the device calls it makes
+ * answered below; the old scan is no longer in the tree and is kept here
+ * as it was.
+ *
+ * Both sides get the same rules through set_dev_linkage() and the same
+ * random events from 100 devices, and are first checked to issue the same
+ * actions in the same order, then timed with 8 rules per device (the old
+ * fixed slot count) and with more, as if the old arrays had been made
+ * larger.
+ *
+ * usage: linkage_bench [-n events]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <glib.h>
+#include "hsb_error.h"
+#include "hsb_config.h"
+#include "../core_daemon/device.h"
+#include "../core_daemon/linkage.h"
+
+#define NOINLINE	__attribute__((noinline))
+#define CLOBBER(_p)	__asm__ volatile("" : : "r"(_p) : "memory")
+
+#define DEV_NUM			(100)
+#define EVT_ID_NUM		(4)	/* DEV_UPDATED to MODE_CHANGED */
+#define EVT_PARAM1_NUM		(8)
+#define EVENTS_NUM		(4096)
+
+static HSB_DEV_T devs[DEV_NUM];
+static int gl_work_mode = 0;
+
+/* a running hash of the actions issued */
+static uint32_t act_sum;
+
+static inline void _do_act(uint32_t devid, uint16_t act_id, uint16_t param1)
+{
+	act_sum = act_sum * 31 + devid;
+	act_sum = act_sum * 31 + act_id;
+	act_sum = act_sum * 31 + param1;
+}
+
+/* what linkage.c calls in device.c */
+HSB_DEV_T *find_dev(uint32_t dev_id)
+{
+	if (dev_id < 1 || dev_id > DEV_NUM)
+		return NULL;
+
+	return &devs[dev_id - 1];
+}
+
+HSB_DEV_T *get_dev(uint32_t dev_id)
+{
+	HSB_DEV_T *pdev = find_dev(dev_id);
+
+	if (pdev)
+		g_atomic_int_inc(&pdev->ref);
+
+	return pdev;
+}
+
+void put_dev(HSB_DEV_T *pdev)
+{
+	g_atomic_int_dec_and_test(&pdev->ref);
+}
+
+HSB_WORK_MODE_T get_box_work_mode(void)
+{
+	return gl_work_mode;
+}
+
+int do_dev_act_async(uint32_t devid, uint8_t flag, uint16_t act_id,
+			uint16_t param1, uint32_t param2)
+{
+	_do_act(devid, act_id, param1);
+
+	return HSB_E_OK;
+}
+
+/* check_alarm_linkage() only, not reached here */
+int do_dev_alarm_act(uint32_t devid, uint8_t flag, uint16_t act_id,
+			uint16_t param1, uint32_t param2)
+{
+	return do_dev_act_async(devid, flag, act_id, param1, param2);
+}
+
+/* the old per device linkage slots and their scan */
+static HSB_LINKAGE_T *old_link[DEV_NUM];
+static bool *old_link_active[DEV_NUM];
+static int link_num;
+
+static NOINLINE int old_check_linkage(uint32_t devid, HSB_EVT_T *evt)
+{
+	HSB_DEV_T *pdev = get_dev(devid);
+	if (!pdev)
+		return HSB_E_OTHERS;
+
+	int work_mode = gl_work_mode;
+	HSB_LINKAGE_T *link = old_link[devid - 1];
+	bool *active = old_link_active[devid - 1];
+
+	if (!CHECK_BIT(pdev->work_mode, work_mode)) {
+		put_dev(pdev);
+		return HSB_E_OTHERS;
+	}
+
+	int id;
+
+	for (id = 0; id < link_num; id++, link++, active++) {
+		if (!*active)
+			continue;
+
+		if (!CHECK_BIT(link->work_mode, work_mode))
+			continue;
+
+		if (evt->id != link->evt_id ||
+		    evt->param1 != link->evt_param1 ||
+		    evt->param2 != link->evt_param2)
+			continue;
+
+		do_dev_act_async(link->act_devid, link->flag, link->act_id,
+				link->act_param1, link->act_param2);
+	}
+
+	put_dev(pdev);
+
+	return HSB_E_OK;
+}
+
+static int setup(int num)
+{
+	HSB_LINKAGE_T *link;
+	int dev, id;
+
+	link_num = num;
+
+	for (dev = 0; dev < DEV_NUM; dev++) {
+		devs[dev].id = dev + 1;
+		devs[dev].work_mode = 0xFF;
+		old_link[dev] = calloc(num, sizeof(HSB_LINKAGE_T));
+		old_link_active[dev] = calloc(num, sizeof(bool));
+
+		for (id = 0; id < num; id++) {
+			link = &old_link[dev][id];
+			link->id = id;
+			link->work_mode = (rand() % 4) ? 0xFF : 0xFE;
+			link->evt_id = HSB_EVT_TYPE_DEV_UPDATED + rand() % EVT_ID_NUM;
+			link->evt_param1 = rand() % EVT_PARAM1_NUM;
+			link->act_devid = rand() % DEV_NUM + 1;
+			link->act_id = rand();
+			link->act_param1 = rand();
+
+			old_link_active[dev][id] = true;
+
+			if (set_dev_linkage(devs[dev].id, link))
+				return printf("set linkage %d of dev %d fail\n",
+					      id, devs[dev].id);
+		}
+	}
+
+	return 0;
+}
+
+static void teardown(void)
+{
+	int dev;
+
+	for (dev = 0; dev < DEV_NUM; dev++) {
+		del_linkage_by_dev(devs[dev].id);
+
+		free(old_link[dev]);
+		free(old_link_active[dev]);
+	}
+}
+
+static void fill_events(HSB_EVT_T *evts)
+{
+	int cnt;
+
+	for (cnt = 0; cnt < EVENTS_NUM; cnt++) {
+		evts[cnt].devid = rand() % DEV_NUM + 1;
+		evts[cnt].id = HSB_EVT_TYPE_DEV_UPDATED + rand() % EVT_ID_NUM;
+		evts[cnt].param1 = rand() % EVT_PARAM1_NUM;
+		evts[cnt].param2 = 0;
+	}
+}
+
+static int check_same(const HSB_EVT_T *evts)
+{
+	uint32_t old_sum, new_sum;
+	HSB_EVT_T evt;
+	int cnt;
+
+	for (cnt = 0; cnt < EVENTS_NUM; cnt++) {
+		memcpy(&evt, &evts[cnt], sizeof(evt));
+
+		act_sum = 0;
+		old_check_linkage(evt.devid, &evt);
+		old_sum = act_sum;
+
+		act_sum = 0;
+		check_linkage(&evt);
+		new_sum = act_sum;
+
+		if (old_sum != new_sum)
+			return printf("event %d of dev %u differs\n", cnt, evt.devid);
+	}
+
+	return 0;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define BENCH(_name, _num, _iter, _expr)	do { \
+	int64_t _start = now_ns(); \
+	long _it; \
+	for (_it = 0; _it < (_iter); _it++) { \
+		HSB_EVT_T *evt = &evts[_it & (EVENTS_NUM - 1)]; \
+		_expr; \
+		CLOBBER(evt); \
+	} \
+	printf("%-6s %4d rules/dev %10.1f ns/event\n", _name, _num, \
+		(double)(now_ns() - _start) / (_iter)); \
+} while (0)
+
+int main(int argc, char *argv[])
+{
+	static const int nums[] = { 8, 64, 512 };
+	static HSB_EVT_T evts[EVENTS_NUM];
+	long iter = 2000000;
+	int opt, cnt, round;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				iter = atol(optarg);
+				break;
+			default:
+				break;
+		}
+	}
+
+	srand(1);
+
+	init_linkage();
+
+	for (cnt = 0; cnt < (int)(sizeof(nums) / sizeof(nums[0])); cnt++) {
+		if (setup(nums[cnt]))
+			return -1;
+
+		fill_events(evts);
+
+		if (check_same(evts))
+			return -1;
+
+		/* two rounds, the first one warms up caches and clocks */
+		for (round = 0; round < 2; round++) {
+			BENCH("old", nums[cnt], iter, old_check_linkage(evt->devid, evt));
+			BENCH("new", nums[cnt], iter, check_linkage(evt));
+		}
+
+		teardown();
+	}
+
+	printf("old and new issue the same actions\n");
+
+	return 0;
+}
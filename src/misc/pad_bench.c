@@ -0,0 +1,280 @@
+/*
+ * Load test for the core daemon TCP server: many simulated pads send
+ * rounds of GET_DEVS and the round trip of each round is measured.
+ *
+ * -b sends that many commands per round back to back, -s writes each
+ * round in randomly sized pieces so commands straddle TCP segments;
+ * every command must still get its reply.
+ *
+ * usage: pad_bench <box ip> [-n pads] [-t seconds] [-i interval ms] [-b burst] [-s]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "network_utils.h"
+#include "net_protocol.h"
+
+#define CORE_TCP_LISTEN_PORT	(18002)
+
+#define MAX_RTT_SAMPLE		(1 << 20)
+#define MAX_BURST		(64)
+
+typedef struct {
+	int		fd;
+	uint8_t		rbuf[4096];
+	int		rlen;
+	int64_t		sent_us;	/* 0: nothing in flight */
+	int64_t		next_us;
+	int		pending;	/* replies left in this round */
+	int		replies;
+} PAD_T;
+
+static int64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int cmp_rtt(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static int pad_connect(struct in_addr *addr)
+{
+	struct sockaddr_in servaddr;
+	int one = 1;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd < 0)
+		return -1;
+
+	memset(&servaddr, 0, sizeof(servaddr));
+	servaddr.sin_family = AF_INET;
+	servaddr.sin_port = htons(CORE_TCP_LISTEN_PORT);
+	servaddr.sin_addr = *addr;
+
+	if (connect(fd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	return fd;
+}
+
+/* the socket is blocking until the round is out, then non-blocking */
+static int pad_send(PAD_T *pad, int burst, int segment)
+{
+	uint8_t buf[MAX_BURST * 4];
+	int cnt, off, len, total = burst * 4;
+
+	for (cnt = 0; cnt < burst; cnt++) {
+		SET_CMD_FIELD(buf, cnt * 4, uint16_t, HSB_CMD_GET_DEVS);
+		SET_CMD_FIELD(buf, cnt * 4 + 2, uint16_t, 4);
+	}
+
+	fcntl(pad->fd, F_SETFL, fcntl(pad->fd, F_GETFL, 0) & ~O_NONBLOCK);
+
+	for (off = 0; off < total; off += len) {
+		len = segment ? 1 + rand() % 7 : total;
+		if (len > total - off)
+			len = total - off;
+
+		if (write(pad->fd, buf + off, len) != len)
+			return -1;
+
+		if (segment)
+			usleep(rand() % 200);
+	}
+
+	fcntl(pad->fd, F_SETFL, fcntl(pad->fd, F_GETFL, 0) | O_NONBLOCK);
+
+	pad->pending = burst;
+	pad->sent_us = now_us();
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct in_addr addr;
+	struct epoll_event ev, events[64];
+	int pad_num = 128, seconds = 10, interval_ms = 100, burst = 1, segment = 0;
+	int opt, epfd, cnt, nfds, connected = 0, served = 0, errors = 0;
+	int64_t start, end, now, *rtt;
+	long sent = 0, replies = 0, inflight = 0, nrtt = 0;
+	PAD_T *pads, *pad;
+
+	if (argc < 2 || !inet_aton(argv[1], &addr)) {
+		printf("usage: %s <box ip> [-n pads] [-t seconds] [-i interval ms] [-b burst] [-s]\n", argv[0]);
+		return -1;
+	}
+
+	optind = 2;
+	while ((opt = getopt(argc, argv, "n:t:i:b:s")) != -1) {
+		switch (opt) {
+			case 'n':
+				pad_num = atoi(optarg);
+				break;
+			case 't':
+				seconds = atoi(optarg);
+				break;
+			case 'i':
+				interval_ms = atoi(optarg);
+				break;
+			case 'b':
+				burst = atoi(optarg);
+				if (burst < 1)
+					burst = 1;
+				if (burst > MAX_BURST)
+					burst = MAX_BURST;
+				break;
+			case 's':
+				segment = 1;
+				break;
+			default:
+				break;
+		}
+	}
+
+	srand(time(NULL));
+
+	pads = calloc(pad_num, sizeof(PAD_T));
+	rtt = malloc(MAX_RTT_SAMPLE * sizeof(int64_t));
+	epfd = epoll_create(pad_num);
+	if (!pads || !rtt || epfd < 0)
+		return -1;
+
+	for (cnt = 0; cnt < pad_num; cnt++) {
+		pad = &pads[cnt];
+		pad->fd = pad_connect(&addr);
+		if (pad->fd < 0) {
+			printf("pad %d connect fail\n", cnt);
+			continue;
+		}
+
+		ev.events = EPOLLIN;
+		ev.data.ptr = pad;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, pad->fd, &ev);
+		connected++;
+	}
+
+	printf("%d/%d pads connected, running %ds\n", connected, pad_num, seconds);
+
+	start = now_us();
+	end = start + (int64_t)seconds * 1000000;
+
+	/* after the run, give the rounds in flight a second to finish */
+	while ((now = now_us()) < end || (inflight && now < end + 1000000)) {
+		for (cnt = 0; cnt < pad_num && now < end; cnt++) {
+			pad = &pads[cnt];
+			if (pad->fd < 0 || pad->sent_us || now < pad->next_us)
+				continue;
+
+			if (pad_send(pad, burst, segment)) {
+				errors++;
+				continue;
+			}
+			sent += burst;
+			inflight += burst;
+		}
+
+		nfds = epoll_wait(epfd, events, 64, 10);
+
+		for (cnt = 0; cnt < nfds; cnt++) {
+			int nread, off = 0;
+			uint16_t cmd, len;
+
+			pad = (PAD_T *)events[cnt].data.ptr;
+
+			nread = read(pad->fd, pad->rbuf + pad->rlen, sizeof(pad->rbuf) - pad->rlen);
+			if (nread <= 0) {
+				if (nread < 0 && errno == EAGAIN)
+					continue;
+
+				epoll_ctl(epfd, EPOLL_CTL_DEL, pad->fd, NULL);
+				close(pad->fd);
+				pad->fd = -1;
+				inflight -= pad->pending;
+				pad->pending = 0;
+				errors++;
+				continue;
+			}
+
+			pad->rlen += nread;
+
+			/* events and status updates share the stream, skip them */
+			while (pad->rlen - off >= 4) {
+				cmd = GET_CMD_FIELD(pad->rbuf, off, uint16_t);
+				len = GET_CMD_FIELD(pad->rbuf, off + 2, uint16_t);
+				if (len < 4) {
+					off = pad->rlen;
+					break;
+				}
+
+				if (pad->rlen - off < len)
+					break;
+
+				if (cmd == HSB_CMD_GET_DEVS_RESP && pad->pending) {
+					replies++;
+					inflight--;
+					if (0 == pad->replies++)
+						served++;
+
+					if (0 == --pad->pending) {
+						now = now_us();
+						if (nrtt < MAX_RTT_SAMPLE)
+							rtt[nrtt++] = now - pad->sent_us;
+
+						pad->sent_us = 0;
+						pad->next_us = now + interval_ms * 1000;
+					}
+				}
+
+				off += len;
+			}
+
+			memmove(pad->rbuf, pad->rbuf + off, pad->rlen - off);
+			pad->rlen -= off;
+		}
+	}
+
+	qsort(rtt, nrtt, sizeof(int64_t), cmp_rtt);
+
+	printf("requests %ld replies %ld unanswered %ld errors %d, %.1f req/s\n",
+		sent, replies, sent - replies, errors, replies * 1000000.0 / (end - start));
+	printf("pads served %d/%d\n", served, connected);
+
+	if (nrtt) {
+		printf("round rtt us: p50 %lld p90 %lld p99 %lld max %lld\n",
+			(long long)rtt[nrtt / 2],
+			(long long)rtt[nrtt * 9 / 10],
+			(long long)rtt[nrtt * 99 / 100],
+			(long long)rtt[nrtt - 1]);
+	}
+
+	for (cnt = 0; cnt < pad_num; cnt++) {
+		if (pads[cnt].fd >= 0)
+			close(pads[cnt].fd);
+	}
+
+	return 0;
+}
@@ -0,0 +1,250 @@
+/*
+ * Micro benchmark for the device registry lookups in core_daemon/device.c.
+ * The baseline find_dev() and find_dev_by_ip() walked gl_dev_cb.queue with
+ * g_queue_peek_nth(), which restarts from the head on every step, and a mac
+ * was matched by the same walk; the new ones are hash lookups. The new side
+ * links device.c and the rest of the core daemon but for its main loop and
+ * network.c, and registers its devices with register_dev(). The old walks
+ * are no longer in the tree and are kept below as they were, over a queue
+ * of the same devices in the same order.
+ *
+ * Both are run at 10, 100 and 1000 registered devices, first checked to
+ * find the same device for every id, mac and ip, then timed over random
+ * present and absent keys.
+ *
+ * usage: registry_bench [-n lookups]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <glib.h>
+#include "hsb_error.h"
+#include "debug.h"
+#include "../core_daemon/device.h"
+#include "../core_daemon/network.h"
+
+#define NOINLINE	__attribute__((noinline))
+#define CLOBBER(_p)	__asm__ volatile("" : : "r"(_p) : "memory")
+
+#define DEV_ID_SPAN	(2)	/* half of the looked up keys are not registered */
+#define BENCH_DRVID	(1)
+#define IDS_NUM		(4096)
+
+/* events of register_dev() end here, there are no clients */
+int notify_resp(HSB_RESP_T *resp, void *data)
+{
+	return HSB_E_OK;
+}
+
+/* gl_dev_cb.queue as the baseline kept it */
+static GQueue old_queue = G_QUEUE_INIT;
+
+static NOINLINE HSB_DEV_T *old_find_dev(uint32_t dev_id)
+{
+	guint len, id;
+	GQueue *queue = &old_queue;
+	HSB_DEV_T	*pdev = NULL;
+
+	len = g_queue_get_length(queue);
+	for (id = 0; id < len; id++) {
+		pdev = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
+		if (!pdev) {
+			hsb_critical("device null\n");
+			continue;
+		}
+
+		if (pdev->id == dev_id)
+			return pdev;
+	}
+
+	return NULL;
+}
+
+static NOINLINE HSB_DEV_T *old_find_dev_by_mac(uint32_t drvid, uint8_t *mac)
+{
+	guint len, id;
+	GQueue *queue = &old_queue;
+	HSB_DEV_T	*pdev = NULL;
+
+	len = g_queue_get_length(queue);
+	for (id = 0; id < len; id++) {
+		pdev = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
+		if (!pdev) {
+			hsb_critical("device null\n");
+			continue;
+		}
+
+		if (drvid == pdev->drvid &&
+		    0 == memcmp(pdev->info.mac, mac, 8))
+			return pdev;
+	}
+
+	return NULL;
+}
+
+static NOINLINE HSB_DEV_T *old_find_dev_by_ip(struct in_addr *ip)
+{
+	guint len, id;
+	GQueue *queue = &old_queue;
+	HSB_DEV_T	*pdev = NULL;
+
+	len = g_queue_get_length(queue);
+	for (id = 0; id < len; id++) {
+		pdev = (HSB_DEV_T *)g_queue_peek_nth(queue, id);
+		if (!pdev) {
+			hsb_critical("device null\n");
+			continue;
+		}
+
+		if (ip->s_addr == pdev->prty.ip.s_addr)
+			return pdev;
+	}
+
+	return NULL;
+}
+
+/* the lookup keys of device @devid, which may not be registered */
+static void _dev_mac(uint32_t devid, uint8_t *mac)
+{
+	memset(mac, 0, 8);
+	mac[0] = 0xAC;
+	mac[5] = (devid >> 16) & 0xFF;
+	mac[6] = (devid >> 8) & 0xFF;
+	mac[7] = devid & 0xFF;
+}
+
+static void _dev_ip(uint32_t devid, struct in_addr *ip)
+{
+	ip->s_addr = htonl(0x0A000000 | devid);
+}
+
+/* register devices up to @num, ids from 1 */
+static int setup(int num)
+{
+	HSB_DEV_T *pdev;
+	uint32_t devid;
+
+	for (devid = g_queue_get_length(&old_queue) + 1; devid <= (uint32_t)num; devid++) {
+		pdev = alloc_dev(devid);
+		if (!pdev)
+			return printf("alloc dev %u fail\n", devid);
+
+		pdev->drvid = BENCH_DRVID;
+		_dev_mac(devid, pdev->info.mac);
+		_dev_ip(devid, &pdev->prty.ip);
+
+		/* out of every work mode, so no linkage runs on its events */
+		pdev->work_mode = 0;
+
+		register_dev(pdev);
+		g_queue_push_tail(&old_queue, pdev);
+	}
+
+	return 0;
+}
+
+static int check_same(int num)
+{
+	struct in_addr ip;
+	uint8_t mac[8];
+	uint32_t id;
+
+	for (id = 1; id <= (uint32_t)num * DEV_ID_SPAN; id++) {
+		_dev_mac(id, mac);
+		_dev_ip(id, &ip);
+
+		if (old_find_dev(id) != find_dev(id) ||
+		    old_find_dev_by_mac(BENCH_DRVID, mac) != find_dev_by_mac(BENCH_DRVID, mac) ||
+		    old_find_dev_by_ip(&ip) != find_dev_by_ip(&ip))
+			return printf("lookup of %u differs at %d devices\n", id, num);
+
+		if ((id <= (uint32_t)num) != (find_dev(id) != NULL))
+			return printf("device %u not registered right\n", id);
+	}
+
+	return 0;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#define BENCH(_name, _num, _iter, _expr)	do { \
+	int64_t _start = now_ns(); \
+	long _it; \
+	for (_it = 0; _it < (_iter); _it++) { \
+		int _idx = _it & (IDS_NUM - 1); \
+		HSB_DEV_T *_pdev = _expr; \
+		CLOBBER(_pdev); \
+	} \
+	printf("%-16s %5d devices %12.1f ns\n", _name, _num, \
+		(double)(now_ns() - _start) / (_iter)); \
+} while (0)
+
+int main(int argc, char *argv[])
+{
+	static const int nums[] = { 10, 100, 1000 };
+	static uint32_t ids[IDS_NUM];
+	static uint8_t macs[IDS_NUM][8];
+	static struct in_addr ips[IDS_NUM];
+	long iter = 20000000, old_iter;
+	int opt, cnt, round;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n':
+				iter = atol(optarg);
+				break;
+			default:
+				break;
+		}
+	}
+
+	srand(1);
+
+	init_dev_registry();
+
+	for (cnt = 0; cnt < (int)(sizeof(nums) / sizeof(nums[0])); cnt++) {
+		if (setup(nums[cnt]))
+			return -1;
+
+		if (check_same(nums[cnt]))
+			return -1;
+
+		for (opt = 0; opt < IDS_NUM; opt++) {
+			ids[opt] = rand() % (nums[cnt] * DEV_ID_SPAN) + 1;
+			_dev_mac(ids[opt], macs[opt]);
+			_dev_ip(ids[opt], &ips[opt]);
+		}
+
+		/* the old walk is quadratic, keep its run time in check */
+		old_iter = iter / ((long)nums[cnt] * nums[cnt] / 10 + 1);
+		if (old_iter < IDS_NUM)
+			old_iter = IDS_NUM;
+
+		/* two rounds, the first one warms up caches and clocks */
+		for (round = 0; round < 2; round++) {
+			BENCH("old find_dev", nums[cnt], old_iter, old_find_dev(ids[_idx]));
+			BENCH("new find_dev", nums[cnt], iter, find_dev(ids[_idx]));
+			BENCH("old by_mac", nums[cnt], old_iter,
+			      old_find_dev_by_mac(BENCH_DRVID, macs[_idx]));
+			BENCH("new by_mac", nums[cnt], iter,
+			      find_dev_by_mac(BENCH_DRVID, macs[_idx]));
+			BENCH("old by_ip", nums[cnt], old_iter, old_find_dev_by_ip(&ips[_idx]));
+			BENCH("new by_ip", nums[cnt], iter, find_dev_by_ip(&ips[_idx]));
+		}
+	}
+
+	printf("old and new find the same devices\n");
+
+	return 0;
+}
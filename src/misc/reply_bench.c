@@ -0,0 +1,379 @@
+/*
+ * Socketpair benchmark for the reply path of core_daemon/network.c, which
+ * is built into this bench so its static helpers can be called. The new
+ * path is the reactor's own: _process_client_read() hands each frame to
+ * deal_tcp_packet(), which builds the reply in place with _reply_room()
+ * and _reply_commit(), and _client_flush() sends the batch. The old path
+ * is no longer in the tree and is kept below as it was: each reply was
+ * built in a zeroed buffer on the stack and copied into the client output
+ * buffer with _client_write().
+ *
+ * A client writes bursts of GET_TIMER requests with a req id trailer for a
+ * registered device, half of them for slots it does not have, so both
+ * timer and RESULT replies are built by the real handlers. Both paths are
+ * first checked to send the same bytes, then timed. The server time per
+ * command and the end to end rate are reported.
+ *
+ * usage: reply_bench [-b burst] [-n bursts]
+ */
+#include "../core_daemon/network.c"
+
+#define REQ_LEN			(HSB_MSG_DEV_ITEM_LEN + 4)	/* with the req id */
+#define BURST_MAX		(1024)
+#define SOCK_BUF_SIZE		(1024 * 1024)
+#define BENCH_DEVID		(1)
+
+/* the old path, a copy of the built reply per command */
+static int old_client_write(void *reply, const void *buf, int len)
+{
+	tcp_client_context *pctx = (tcp_client_context *)reply;
+	uint8_t *ptr;
+
+	if (!pctx)
+		return -1;
+
+	ptr = _obuf_reserve(pctx, len + 8);
+	if (!ptr)
+		return -1;
+
+	memcpy(ptr, buf, len);
+	len = _put_trailer(pctx, ptr, len, 0, get_act_req_id());
+	pctx->otail += len;
+	net_stats.msgs++;
+
+	return len;
+}
+
+static int old_deal_tcp_packet(int fd, uint8_t *buf, int len, void *reply, int *used)
+{
+	const tcp_cmd_entry *entry;
+	uint8_t reply_buf[REPLY_BUF_SIZE];
+	uint16_t cmd, cmdlen;
+	int rlen;
+
+	if (check_tcp_pkt_valid(buf, len)) {
+		hsb_debug("tcp pkt invalid, len=%d\n", len);
+		*used = len;
+		return -1;
+	}
+
+	cmd = GET_CMD_FIELD(buf, 0, uint16_t);
+	cmdlen = GET_CMD_FIELD(buf, 2, uint16_t);
+	memset(reply_buf, 0, sizeof(reply_buf));
+
+	*used = cmdlen;
+
+	entry = _cmd_entry(cmd);
+	if (!entry)
+		rlen = _reply_result(reply_buf, REPLY_FAIL, 0, cmd);
+	else if (cmdlen < entry->min_len)
+		rlen = _reply_result(reply_buf, HSB_E_BAD_PARAM, 0, cmd);
+	else
+		rlen = entry->handler(cmd, buf, cmdlen, reply, reply_buf);
+
+	if (rlen < 0) {
+		hsb_debug("rlen %d<0\n", rlen);
+		return -2;
+	}
+
+	if (rlen > 0)
+		old_client_write(reply, reply_buf, rlen);
+
+	/* the reply comes later through notify_resp */
+	if (0 == rlen && entry && entry->async)
+		return 1;
+
+	return 0;
+}
+
+static void old_deal_client_frame(tcp_client_context *pctx, uint8_t *buf, int len)
+{
+	uint8_t reply_buf[16];
+	uint32_t req_id = 0;
+	uint16_t cmd = GET_CMD_FIELD(buf, 0, uint16_t);
+	int used = 0;
+
+	/* take the request id off so the handlers see the plain frame */
+	if ((pctx->features & HSB_FEATURE_REQ_ID) && len >= 8) {
+		len -= 4;
+		req_id = GET_CMD_FIELD(buf, len, uint32_t);
+		SET_CMD_FIELD(buf, 2, uint16_t, len);
+	}
+
+	set_act_req(req_id, pctx->gen);
+
+	if (_cmd_is_async(cmd) && pctx->inflight >= CLIENT_MAX_INFLIGHT) {
+		net_stats.busy++;
+		old_client_write(pctx, reply_buf,
+			_reply_result(reply_buf, HSB_E_BUSY, 0, cmd));
+	} else if (old_deal_tcp_packet(pctx->tcp_sockfd, buf, len, pctx, &used) > 0) {
+		pctx->inflight++;
+	}
+
+	set_act_req(0, 0);
+}
+
+/* _process_client_read() and _process_client_frames() on the old path */
+static int old_process_client_read(tcp_client_context *pctx)
+{
+	int nread, off;
+	uint16_t cmdlen;
+
+	while (1) {
+		nread = read(pctx->tcp_sockfd, pctx->ibuf + pctx->ilen,
+				CLIENT_IBUF_SIZE - pctx->ilen);
+		if (nread == 0)
+			return -1;
+
+		if (nread < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			return -1;
+		}
+
+		pctx->ilen += nread;
+
+		for (off = 0; pctx->ilen - off >= 4; off += cmdlen) {
+			cmdlen = GET_CMD_FIELD(pctx->ibuf, off + 2, uint16_t);
+			if (cmdlen < 4 || cmdlen > CLIENT_IBUF_SIZE)
+				return -1;
+
+			if (pctx->ilen - off < cmdlen)
+				break;
+
+			old_deal_client_frame(pctx, pctx->ibuf + off, cmdlen);
+			net_stats.frames++;
+		}
+
+		if (off < pctx->ilen && off)
+			memmove(pctx->ibuf, pctx->ibuf + off, pctx->ilen - off);
+
+		pctx->ilen -= off;
+	}
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* a device with every timer slot set, the GET_TIMER handler reads them */
+static int _setup_dev(void)
+{
+	HSB_DEV_T *pdev;
+	int id;
+
+	init_dev_registry();
+	init_linkage();
+
+	pdev = alloc_dev(BENCH_DEVID);
+	if (!pdev)
+		return -1;
+
+	for (id = 0; id < HSB_DEV_MAX_TIMER_NUM; id++) {
+		pdev->timer[id].id = id;
+		pdev->timer[id].work_mode = 0xFF;
+		pdev->timer[id].flag = 0x2;
+		pdev->timer[id].hour = 7;
+		pdev->timer[id].wday = 0x7F;
+		pdev->timer[id].act_param2 = 99;
+	}
+
+	return register_dev(pdev);
+}
+
+/* slots from HSB_DEV_MAX_TIMER_NUM up get a RESULT */
+static int _make_burst(uint8_t *buf, int burst, uint32_t round)
+{
+	int cnt, off = 0;
+
+	for (cnt = 0; cnt < burst; cnt++, off += REQ_LEN) {
+		SET_CMD_FIELD(buf, off, uint16_t, HSB_CMD_GET_TIMER);
+		SET_CMD_FIELD(buf, off + 2, uint16_t, REQ_LEN);
+		SET_CMD_FIELD(buf, off + 4, uint32_t, BENCH_DEVID);
+		SET_CMD_FIELD(buf, off + 8, uint16_t, cnt % (HSB_DEV_MAX_TIMER_NUM * 2));
+		SET_CMD_FIELD(buf, off + 10, uint32_t, round * BURST_MAX + cnt + 1);
+	}
+
+	return off;
+}
+
+/* one burst through the server side, returns the server time in ns */
+static int64_t _serve(tcp_client_context *pctx, int use_new)
+{
+	int64_t start = now_ns();
+
+	if (use_new)
+		_process_client_read(pctx);
+	else
+		old_process_client_read(pctx);
+
+	_client_flush(pctx);
+
+	return now_ns() - start;
+}
+
+static int _open_pair(int sv[2], tcp_client_context *pctx)
+{
+	int size = SOCK_BUF_SIZE;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		perror("socketpair");
+		return -1;
+	}
+
+	setsockopt(sv[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	set_nonblock(sv[1]);
+
+	memset(pctx, 0, sizeof(*pctx));
+	pctx->tcp_sockfd = sv[1];
+	pctx->using = 1;
+	pctx->features = HSB_FEATURE_REQ_ID;
+	pctx->ibuf = g_malloc(CLIENT_IBUF_SIZE);
+	pctx->obuf = g_malloc(CLIENT_OBUF_INIT);
+	pctx->osize = CLIENT_OBUF_INIT;
+
+	return 0;
+}
+
+static void _close_pair(int sv[2], tcp_client_context *pctx)
+{
+	close(sv[0]);
+	close(sv[1]);
+	g_free(pctx->ibuf);
+	g_free(pctx->obuf);
+}
+
+/* read until the replies to a whole burst are in */
+static int _read_replies(int fd, uint8_t *buf, int size, int burst)
+{
+	int len = 0, off = 0, cnt = 0, nread;
+
+	while (cnt < burst) {
+		nread = read(fd, buf + len, size - len);
+		if (nread <= 0)
+			return -1;
+
+		len += nread;
+
+		while (off + 4 <= len && off + GET_CMD_FIELD(buf, off + 2, uint16_t) <= len) {
+			off += GET_CMD_FIELD(buf, off + 2, uint16_t);
+			cnt++;
+		}
+	}
+
+	return len;
+}
+
+/* both paths must put the same bytes on the wire */
+static int check_same(int burst)
+{
+	static uint8_t cbuf[BURST_MAX * REQ_LEN];
+	static uint8_t rbuf[2][BURST_MAX * 64];
+	tcp_client_context ctx;
+	int sv[2], use_new, len, rlen[2];
+
+	for (use_new = 0; use_new < 2; use_new++) {
+		if (_open_pair(sv, &ctx))
+			return -1;
+
+		len = _make_burst(cbuf, burst, 1);
+		if (write(sv[0], cbuf, len) != len)
+			return printf("short write\n");
+
+		_serve(&ctx, use_new);
+		rlen[use_new] = _read_replies(sv[0], rbuf[use_new], sizeof(rbuf[0]), burst);
+
+		_close_pair(sv, &ctx);
+	}
+
+	if (rlen[0] != rlen[1] || memcmp(rbuf[0], rbuf[1], rlen[0]))
+		return printf("old and new replies differ\n");
+
+	return 0;
+}
+
+static void bench(int burst, long bursts, int use_new)
+{
+	static uint8_t cbuf[BURST_MAX * REQ_LEN];
+	static uint8_t rbuf[BURST_MAX * 64];
+	int64_t start, server = 0, total;
+	tcp_client_context ctx;
+	int sv[2], len;
+	long round, cmds = 0;
+
+	if (_open_pair(sv, &ctx))
+		return;
+
+	start = now_ns();
+
+	for (round = 0; round < bursts; round++) {
+		len = _make_burst(cbuf, burst, round);
+		if (write(sv[0], cbuf, len) != len)
+			break;
+
+		server += _serve(&ctx, use_new);
+
+		if (_read_replies(sv[0], rbuf, sizeof(rbuf), burst) < 0)
+			break;
+
+		cmds += burst;
+	}
+
+	total = now_ns() - start;
+
+	printf("%-4s burst %4d: server %6.1f ns/cmd (%6.2f M cmds/s), "
+	       "end to end %5.2f M cmds/s\n", use_new ? "new" : "old", burst,
+	       (double)server / cmds, cmds * 1e3 / server, cmds * 1e3 / total);
+
+	_close_pair(sv, &ctx);
+}
+
+int main(int argc, char *argv[])
+{
+	int burst = 32, opt, round;
+	long bursts = 300000;
+
+	while ((opt = getopt(argc, argv, "b:n:")) != -1) {
+		switch (opt) {
+			case 'b':
+				burst = atoi(optarg);
+				break;
+			case 'n':
+				bursts = atol(optarg);
+				break;
+			default:
+				break;
+		}
+	}
+
+	if (burst < 1 || burst > BURST_MAX) {
+		printf("burst must be 1 to %d\n", BURST_MAX);
+		return -1;
+	}
+
+	if (_setup_dev()) {
+		printf("register device fail\n");
+		return -1;
+	}
+
+	if (check_same(burst))
+		return -1;
+
+	/* two rounds, the first one warms up caches and clocks */
+	for (round = 0; round < 2; round++) {
+		bench(burst, bursts, 0);
+		bench(burst, bursts, 1);
+	}
+
+	printf("old and new send the same replies\n");
+
+	return 0;
+}
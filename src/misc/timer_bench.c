@@ -0,0 +1,373 @@
+/*
+ * Micro benchmark for the device timer scheduler in core_daemon/timer_sched.c
+ * against the per second scan of every device timer it replaced in
+ * device.c. The new side links timer_sched.c as is; the old scan is no
+ * longer in the tree and is kept below as it was. Both sides are first run
+ * through one simulated day with the same timers and checked to fire each
+ * of them at the same second, then timed with 10000 daily timers (-t to
+ * change).
+ *
+ * The old scan ran once a second whether anything was due or not, the heap
+ * only wakes the main loop when its top is due, so the per day cost is
+ * 86400 scans against one pop and reschedule per fire. A thread listens on
+ * the core daemon unix path in the current directory to take the wake ups,
+ * as the main loop does.
+ *
+ * usage: timer_bench [-t timers] [-n iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <glib.h>
+#include "hsb_config.h"
+#include "unix_socket.h"
+#include "../core_daemon/device.h"
+#include "../core_daemon/timer_sched.h"
+
+#define NOINLINE	__attribute__((noinline))
+#define CLOBBER(_p)	__asm__ volatile("" : : "r"(_p) : "memory")
+
+#define CHECK_TIMER_NUM		(320)
+#define DAY_SEC			(86400)
+
+static HSB_DEV_T *devs;
+static int dev_num;
+
+/* second of the simulated day each timer fired at, -1 for not yet */
+static int *fired_old, *fired_new;
+static time_t day_start;
+
+static int wake_fd = -1;
+static volatile long wakes;
+
+/* the old per second scan from device.c, with time(NULL) passed in */
+static uint32_t gl_sec_today;
+static int gl_work_mode = 0;
+
+static int compare_date(HSB_TIMER_T *ptimer, struct tm *tm_now)
+{
+	if (ptimer->year == 0 &&
+		ptimer->mon == 0 &&
+		ptimer->mday == 0)
+	{
+		return -1;
+	}
+
+	if (tm_now->tm_year == ptimer->year &&
+		tm_now->tm_mon == ptimer->mon &&
+		tm_now->tm_mday == ptimer->mday)
+	{
+		return 0;
+	}
+
+	return 1;
+}
+
+static void old_check_dev(HSB_DEV_T *pdev, time_t now, int *fired)
+{
+	int work_mode = gl_work_mode;
+	struct tm tm_now;
+	localtime_r(&now, &tm_now);
+	uint32_t sec_today = tm_now.tm_hour * 3600 + tm_now.tm_min * 60 + tm_now.tm_sec;
+	uint32_t sec_timer;
+	int cnt, ret;
+	uint8_t flag, weekday;
+	HSB_TIMER_T *ptimer = pdev->timer;
+	HSB_TIMER_STATUS_T *tstatus = pdev->timer_status;
+
+	if (sec_today < gl_sec_today && sec_today < 10) {
+		for (cnt = 0; cnt < HSB_DEV_MAX_TIMER_NUM; cnt++, ptimer++, tstatus++) {
+			flag = ptimer->flag;
+			if (!CHECK_BIT(flag, 1))
+				continue;
+
+			ret = compare_date(ptimer, &tm_now);
+			if (0 == ret) {
+				tstatus->expired = false;
+			} else if (1 == ret) {
+				tstatus->expired = true;
+			} else if (-1 == ret) {
+				weekday = ptimer->wday;
+				if (!CHECK_BIT(weekday, tm_now.tm_wday))
+					tstatus->expired = true;
+				else
+					tstatus->expired = false;
+			}
+		}
+	}
+
+	gl_sec_today = sec_today;
+
+	if (!CHECK_BIT(pdev->work_mode, work_mode))
+		return;
+
+	ptimer = pdev->timer;
+	tstatus = pdev->timer_status;
+
+	for (cnt = 0; cnt < HSB_DEV_MAX_TIMER_NUM; cnt++, ptimer++, tstatus++) {
+		flag = ptimer->flag;
+		if (!CHECK_BIT(flag, 1) || tstatus->expired)
+			continue;
+
+		if (!CHECK_BIT(ptimer->work_mode, work_mode))
+			continue;
+
+		weekday = ptimer->wday;
+		ret = compare_date(ptimer, &tm_now);
+
+		if (-1 == ret) {
+			if (!CHECK_BIT(weekday, tm_now.tm_wday)) {
+				continue;
+			}
+		} else if (1 == ret) {
+			tstatus->expired = true;
+			continue;
+		}
+
+		sec_timer = ptimer->hour * 3600 + ptimer->min * 60 + ptimer->sec;
+
+		if (sec_timer > sec_today || sec_today - sec_timer > 5)
+			continue;
+
+		if (fired)
+			fired[pdev->id * HSB_DEV_MAX_TIMER_NUM + cnt] = (int)(now - day_start);
+
+		if (CHECK_BIT(weekday, 7)) {
+			tstatus->active = false;
+			tstatus->expired = true;
+			continue;
+		}
+
+		tstatus->expired = true;
+	}
+}
+
+static NOINLINE void old_tick(time_t now, int *fired)
+{
+	int cnt;
+
+	for (cnt = 0; cnt < dev_num; cnt++)
+		old_check_dev(&devs[cnt], now, fired);
+}
+
+/* take the wake ups timer_sched_set() sends to the main loop */
+static void *_wake_thread(void *arg)
+{
+	char buf[16];
+
+	while (recv(wake_fd, buf, sizeof(buf), 0) > 0)
+		wakes++;
+
+	return NULL;
+}
+
+/*
+ * What the main loop does on a wake up: fire and reschedule what is due.
+ * Every timer here is daily, so the next fire is a day later, as
+ * _timer_next_fire() in device.c gives away from a DST change.
+ */
+static NOINLINE int new_tick(time_t now, int *fired)
+{
+	uint32_t devid;
+	HSB_SCHED_TYPE_T type;
+	uint16_t id;
+	time_t fire_tm;
+	int cnt = 0;
+
+	while (HSB_E_OK == timer_sched_pop(now, &devid, &type, &id, &fire_tm)) {
+		if (fired)
+			fired[devid * HSB_DEV_MAX_TIMER_NUM + id] = (int)(now - day_start);
+
+		timer_sched_set(devid, type, id, fire_tm + DAY_SEC);
+		cnt++;
+	}
+
+	return cnt;
+}
+
+static void setup(int timers)
+{
+	struct tm tm;
+	time_t now = time(NULL);
+	HSB_DEV_T *pdev;
+	HSB_TIMER_T *ptimer;
+	int cnt;
+
+	localtime_r(&now, &tm);
+	tm.tm_hour = 0;
+	tm.tm_min = 0;
+	tm.tm_sec = 0;
+	tm.tm_isdst = -1;
+	day_start = mktime(&tm);
+
+	dev_num = (timers + HSB_DEV_MAX_TIMER_NUM - 1) / HSB_DEV_MAX_TIMER_NUM;
+	devs = calloc(dev_num, sizeof(HSB_DEV_T));
+
+	gl_sec_today = 0;
+
+	/* daily timers, active, clear of the first seconds of the day */
+	for (cnt = 0; cnt < timers; cnt++) {
+		int sec = 10 + rand() % (DAY_SEC - 20);
+
+		pdev = &devs[cnt / HSB_DEV_MAX_TIMER_NUM];
+		pdev->id = cnt / HSB_DEV_MAX_TIMER_NUM;
+		pdev->work_mode = 0xFF;
+
+		ptimer = &pdev->timer[cnt % HSB_DEV_MAX_TIMER_NUM];
+		ptimer->id = cnt % HSB_DEV_MAX_TIMER_NUM;
+		ptimer->flag = 0x2;
+		ptimer->work_mode = 0xFF;
+		ptimer->wday = 0x7F;
+		ptimer->hour = sec / 3600;
+		ptimer->min = (sec / 60) % 60;
+		ptimer->sec = sec % 60;
+
+		pdev->timer_status[ptimer->id].active = true;
+
+		timer_sched_set(pdev->id, HSB_SCHED_TYPE_TIMER, ptimer->id,
+				day_start + sec);
+	}
+}
+
+static void teardown(void)
+{
+	uint32_t devid;
+	HSB_SCHED_TYPE_T type;
+	uint16_t id;
+	time_t fire_tm;
+
+	while (HSB_E_OK == timer_sched_pop(day_start + 1000 * DAY_SEC,
+					   &devid, &type, &id, &fire_tm))
+		;
+
+	free(devs);
+}
+
+/* one simulated day at one second steps, both must fire the same */
+static int check_same(void)
+{
+	int cnt, sec;
+
+	setup(CHECK_TIMER_NUM);
+
+	fired_old = malloc(sizeof(int) * dev_num * HSB_DEV_MAX_TIMER_NUM);
+	fired_new = malloc(sizeof(int) * dev_num * HSB_DEV_MAX_TIMER_NUM);
+	memset(fired_old, 0xFF, sizeof(int) * dev_num * HSB_DEV_MAX_TIMER_NUM);
+	memset(fired_new, 0xFF, sizeof(int) * dev_num * HSB_DEV_MAX_TIMER_NUM);
+
+	for (sec = 0; sec < DAY_SEC; sec++) {
+		old_tick(day_start + sec, fired_old);
+		new_tick(day_start + sec, fired_new);
+	}
+
+	for (cnt = 0; cnt < CHECK_TIMER_NUM; cnt++) {
+		if (fired_old[cnt] < 0 || fired_old[cnt] != fired_new[cnt])
+			return printf("timer %d fired at %d and %d\n",
+				      cnt, fired_old[cnt], fired_new[cnt]);
+	}
+
+	free(fired_old);
+	free(fired_new);
+	teardown();
+
+	return 0;
+}
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+	int timers = 10000;
+	long iter = 200, fires, it;
+	int64_t start;
+	double old_ns, idle_ns, fire_ns;
+	int opt, round, ret = 0;
+	pthread_t thread;
+
+	while ((opt = getopt(argc, argv, "t:n:")) != -1) {
+		switch (opt) {
+			case 't':
+				timers = atoi(optarg);
+				break;
+			case 'n':
+				iter = atol(optarg);
+				break;
+			default:
+				break;
+		}
+	}
+
+	wake_fd = unix_socket_new_listen(hsb_core_daemon_config.unix_listen_path);
+	if (wake_fd < 0) {
+		printf("listen on %s fail\n", hsb_core_daemon_config.unix_listen_path);
+		return -1;
+	}
+
+	pthread_create(&thread, NULL, _wake_thread, NULL);
+
+	init_timer_sched();
+
+	srand(1);
+
+	if (check_same()) {
+		ret = -1;
+		goto out;
+	}
+
+	printf("old and new fire the same timers at the same second\n");
+
+	setup(timers);
+
+	/* two rounds, the first one warms up caches and clocks */
+	for (round = 0; round < 2; round++) {
+		printf("round %d, %d timers\n", round, timers);
+
+		/* a scan in the middle of the day, where most timers are checked */
+		start = now_ns();
+		for (it = 0; it < iter; it++)
+			old_tick(day_start + DAY_SEC / 2, NULL);
+		old_ns = (double)(now_ns() - start) / iter;
+
+		/* a wake up with nothing due, just the heap top */
+		start = now_ns();
+		for (it = 0; it < iter * 1000; it++) {
+			opt = new_tick(day_start - 1, NULL);
+			CLOBBER(&opt);
+		}
+		idle_ns = (double)(now_ns() - start) / (iter * 1000);
+
+		/* a whole day of fires, each popped and pushed back a day later */
+		wakes = 0;
+		start = now_ns();
+		fires = new_tick(day_start + DAY_SEC * (round + 1), NULL);
+		fire_ns = fires ? (double)(now_ns() - start) / fires : 0;
+
+		printf("old scan             %12.0f ns per second\n", old_ns);
+		printf("new idle wake up     %12.1f ns\n", idle_ns);
+		printf("new fire             %12.1f ns, %ld fired, %ld wake ups\n",
+		       fire_ns, fires, wakes);
+		printf("per day: old %.1f ms, new %.1f ms\n",
+		       old_ns * DAY_SEC / 1e6, (fire_ns * fires + idle_ns * fires) / 1e6);
+	}
+
+	teardown();
+
+out:
+	unix_socket_free(wake_fd);
+	unlink(hsb_core_daemon_config.unix_listen_path);
+
+	return ret;
+}